@@ -4,7 +4,9 @@ uniform sampler2D searchTex;
 varying vec4 offset1;
 varying vec4 offset2;
 varying vec4 offset3;
-#define SMAA_PIXEL_SIZE vec2(1.0/1920.0, 1.0/1080.0)
+uniform float viewportWidth;
+uniform float viewportHeight;
+#define SMAA_PIXEL_SIZE vec2(1.0/viewportWidth, 1.0/viewportHeight)
 #define SMAA_AREATEX_PIXEL_SIZE (1.0 / vec2(160.0, 560.0))
 #define SMAA_AREATEX_SUBTEX_SIZE (1.0 / 7.0)
 #define SMAA_AREATEX_MAX_DISTANCE_DIAG 20
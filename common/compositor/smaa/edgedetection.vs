@@ -1,7 +1,9 @@
 varying vec4 offset1;
 varying vec4 offset2;
 varying vec4 offset3;
-#define SMAA_PIXEL_SIZE vec2(1.0/1920.0, 1.0/1080.0)
+uniform float viewportWidth;
+uniform float viewportHeight;
+#define SMAA_PIXEL_SIZE vec2(1.0/viewportWidth, 1.0/viewportHeight)
 
 void main()
 {
@@ -2,7 +2,9 @@ uniform sampler2D sceneTex;
 uniform sampler2D smaaTex;
 
 varying vec4 offset;
-#define SMAA_PIXEL_SIZE vec2(1.0/1920.0, 1.0/1080.0)
+uniform float viewportWidth;
+uniform float viewportHeight;
+#define SMAA_PIXEL_SIZE vec2(1.0/viewportWidth, 1.0/viewportHeight)
 
 //-----------------------------------------------------------------------------
 // Neighborhood Blending Pixel Shader (Third Pass)
@@ -101,5 +101,12 @@ void main (void)
 {
 	SurfaceData sd = getSurfaceData();
 	LitSurfaceData lsd = computeLighting(sd);
-    gl_FragColor = lsd.luminance; 
+	
+	// Eye space normal and linear depth, for the normal/depth fragment output.
+	// Compiled out when the fragment output does not use them.
+	vec3 eyeNormal = normalize(sd.normal);
+	if(!gl_FrontFacing) eyeNormal = -eyeNormal;
+	vec4 normalDepth = vec4(eyeNormal, -var_EyeVector.z);
+	
+	@fragmentOutputSection
 }
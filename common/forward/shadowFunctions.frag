@@ -53,4 +53,99 @@ float computeSoftShadowMap(sampler2DShadow shadowTexture, vec4 sceneShadowProj,
 	} 
 	return shadow;
 	//return shadow2DProj(shadowTexture, sceneShadowProj).x;
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Filterable (exponential variance) shadow maps: the shadow texture stores the
+// first two moments of the warped caster depth (exp(exponent * depth), or 
+// depth when exponent is 0), blurred and mipmapped, so a single filtered 
+// lookup gives a soft shadow.
+float computeVarianceShadowMap(sampler2D shadowTexture, vec4 sceneShadowProj, float exponent)
+{
+	vec3 smCoord = sceneShadowProj.xyz / sceneShadowProj.w;
+	// Sample before branching, so mipmap selection uses valid derivatives.
+	vec2 moments = texture2D(shadowTexture, smCoord.xy).xy;
+	
+	// Fragments outside the shadow map are not shadowed.
+	if(any(lessThan(smCoord, vec3(0.0))) || any(greaterThan(smCoord, vec3(1.0)))) return 1.0;
+	
+	float d = exponent > 0.0 ? exp(exponent * smCoord.z) : smCoord.z;
+	if(d <= moments.x) return 1.0;
+	
+	// Chebyshev upper bound. The minimum variance limits shadow acne, and 
+	// rescaling the bound reduces light bleeding.
+	float variance = max(moments.y - moments.x * moments.x, 0.0001 * moments.x * moments.x);
+	float delta = d - moments.x;
+	float p = variance / (variance + delta * delta);
+	return clamp((p - 0.2) / 0.8, 0.0, 1.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Cube shadow maps for point lights: pick the face along the major axis of 
+// the light to fragment direction. position is the fragment position relative
+// to the light. Faces are stored in a 3x2 grid, and each face matrix maps 
+// positions to [0,1] within its face. Positions outside the face have no 
+// casters, and are lit. Depth is clamped instead: fragments past the face far
+// plane are still behind every caster in the face.
+float computeCubeShadowMap(sampler2DShadow shadowTexture, vec4 position, mat4 faceMatrices[6])
+{
+	vec3 dir = position.xyz;
+	vec3 a = abs(dir);
+	int face;
+	if(a.x >= a.y && a.x >= a.z) face = dir.x > 0.0 ? 0 : 1;
+	else if(a.y >= a.z) face = dir.y > 0.0 ? 2 : 3;
+	else face = dir.z > 0.0 ? 4 : 5;
+	
+	vec4 smCoord = faceMatrices[face] * vec4(position.xyz, 1.0);
+	smCoord.xyz /= smCoord.w;
+	if(any(lessThan(smCoord.xy, vec2(0.0))) || any(greaterThan(smCoord.xy, vec2(1.0)))) return 1.0;
+	
+	vec2 cell = vec2(mod(float(face), 3.0), floor(float(face) / 3.0));
+	return shadow2D(shadowTexture, vec3((cell + smCoord.xy) / vec2(3.0, 2.0), clamp(smCoord.z, 0.0, 1.0))).x;
+}
+
+#ifdef CASCADED_SHADOWS
+///////////////////////////////////////////////////////////////////////////////
+// Cascaded shadow maps: select the first (smallest) cascade containing the 
+// fragment, and sample the corresponding texture array layer. position is the
+// fragment position relative to the cascades origin.
+float computeCascadedShadowMap(sampler2DArrayShadow shadowTexture, vec4 position, mat4 cascadeMatrices[4], float numCascades)
+{
+	for(int i = 0; i < 4; i++)
+	{
+		if(float(i) >= numCascades) break;
+		vec4 smCoord = cascadeMatrices[i] * vec4(position.xyz, 1.0);
+		if(all(greaterThan(smCoord.xy, vec2(0.0))) && all(lessThan(smCoord.xy, vec2(1.0))))
+		{
+			return shadow2DArray(shadowTexture, vec4(smCoord.xy, float(i), clamp(smCoord.z, 0.0, 1.0))).x;
+		}
+	}
+	// Fragments past the last cascade are not shadowed.
+	return 1.0;
+}
+#endif
+
+#ifdef SHADOW_ATLAS
+///////////////////////////////////////////////////////////////////////////////
+// Shadow atlas: all shadow maps of a layer share a single depth texture. Each
+// slot has a matrix taking scene positions to its light frustum, and a 
+// rectangle (offset, size) in atlas texture space. Fragments outside the light
+// frustum are lit, so they never sample the rectangle of another light. Unused
+// slots map to depth 0, so they are always lit. The array sizes are 
+// ShaderManager::MaxLights.
+uniform sampler2DShadow shadowAtlas;
+uniform mat4 shadowAtlasMatrices[8];
+uniform vec4 shadowAtlasRects[8];
+varying vec4 var_ShadowAtlasPosition;
+
+float computeAtlasShadowMap(int slot)
+{
+	vec4 smCoord = shadowAtlasMatrices[slot] * vec4(var_ShadowAtlasPosition.xyz, 1.0);
+	if(smCoord.w <= 0.0) return 1.0;
+	smCoord.xyz /= smCoord.w;
+	if(any(lessThan(smCoord.xy, vec2(0.0))) || any(greaterThan(smCoord.xy, vec2(1.0)))) return 1.0;
+	
+	vec4 rect = shadowAtlasRects[slot];
+	return shadow2D(shadowAtlas, vec3(rect.xy + smCoord.xy * rect.zw, clamp(smCoord.z, 0.0, 1.0))).x;
+}
+#endif
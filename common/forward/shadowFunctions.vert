@@ -1,3 +1,6 @@
+#ifdef SHADOW_ATLAS
+varying vec4 var_ShadowAtlasPosition;
+#endif
 ///////////////////////////////////////////////////////////////////////////////
 $@vertexShadowSection
 {
@@ -6,4 +9,16 @@ $@vertexShadowSection
     gl_TexCoord[@shadowUnit].p = dot( eyeSpacePosition, gl_EyePlaneR[@shadowUnit] );
     gl_TexCoord[@shadowUnit].q = dot( eyeSpacePosition, gl_EyePlaneQ[@shadowUnit] );
 }
-$
\ No newline at end of file
+$
+///////////////////////////////////////////////////////////////////////////////
+// Shadow atlas lookups also happen in the fragment shader, using the scene 
+// position given by the eye planes of the atlas position unit. This section is
+// added once for all atlas shadows.
+$@vertexShadowAtlasSection
+{
+    var_ShadowAtlasPosition.x = dot( eyeSpacePosition, gl_EyePlaneS[@shadowAtlasUnit] );
+    var_ShadowAtlasPosition.y = dot( eyeSpacePosition, gl_EyePlaneT[@shadowAtlasUnit] );
+    var_ShadowAtlasPosition.z = dot( eyeSpacePosition, gl_EyePlaneR[@shadowAtlasUnit] );
+    var_ShadowAtlasPosition.w = dot( eyeSpacePosition, gl_EyePlaneQ[@shadowAtlasUnit] );
+}
+$
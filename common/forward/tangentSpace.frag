@@ -1,6 +1,8 @@
 @fsinclude shadowMap
 
 varying vec3 var_EyeVector;
+varying vec3 var_ViewNormal;
+varying float var_ViewDepth;
 varying vec3 var_LightVector[@numLights]; 
 varying vec3 var_LightHalfVector[@numLights]; 
 
@@ -99,5 +101,13 @@ void main (void)
 {
 	SurfaceData sd = getSurfaceData();
 	LitSurfaceData lsd = computeLighting(sd);
-    gl_FragColor = lsd.luminance; 
+	
+	// Eye space normal and linear depth, for the normal/depth fragment output.
+	// Compiled out when the fragment output does not use them. The surface 
+	// normal is in tangent space, so use the geometric normal.
+	vec3 eyeNormal = normalize(var_ViewNormal);
+	if(!gl_FrontFacing) eyeNormal = -eyeNormal;
+	vec4 normalDepth = vec4(eyeNormal, var_ViewDepth);
+	
+	@fragmentOutputSection
 }
@@ -4,6 +4,8 @@
 attribute vec3 attrib_Tangent;
 
 varying vec3 var_EyeVector;
+varying vec3 var_ViewNormal;
+varying float var_ViewDepth;
 varying vec3 var_LightVector[@numLights]; 
 varying vec3 var_LightHalfVector[@numLights]; 
 
@@ -46,6 +48,10 @@ void main(void)
 	v.y = dot (eyeSpacePosition, b);
 	v.z = dot (eyeSpacePosition, n);
 	var_EyeVector = normalize (v);
+	
+	// Eye space normal and depth, for the normal/depth fragment output
+	var_ViewNormal = n;
+	var_ViewDepth = -eyeSpacePosition.z;
 
 	setupShadowMap(eyeSpacePosition);
 	setupEnvMap(eyeSpacePosition.xyz);
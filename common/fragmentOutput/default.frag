@@ -0,0 +1,2 @@
+// Default fragment output: write the lit surface color
+gl_FragColor = lsd.luminance;
@@ -0,0 +1,6 @@
+// Normal/depth fragment output, used when a compositor pass captures the scene
+// into multiple render targets: lit surface color on the first target, eye space
+// normal (rgb) and linear eye depth (a) on the second one. Opaque surfaces
+// store a normal of length 2, translucent ones a normal of length 1.
+gl_FragData[0] = lsd.luminance;
+gl_FragData[1] = vec4(normalDepth.xyz * (1.0 + step(0.9, gl_FrontMaterial.diffuse.a)), normalDepth.w);
@@ -0,0 +1,144 @@
+/******************************************************************************
+ * THE OMEGA LIB PROJECT
+ *-----------------------------------------------------------------------------
+ * Copyright 2010-2015		Electronic Visualization Laboratory, 
+ *							University of Illinois at Chicago
+ * Authors:										
+ *  Alessandro Febretti		febret@gmail.com
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2010-2015, Electronic Visualization Laboratory,  
+ * University of Illinois at Chicago
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification, 
+ * are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this 
+ * list of conditions and the following disclaimer. Redistributions in binary 
+ * form must reproduce the above copyright notice, this list of conditions and 
+ * the following disclaimer in the documentation and/or other materials provided 
+ * with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE  GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-----------------------------------------------------------------------------
+ * What's in this file
+ *	A keyframe track with linear interpolation, for animating parameters.
+ ******************************************************************************/
+#ifndef __CY_ANIMATION_TRACK__
+#define __CY_ANIMATION_TRACK__
+
+#include "cyclopsConfig.h"
+
+#include <vector>
+#include <algorithm>
+
+#define OMEGA_NO_GL_HEADERS
+#include <omega.h>
+
+namespace cyclops {
+    using namespace omega;
+
+    ///////////////////////////////////////////////////////////////////////////
+    //! Linear interpolation between two keyframe values, k going from 0 to 1.
+    //! Overload it for value types that can't be scaled by a double.
+    template<typename T>
+    inline T interpolateKeys(const T& a, const T& b, double k)
+    { return (T)(a * (1.0 - k) + b * k); }
+
+    inline Vector2f interpolateKeys(const Vector2f& a, const Vector2f& b, double k)
+    { float t = (float)k; return a * (1.0f - t) + b * t; }
+
+    inline Vector3f interpolateKeys(const Vector3f& a, const Vector3f& b, double k)
+    { float t = (float)k; return a * (1.0f - t) + b * t; }
+
+    inline Vector4f interpolateKeys(const Vector4f& a, const Vector4f& b, double k)
+    { float t = (float)k; return a * (1.0f - t) + b * t; }
+
+    inline Quaternion interpolateKeys(const Quaternion& a, const Quaternion& b, double k)
+    { return a.slerp((float)k, b); }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //! A sorted list of keyframes, evaluated with linear interpolation. Times
+    //! and values are stored in flat arrays, and the track remembers the last
+    //! evaluated segment: when time moves forward (the common case), evaluating
+    //! the track costs a couple of comparisons instead of a search.
+    //! Evaluating updates the cached segment, so a track should not be
+    //! evaluated from several threads at once.
+    template<typename T>
+    class AnimationTrack
+    {
+    public:
+        AnimationTrack(): myCursor(0) {}
+
+        //! Adds a keyframe. A keyframe at an existing time replaces the old one.
+        void addKey(double time, const T& value)
+        {
+            std::vector<double>::iterator itr = 
+                std::lower_bound(myTimes.begin(), myTimes.end(), time);
+            size_t index = itr - myTimes.begin();
+            if(itr != myTimes.end() && *itr == time)
+            {
+                myValues[index] = value;
+            }
+            else
+            {
+                myTimes.insert(itr, time);
+                myValues.insert(myValues.begin() + index, value);
+            }
+            myCursor = 0;
+        }
+
+        void clear() { myTimes.clear(); myValues.clear(); myCursor = 0; }
+        bool isEmpty() const { return myTimes.empty(); }
+        size_t getNumKeys() const { return myTimes.size(); }
+        double getKeyTime(size_t index) const { return myTimes[index]; }
+        const T& getKeyValue(size_t index) const { return myValues[index]; }
+        double getStartTime() const { return myTimes.empty() ? 0 : myTimes.front(); }
+        double getEndTime() const { return myTimes.empty() ? 0 : myTimes.back(); }
+
+        //! Returns the value of the track at the specified time. Times before
+        //! the first keyframe or after the last one return the first or last
+        //! value. The track must not be empty.
+        T evaluate(double time) const
+        {
+            size_t last = myTimes.size() - 1;
+            if(time <= myTimes[0]) return myValues[0];
+            if(time >= myTimes[last]) return myValues[last];
+
+            // Find the segment [i, i + 1] containing time: try the last one
+            // and the one after it, then fall back to a binary search.
+            size_t i = myCursor;
+            if(i >= last || time < myTimes[i])
+            {
+                i = std::upper_bound(myTimes.begin(), myTimes.end(), time) - myTimes.begin() - 1;
+            }
+            else if(time >= myTimes[i + 1])
+            {
+                i++;
+                if(time >= myTimes[i + 1])
+                {
+                    i = std::upper_bound(myTimes.begin() + i, myTimes.end(), time) - myTimes.begin() - 1;
+                }
+            }
+            myCursor = i;
+
+            double k = (time - myTimes[i]) / (myTimes[i + 1] - myTimes[i]);
+            return interpolateKeys(myValues[i], myValues[i + 1], k);
+        }
+
+    private:
+        std::vector<double> myTimes;
+        std::vector<T> myValues;
+        mutable size_t myCursor;
+    };
+};
+
+#endif
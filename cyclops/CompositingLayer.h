@@ -43,9 +43,19 @@ namespace cyclops {
 	using namespace omega;
 
 	class Uniform;
+	class CompositorInstanceCallback;
 	
+	//! Draws the scene through a compositor. The first camera drawing the layer
+	//! uses the compositor, and each other camera (i.e. secondary cameras 
+	//! rendering to readback targets) draws through its own instance of it,
+	//! created on the first frame it shows up. Tiles and stereo eyes of a 
+	//! camera share its instance. Instances share everything with the 
+	//! compositor but pass cameras, render targets and inbuilt uniforms. 
+	//! Instances drawing viewports of the same size share the memory of the
+	//! render targets that don't keep contents across frames.
 	class CY_API CompositingLayer: public SceneLayer
 	{
+		friend class CompositorInstanceCallback;
 	public:
 		CompositingLayer();
 		virtual ~CompositingLayer();
@@ -56,6 +66,32 @@ namespace cyclops {
 		void reset();
 		//! Loads a compositor from an xml definition.
 		void loadCompositor(const String& filename);
+		//! Returns the loaded compositor, or NULL if no compositor is loaded.
+		Compositor* getCompositor() { return myCompositor; }
+		//! Returns the number of compositor instances used by cameras other 
+		//! than the one drawn by the main compositor.
+		int getNumCompositorInstances();
+		//! Updates the compositor from its definition file. Only the passes
+		//! that changed are rebuilt when possible, otherwise the compositor 
+		//! is loaded again.
+		void reloadCompositor();
+		//! When enabled, the compositor definition, included and shader 
+		//! files are checked for changes about once per second, and the 
+		//! compositor is reloaded when they change. Disabled by default.
+		void setHotReloadEnabled(bool value) { myHotReloadEnabled = value; }
+		bool isHotReloadEnabled() { return myHotReloadEnabled; }
+
+		//! Selects the compositor technique (pass list) to render with, i.e.
+		//! "half" or "quarter" for the reduced resolution variants of the 
+		//! ssao and pessao effects. The first technique in the definition 
+		//! file is used after loading.
+		void setTechnique(const String& name);
+		String getTechnique();
+		//! Returns true when the surface shaders of the scene write normal and
+		//! depth to a second render target. This is enabled automatically 
+		//! when a forward pass of the current technique captures the scene 
+		//! into more than one color buffer.
+		bool isNormalDepthOutputEnabled() { return myNormalDepthOutputEnabled; }
 
 		void setPassActive(const String& passName, bool active);
 		bool isPassActive(const String& passName);
@@ -65,10 +101,89 @@ namespace cyclops {
 
 		Uniform* getUniform(const String& name);
 
+		//! Dynamic resolution
+		//! When enabled, the buffers of compositor passes marked with 
+		//! dynamic_resolution="1" are scaled down when the frame time goes
+		//! over the target, and scaled back up when there is headroom.
+		//@{
+		void setDynamicResolutionEnabled(bool value);
+		bool isDynamicResolutionEnabled() { return myDynamicResolutionEnabled; }
+		//! Sets the target frame time, in seconds.
+		void setTargetFrameTime(float value) { myTargetFrameTime = value; }
+		float getTargetFrameTime() { return myTargetFrameTime; }
+		//! Sets the smallest resolution scale the controller can use.
+		void setMinResolutionScale(float value) { myMinResolutionScale = value; }
+		float getMinResolutionScale() { return myMinResolutionScale; }
+		//! Returns the current resolution scale.
+		float getResolutionScale();
+		//@}
+
+		//! Profiling
+		//! When enabled, the CPU cull time and GPU time of each compositor 
+		//! pass are measured and published to the stats manager as
+		//! "cyclops pass <name> cull" and "cyclops pass <name> gpu".
+		//! Times are in milliseconds, and only cover the views drawn by the
+		//! main compositor.
+		//@{
+		void setProfilingEnabled(bool value);
+		bool isProfilingEnabled();
+		//! Returns a table with the times of the passes of the current 
+		//! technique.
+		String getProfile();
+		float getPassCullTime(const String& passName);
+		float getPassGpuTime(const String& passName);
+		//@}
+
+	protected:
+		virtual void updateLayer();
+		void updateDynamicResolution();
+		void updateProfilingStats();
+		void updateSceneOutputs();
+		void updateCompositorInstances();
+		void clearCompositorInstances();
+		void setCompositorResolutionScale(float scale);
+		//! Returns the compositor drawing a camera, or NULL if its instance has
+		//! not been created yet. Called by cull threads. The reference keeps the
+		//! instance alive while it is drawn, even if it is released meanwhile.
+		Ref<Compositor> getCompositorInstance(Camera* camera, const osg::Vec2i& size, unsigned int frame);
+
 	protected:
 		Ref<Compositor> myCompositor;
 		Ref<ShaderManager> myShaderManager;
 		Ref<osg::Group> myOutputNode;
+		String myCompositorFile;
+		bool myNormalDepthOutputEnabled;
+
+		// Compositor instances, by camera. Cameras are only used as keys, and
+		// are never accessed through them. Cameras culled without an instance 
+		// are queued with their viewport size, and instances are created in 
+		// the update thread.
+		struct CompositorInstance
+		{
+			Ref<Compositor> compositor;
+			unsigned int lastCullFrame;
+		};
+		std::map<Camera*, CompositorInstance> myCompositorInstances;
+		std::map<Camera*, osg::Vec2i> myRequestedInstances;
+		Camera* myMainCamera;
+		unsigned int myMainCullFrame;
+		unsigned int myLastCullFrame;
+		Lock myInstancesLock;
+
+		// Hot reload
+		bool myHotReloadEnabled;
+		float myTimeSinceReloadCheck;
+
+		// Profiling stats, by pass name
+		Dictionary<String, Stat*> myPassCullStats;
+		Dictionary<String, Stat*> myPassGpuStats;
+
+		// Dynamic resolution
+		bool myDynamicResolutionEnabled;
+		float myTargetFrameTime;
+		float myMinResolutionScale;
+		float myAverageFrameTime;
+		int myFramesSinceRescale;
 	};	
 };
 
@@ -5,15 +5,57 @@
 #include <osg/Texture>
 #include <osg/Program>
 #include <osg/Camera>
+#include <osg/Texture2D>
+#include <osg/Vec2>
+#include <osg/Vec2i>
+#include <osg/Timer>
+#include <OpenThreads/Mutex>
 #include <osgDB/Options>
 #include <osgDB/XmlParser>
+#include <ctime>
+#include <map>
+#include <set>
 
 #include "cyclopsConfig.h"
 
+namespace osgUtil { class CullVisitor; }
+
 namespace cyclops
 {
 
 
+/** Timings of a compositor pass, recorded when profiling is enabled */
+class PassTimer : public osg::Referenced
+{
+public:
+    PassTimer() {}
+    
+    /** Add time spent by the pass in a frame, in milliseconds. Can be called several times
+        per frame, i.e. once per view, from different threads */
+    void addCullTime( unsigned int frame, double ms );
+    void addGpuTime( unsigned int frame, double ms );
+    
+    /** Get the total time spent by the pass in the last complete frame, in milliseconds */
+    double getCullTime() const;
+    double getGpuTime() const;
+    
+protected:
+    /** Times of the last few frames. Results from several views and contexts may arrive
+        out of frame order, so each frame accumulates its own time */
+    struct FrameTime
+    {
+        std::map<unsigned int, double> frames;
+        double last;
+        
+        FrameTime() : last(0.0) {}
+        void add( unsigned int f, double ms );
+    };
+    
+    FrameTime _cullTime;
+    FrameTime _gpuTime;
+    mutable OpenThreads::Mutex _mutex;
+};
+
 /** The compositor class integrates myltiple forward and deferred passes to create complex visual effects */
 class Compositor : public osg::Group
 {
@@ -23,19 +65,65 @@ public:
     META_Node( osgFX, Compositor );
     
     enum PassType { FORWARD_PASS, DEFERRED_PASS };
+    
+    /** A view drawing the compositor: the omegalib camera, eye and depth partition being culled,
+        or the render stage camera outside of omegalib */
+    struct ViewKey
+    {
+        const void* camera;
+        int eye;
+        int depthPartition;
+        
+        ViewKey() : camera(NULL), eye(-1), depthPartition(-1) {}
+        bool operator==( const ViewKey& k ) const
+        { return camera==k.camera && eye==k.eye && depthPartition==k.depthPartition; }
+    };
+    
     struct PassData
     {
         bool activated;
         PassType type;
         std::string name;
         osg::ref_ptr<osg::Camera> pass;
+        bool dynamicResolution;
+        bool culled;  // set when the pass output is not used by the display passes
+        
+        /** The pass is only updated one frame every updateInterval frames, shifted by
+            updateOffset frames. With checkerboardUpdate, it is updated every frame instead,
+            but its shaders only write the pixels of the current phase (osg_UpdatePhase). */
+        unsigned int updateInterval;
+        unsigned int updateOffset;
+        bool checkerboardUpdate;
+        int lastUpdateFrame;  // -1 when the pass outputs have to be updated as soon as possible
+        ViewKey lastUpdateView;  // view whose result the pass outputs hold
         
-        PassData() : activated(true), type(FORWARD_PASS) {}
+        /** Checkerboard passes get osg_UpdateInterval and osg_UpdatePhase from one of these,
+            pushed when culling the pass: phaseStateSet to update the pixels of the current
+            phase, set in the update traversal, or fullUpdateStateSet to update all of them. */
+        osg::ref_ptr<osg::StateSet> phaseStateSet;
+        osg::ref_ptr<osg::StateSet> fullUpdateStateSet;
+        
+        /** Names of the global buffers/textures read and written by the pass */
+        std::vector<std::string> inputs;
+        std::vector<std::string> outputs;
+        
+        /** Pass timings, only allocated when profiling is enabled */
+        osg::ref_ptr<PassTimer> timer;
+        
+        PassData() : activated(true), type(FORWARD_PASS), dynamicResolution(false), culled(false),
+                     updateInterval(1), updateOffset(0), checkerboardUpdate(false), lastUpdateFrame(-1) {}
         
         PassData& operator=( const PassData& pd )
         {
             activated = pd.activated; type = pd.type;
             name = pd.name; pass = pd.pass;
+            dynamicResolution = pd.dynamicResolution; culled = pd.culled;
+            updateInterval = pd.updateInterval; updateOffset = pd.updateOffset;
+            checkerboardUpdate = pd.checkerboardUpdate; lastUpdateFrame = pd.lastUpdateFrame;
+            lastUpdateView = pd.lastUpdateView;
+            phaseStateSet = pd.phaseStateSet; fullUpdateStateSet = pd.fullUpdateStateSet;
+            inputs = pd.inputs; outputs = pd.outputs;
+            timer = pd.timer;
             return *this;
         }
         
@@ -48,12 +136,52 @@ public:
     void setRenderTargetImplementation( osg::Camera::RenderTargetImplementation r ) { _renderTargetImpl = r; }
     osg::Camera::RenderTargetImplementation getRenderTargetImplementation() const { return _renderTargetImpl; }
     
-    /** Set default output buffer size */
+    /** Set default output buffer size. Viewport relative buffers also use it until the
+        viewport size is known. */
     void setRenderTargetResolution( const osg::Vec3& r ) { _renderTargetResolution = r; }
     const osg::Vec3& getRenderTargetResolution() const { return _renderTargetResolution; }
     
-    /** Set current technique (pass list) */
-    void setCurrentTechnique( const std::string& tech ) { _currentTechnique = tech; }
+    /** Set the viewport size that buffers with relative_size="viewport" are sized from, and
+        resize them. Call it from the update thread: buffers can't be resized while culling. */
+    void setViewportSize( int width, int height );
+    osg::Vec2i getViewportSize() const;
+    
+    /** Resize the viewport relative buffers to fit the viewports culled in the last frame.
+        When several cameras with different viewports draw the compositor, the largest
+        viewport is used, unless each camera gets its own instance (see createInstance()).
+        Called by the update traversal; compositors drawn outside of the scene graph need
+        to call it from the update thread. Until the viewport size is known, culling the
+        compositor draws its children without any effect. */
+    void updateViewportSize();
+    
+    /** Check if some buffer has relative_size="viewport", so the compositor can only draw
+        viewports of a single size at full quality (see createInstance()) */
+    bool hasViewportBuffers() const { return !_viewportBufferScales.empty(); }
+    
+    /** Create a compositor that shares the techniques, shaders, uniforms and scene children
+        of this one, but has its own pass cameras, render targets and inbuilt uniforms, so it
+        can draw another camera. Pass timers are not shared, and the instance is not updated
+        when this compositor is reloaded, so create it again in that case.
+    */
+    Compositor* createInstance() const;
+    
+    /** Use the render targets of another instance drawing viewports of the same size, where
+        they are identical. Only buffers written before being read in every frame are shared:
+        outputs of passes with an update interval and buffers keeping contents from the
+        previous frame stay per instance. A compositor gets its own copy of a shared render
+        target again before resizing it. Call it from the update thread. Returns the number
+        of render targets shared.
+    */
+    unsigned int shareRenderTargets( Compositor* other );
+    
+    /** Scale the output buffers and viewports of passes marked with dynamic_resolution="1"
+        in the current technique, relative to their size at load time. Buffers are reallocated
+        when their size changes, so avoid changing the scale every frame. */
+    void setResolutionScale( float scale );
+    float getResolutionScale() const { return _resolutionScale; }
+    
+    /** Set current technique (pass list). Buffers get the resolution scale of the new technique. */
+    void setCurrentTechnique( const std::string& tech );
     
     /** Remove current technique (pass list) */
     const std::string& getCurrentTechnique() { return _currentTechnique; }
@@ -87,6 +215,31 @@ public:
     /** Get if the pass should be activated (so to update its contents) */
     bool getPassActivated( const std::string& name ) const;
     
+    /** Set if activated passes whose outputs are never used by a display pass should be skipped */
+    void setPassCullingEnabled( bool enabled ) { _passCullingEnabled = enabled; updatePassGraph(); }
+    bool getPassCullingEnabled() const { return _passCullingEnabled; }
+    
+    /** Rebuild the pass dependency graph from the pass inputs and outputs, and cull passes
+        that display passes don't depend on. Passes with outputs that are not global buffers
+        are never culled. Called automatically when passes are activated, moved or removed. */
+    void updatePassGraph();
+    
+    /** Check if a forward pass of the current technique draws the scene with its own shaders
+        into more than one color buffer. Scene shaders then have to write all of them. */
+    bool hasMultipleTargetScenePass() const;
+    
+    /** Get a readable description of the pass dependency graph of the current technique */
+    std::string getPassGraphDescription() const;
+    
+    /** Record the CPU cull time and the GPU time of every pass (see PassData::timer). GPU times
+        are measured with timestamp queries and read back a few frames later. When disabled,
+        passes are not instrumented at all. */
+    void setProfilingEnabled( bool enabled );
+    bool getProfilingEnabled() const { return _profilingEnabled; }
+    
+    /** Get a readable table of the pass timings of the current technique */
+    std::string getProfilingDescription() const;
+    
     /** Get number of passes in this compositor */
     unsigned int getNumPasses() const { return getPassList().size(); }
     
@@ -110,6 +263,15 @@ public:
     typedef std::map<std::string, osg::ref_ptr<osg::Texture> > TextureMap;
     const TextureMap& getTextureMap() const { return _textureMap; }
     
+    /** Share render targets between global buffers with the same format and size whose
+        lifetimes in the pass list don't overlap. Buffers are only aliased if they are used
+        by a single technique, written before being read in each frame, and not marked as
+        persistent in their XML definition. Viewport relative buffers are only aliased with
+        buffers of the same relative size. The analysis uses the current pass order, so
+        call it again after reordering passes. Returns the number of aliased buffers.
+    */
+    unsigned int aliasBuffers();
+    
     /** Set a global parameter object */
     bool setUniform( const std::string& name, osg::Uniform* uniform );
     
@@ -144,9 +306,13 @@ public:
         SCENE_MODELVIEW_MATRIX,
         SCENE_INV_MODELVIEW_MATRIX,
         SCENE_PROJECTION_MATRIX,
-        SCENE_INV_PROJECTION_MATRIX
+        SCENE_INV_PROJECTION_MATRIX,
+        CAMERA_BLOCK  // all of the above in a single mat4 array uniform (see getInbuiltValues())
     };
     
+    /** Number of elements of the mat4 array uniform of a CAMERA_BLOCK inbuilt value */
+    static const unsigned int CAMERA_BLOCK_SIZE = 7;
+    
     /** Add an inbuilt uniform for automatical updating */
     void addInbuiltUniform( InbuiltUniformType t, osg::Uniform* u ) { _inbuiltUniforms.push_back(InbuiltUniformPair(t, u)); }
     
@@ -186,19 +352,26 @@ public:
         The reason we don't use the main camera's zear/zfar is because the compositor will
         manage the scene using internal cameras, and won't return back znear/zfar to the
         main camera in osgUtil::CullVisitor
+        Values are kept for each view camera (the camera of the root render stage), since
+        cameras and tiles looking at different parts of the scene have different ranges.
     */
-    void setPreservedNearAndFar( unsigned int frame, double zn, double zf );
-    void getPreservedNearAndFar( double& zn, double& zf ) { zn = _preservedZNear; zf = _preservedZFar; }
+    void setPreservedNearAndFar( const osg::Camera* view, unsigned int frame, double zn, double zf );
+    bool getPreservedNearAndFar( const osg::Camera* view, double& zn, double& zf );
     
     /** Create a new pass from XML
         A typical definition is:
-          <pass name="..." type="...">  <!-- or <forward_pass>, <deferred_pass> -->
+          <pass name="..." type="..." dynamic_resolution="0">  <!-- or <forward_pass>, <deferred_pass> -->
             <shader>...</shader>
             <uniform>...</uniform>
             <texture unit="">...</texture>
             <input unit="">...</input>
             <output target="">...</output>
           </pass>
+        Passes with slowly changing outputs can set update_interval="N" (and optionally
+        update_offset="k") to be updated once every N frames, keeping their previous outputs
+        in between. With update_pattern="checkerboard" the pass runs every frame without
+        clearing its color outputs, and its shaders are expected to discard the pixels where
+        mod(x + y, osg_UpdateInterval) != osg_UpdatePhase.
     */
     osg::Camera* createPassFromXML( osgDB::XmlNode* xmlNode );
     
@@ -210,6 +383,11 @@ public:
             <source_format>...</source_format>
             <internal_format>...</internal_format>
           </buffer>
+        Set persistent="1" on buffers whose contents must be kept between frames, so that
+        their render target is never shared with other buffers (see aliasBuffers()).
+        With relative_size="1", width and height are fractions of the render target resolution.
+        With relative_size="viewport", they are fractions (1 by default) of the viewport size,
+        and 2d buffers are resized when the viewport changes (see setViewportSize()).
         
         A typical definition of a texture object is:
           <texture name="..." type="...">
@@ -240,41 +418,123 @@ public:
     /** Load effect data from XML, can be executed multiple times to load various data */
     bool loadFromXML( osgDB::XmlNode* xmlNode, XmlTemplateMap& templateMap, const osgDB::Options* options );
     
+    /** Update the effect from a new version of its XML definition. Global shaders and uniforms
+        are updated in place, and only passes whose definition changed are rebuilt. Returns false,
+        leaving the compositor untouched, if buffers, textures or the pass list changed: in that
+        case the effect has to be loaded again.
+    */
+    bool reloadFromXML( osgDB::XmlNode* xmlNode, const osgDB::Options* options );
+    
+    /** Watch a file used by the effect for changes */
+    void addSourceFile( const std::string& path );
+    
+    /** Check if any effect, include or shader file used by the effect changed on disk */
+    bool areSourceFilesChanged() const;
+    
     /** Traverse the node and all its children */
     virtual void traverse( osg::NodeVisitor& nv );
     
 protected:
     osg::Geode* createScreenQuad( float width, float height, float scale=1.0f );
-    void traverseAllPasses( osg::NodeVisitor& nv )
+    
+    /** Camera values that inbuilt uniforms are set from */
+    struct InbuiltValues
     {
-        PassList& passList = getPassList();
-        for ( unsigned int i=0; i<passList.size(); ++i )
-        {
-            PassData& data = passList[i];
-            if ( data.activated && data.pass.valid() )
-                data.pass->accept( nv );
-        }
-    }
+        osg::Vec3 eyePosition, viewPoint, lookVector, upVector;
+        osg::Vec4 viewport;
+        float zNear, zFar, fovInRadians, aspectRatio;
+        osg::Matrixf windowMatrix, invWindowMatrix;
+        osg::Matrixf modelViewMatrix, invModelViewMatrix;
+        osg::Matrixf projectionMatrix, invProjectionMatrix;
+        
+        InbuiltValues() : zNear(0.0f), zFar(0.0f), fovInRadians(0.0f), aspectRatio(0.0f) {}
+    };
+    
+    /** Get the camera values of a cull, computed once per compositor traversal for all of the
+        inbuilt uniforms. Required is a mask of the InbuiltUniformType bits used, so unused
+        inverse matrices are skipped.
+        
+        A CAMERA_BLOCK uniform holds, in order: the modelview matrix and its inverse, the
+        projection matrix and its inverse, the window matrix and its inverse, then a matrix
+        whose columns are (eye position, near), (look vector, far), (up vector, fov in radians)
+        and the viewport (x, y, width, height).
+    */
+    void getInbuiltValues( osgUtil::CullVisitor* cv, unsigned int required, InbuiltValues& values );
+    
+    
+    /** Resize the viewport relative buffers and the outputs of dynamic resolution passes,
+        and fit the viewports of the passes writing them */
+    void resizeBuffers();
+    
+    /** Replace render targets in the texture maps and pass cameras */
+    typedef std::map<osg::Texture*, osg::ref_ptr<osg::Texture> > TextureReplacementMap;
+    void replaceRenderTargets( const TextureReplacementMap& replacements );
+    
+    /** Record the size of a viewport culled in a frame (see updateViewportSize()) */
+    void requestViewportSize( unsigned int frame, int width, int height );
+    
+    /** Check if a pass with an update interval has to be updated in the frame being culled.
+        The pass outputs are shared by all views drawing the compositor, so a pass only skips
+        updates for the view it was last updated for: other views (stereo eyes, depth
+        partitions) update it every frame. For checkerboard passes, updateStateSet is set to
+        the state set to push while culling the pass. */
+    bool isPassUpdateFrame( PassData& data, const osg::NodeVisitor& nv, osg::StateSet*& updateStateSet );
+    
+    void traverseAllPasses( osg::NodeVisitor& nv );
     
     PassListMap _passLists;
     TextureMap _textureMap;
+    TextureMap _bufferTextures;  // own render targets of aliasable buffers
+    std::map<osg::ref_ptr<osg::Texture2D>, osg::Vec2i> _baseBufferSizes;  // unscaled buffer sizes
+    std::map<std::string, osg::Vec2> _viewportBufferScales;  // sizes of viewport relative buffers
+    
+    // Definitions of the loaded objects, used to find what changed when reloading
+    struct PassDefinition
+    {
+        osg::ref_ptr<osgDB::XmlNode> xmlNode;
+        unsigned int hash;
+    };
+    std::map<std::string, PassDefinition> _passDefinitions;  // by "technique/pass"
+    std::map<std::string, unsigned int> _definitionHashes;   // by "element:name"
+    std::map<std::string, time_t> _sourceFiles;
+    osg::ref_ptr<const osgDB::Options> _options;
     UniformMap _uniformMap;
     ShaderMap _shaderMap;
     InbuiltUniformList _inbuiltUniforms;
+    
+    struct PreservedNearAndFar
+    {
+        unsigned int frame;
+        double zNear, zFar;
+    };
+    std::map<const osg::Camera*, PreservedNearAndFar> _preservedNearAndFar;  // by view camera
+    osg::Vec4 _lastViewport;  // used by culls without a viewport
+    OpenThreads::Mutex _inbuiltValuesMutex;  // guards the preserved near/far values and the last viewport
     std::string _currentTechnique;
     
     osg::ref_ptr<osg::Geode> _quad;
     osg::Vec3 _renderTargetResolution;
+    osg::Vec2i _viewportSize;       // 0 until the compositor is culled for the first time
+    osg::Vec2i _frameViewportSize;  // largest viewport culled in the current frame
+    unsigned int _viewportFrameNumber;
+    bool _viewportSizeRequested;    // set when viewports were culled since the last update
+    mutable OpenThreads::Mutex _viewportMutex;  // guards the viewport sizes, set in cull and update
+    OpenThreads::Mutex _updateFrameMutex;  // guards the pass update frames, set in cull and update
+    std::set<osg::Texture*> _sharedRenderTargets;  // render targets also used by other instances
+    float _resolutionScale;
+    bool _passCullingEnabled;
+    bool _profilingEnabled;
     osg::Camera::RenderTargetImplementation _renderTargetImpl;
-    double _preservedZNear;
-    double _preservedZFar;
-    unsigned int _preservingNearFarFrameNumber;
 };
 
 /** Read effect compositor from the XML file/stream */
 Compositor* readEffectFile( const std::string& filename, const osgDB::Options* options=NULL );
 Compositor* readEffectStream( std::istream& stream, const osgDB::Options* options=NULL );
 
+/** Update a compositor from the current content of its effect file (see Compositor::reloadFromXML).
+    Returns false if the effect needs to be loaded again */
+bool reloadEffectFile( Compositor* compositor, const std::string& filename, const osgDB::Options* options=NULL );
+
 
 }
 
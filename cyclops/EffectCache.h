@@ -0,0 +1,100 @@
+/******************************************************************************
+ * THE OMEGA LIB PROJECT
+ *-----------------------------------------------------------------------------
+ * Copyright 2010-2015		Electronic Visualization Laboratory, 
+ *							University of Illinois at Chicago
+ * Authors:										
+ *  Alessandro Febretti		febret@gmail.com
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2010-2015, Electronic Visualization Laboratory,  
+ * University of Illinois at Chicago
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification, 
+ * are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this 
+ * list of conditions and the following disclaimer. Redistributions in binary 
+ * form must reproduce the above copyright notice, this list of conditions and 
+ * the following disclaimer in the documentation and/or other materials provided 
+ * with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE  GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-----------------------------------------------------------------------------
+ * What's in this file
+ *	A process-wide cache of parsed compositor effect definitions and images.
+ ******************************************************************************/
+#ifndef __CY_EFFECT_CACHE__
+#define __CY_EFFECT_CACHE__
+
+#include "cyclopsConfig.h"
+
+#include <ctime>
+#include <osg/Image>
+#include <osgDB/Options>
+#include <osgDB/XmlParser>
+
+#define OMEGA_NO_GL_HEADERS
+#include <omega.h>
+
+namespace cyclops {
+    using namespace omega;
+
+    ///////////////////////////////////////////////////////////////////////////
+    //! Caches parsed compositor effect files and the images they load. Effect
+    //! definitions are cached by content hash: a file is read every time it
+    //! is requested, but only parsed when its content changed. Only the
+    //! definitions and images are cached: each compositor still builds its 
+    //! own passes, programs and textures. All methods are thread safe.
+    class CY_API EffectCache
+    {
+    public:
+        //! Returns a copy of the effect definition in a file, with <include>
+        //! elements replaced by the content of the included files. The copy
+        //! can be freely modified by the caller. The effect file and all
+        //! included files are added to outFiles if it is not NULL. Returns 
+        //! NULL if the file could not be read.
+        static osgDB::XmlNode* getEffect(const String& path, List<String>* outFiles = NULL);
+        //! Returns an image loaded from a file. Images are shared by all 
+        //! effects, except for image streams (videos). An image is loaded 
+        //! again when its file changed since it was cached.
+        static osg::Image* getImage(const String& path, const osgDB::Options* options);
+        //! Drops cached images that are not used by any effect anymore.
+        static void releaseUnusedImages();
+        //! Drops all cached effect definitions and images.
+        static void clear();
+
+        //! Returns the modification time of a file, or 0 if the file does
+        //! not exist.
+        static time_t getFileStamp(const String& path);
+        //! Returns a 32 bit FNV-1a hash of a string.
+        static unsigned int hash(const String& data);
+
+    private:
+        static osgDB::XmlNode* getEffect(const String& path, List<String>* outFiles, int depth);
+        static void resolveIncludes(osgDB::XmlNode* node, const String& path, List<String>* outFiles, int depth);
+
+    private:
+        // Parsed effects by content hash, and last content hash of each file.
+        static Dictionary<unsigned int, osg::ref_ptr<osgDB::XmlNode> > sEffects;
+        static Dictionary<String, unsigned int> sFileHashes;
+        struct CachedImage
+        {
+            osg::ref_ptr<osg::Image> image;
+            String file;
+            time_t stamp;
+        };
+        static Dictionary<String, CachedImage> sImages;
+        static Lock sLock;
+    };
+};
+
+#endif
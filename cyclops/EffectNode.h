@@ -81,6 +81,9 @@ namespace cyclops {
         //! @internal sets the shader manager used by this effect to manage
         //! material shaders
         void setShaderManager(ShaderManager* sm);
+        //! @internal binds material programs again when the shader manager
+        //! replaced them.
+        void refreshPrograms();
 
         //! @internal
         virtual void traverse(osg::NodeVisitor& nv);
@@ -92,6 +92,12 @@ namespace cyclops {
 
         void castShadow(bool value);
         bool doesCastShadow();
+        //! Flags this entity as a static shadow caster. Lights using the
+        //! StaticCached shadow refresh mode render static casters to a 
+        //! cached depth map, and re-render it only when a static caster 
+        //! moves or changes. Entities are dynamic casters by default.
+        void setStaticShadowCaster(bool value);
+        bool isStaticShadowCaster() { return myStaticShadowCaster; }
         //! Enables or disables frustum culling for this entity. If culling is
         //! enabled (the default state), this entity will be culled when its
         //! bounding box does not intersect the camera frustum.
@@ -117,6 +123,12 @@ namespace cyclops {
 
         virtual void updateTraversal(const UpdateContext& context);
 
+        //! @internal Sets the lights that will be skipped when shading this
+        //! entity, as a bitmask of light indices. Called by lighting layers 
+        //! after culling lights against the entity bounds.
+        void setCulledLights(uint mask);
+        uint getCulledLights() { return myCulledLights; }
+
     protected:
         void initialize(osg::Node* node);
         //! Used by the piece functions to find a named group inside the object.
@@ -135,8 +147,20 @@ namespace cyclops {
         Ref<EffectNode> myEffect;
 
         bool myCastShadow;
+        bool myStaticShadowCaster;
         bool myCullingActive;
 
+        // Last transform and visibility of static casters, used to 
+        // invalidate cached static shadows.
+        Vector3f myLastCasterPosition;
+        Quaternion myLastCasterOrientation;
+        Vector3f myLastCasterScale;
+        bool myLastCasterVisible;
+
+        // Per-entity light culling
+        uint myCulledLights;
+        Ref<osg::Uniform> myLightCulledUniform;
+
         Ref<RigidBody> myRigidBody;
     };
 
@@ -42,6 +42,8 @@
 #include <osg/Light>
 #include <osg/LightSource>
 
+#include <cfloat>
+
 #define OMEGA_NO_GL_HEADERS
 #include <omega.h>
 #include <omegaOsg/omegaOsg.h>
@@ -64,7 +66,13 @@ namespace cyclops {
     friend class LightInstance;
     public:
         enum LightType { Point, Directional, Spot, Custom };
-        enum ShadowRefreshMode { OnFrame, OnLightMove, Manual };
+        //! Shadow refresh modes. StaticCached renders static casters (see 
+        //! Entity::setStaticShadowCaster) to a cached depth map, updated
+        //! only when the light or a static caster changes, and renders 
+        //! dynamic casters on top of it every frame. Scheduled shadows are
+        //! refreshed by their lighting layer within a per-frame budget (see
+        //! LightingLayer::setShadowRefreshBudget).
+        enum ShadowRefreshMode { OnFrame, OnLightMove, Manual, StaticCached, Scheduled };
 
         //! Convenience method for creating Light instances
         static Light* create();
@@ -86,10 +94,10 @@ namespace cyclops {
         LightInstance* createInstance(osg::Group* rootNode);
         void destroyInstance(LightInstance* i);
 
-        void setColor(const Color& value) { myColor = value; }
+        void setColor(const Color& value) { myColor = value; myParamVersion++; }
         const Color& getColor() { return myColor; }
 
-        void setAmbient(const Color& value) { myAmbient = value; }
+        void setAmbient(const Color& value) { myAmbient = value; myParamVersion++; }
         const Color& getAmbient() { return myAmbient; }
 
         void setEnabled(bool value);
@@ -100,18 +108,32 @@ namespace cyclops {
             myAttenuation[0] = constant; 
             myAttenuation[1] = linear; 
             myAttenuation[2] = quadratic; 
+            myParamVersion++;
         }
         const Vector3f& getAttenuation() { return myAttenuation; }
 
+        //! Sets the radius of the sphere around this light outside of which
+        //! the light is considered to have no effect. Entities whose bounds
+        //! do not intersect this sphere will not be lit by this light.
+        //! Set to 0 (the default) to derive the radius from the light 
+        //! attenuation and color.
+        void setInfluenceRadius(float value) { myInfluenceRadius = value; }
+        //! Returns the light influence radius, either set explicitly or 
+        //! derived from attenuation. Returns FLT_MAX for lights with unbounded 
+        //! influence (directional lights or lights with no attenuation)
+        float getInfluenceRadius();
+        //! Returns true if this light influence is bounded.
+        bool hasBoundedInfluence() { return getInfluenceRadius() != FLT_MAX; }
+
         void setLightType(LightType type);
         LightType getLightType() { return myType; }
 
-        void setLightDirection(const Vector3f& value) { myLightDirection = value; }
+        void setLightDirection(const Vector3f& value) { myLightDirection = value; myParamVersion++; }
         Vector3f getLightDirection() { return myLightDirection; }
 
-        void setSpotExponent(float value) { mySpotExponent = value; }
+        void setSpotExponent(float value) { mySpotExponent = value; myParamVersion++; }
         float getSpotExponent() { return mySpotExponent; }
-        void setSpotCutoff(float value) { mySpotCutoff = value; }
+        void setSpotCutoff(float value) { mySpotCutoff = value; myParamVersion++; }
         float getSpotCutoff() { return mySpotCutoff; }
 
         void setLightFunction(const String& function) { myLightFunction = function; }
@@ -122,6 +144,13 @@ namespace cyclops {
         //! Forces a regeneration of shaders using this light.
         void requestShaderUpdate();
 
+        //! @internal Returns a counter that changes every time one of the
+        //! light parameters (color, attenuation, type, etc.) changes.
+        uint getParamVersion() { return myParamVersion; }
+        //! @internal Returns a counter that changes every time the light
+        //! derived position or orientation changes.
+        uint getTransformVersion();
+
     private:
         SceneManager* mySceneManager;
         LightingLayer* myLayer;
@@ -130,6 +159,7 @@ namespace cyclops {
         Color myAmbient;
         bool myEnabled;
         Vector3f myAttenuation;
+        float myInfluenceRadius;
 
         float mySpotExponent;
         float mySpotCutoff;
@@ -143,6 +173,13 @@ namespace cyclops {
         LightType myType;
         String myLightFunction;
 
+        // Change tracking, used by light instances to skip updates when
+        // nothing changed.
+        uint myParamVersion;
+        uint myTransformVersion;
+        Vector3f myLastPosition;
+        Quaternion myLastOrientation;
+
         // Shadow stuff
         Ref<ShadowMap> myShadow;
         ShadowRefreshMode myShadowRefreshMode;
@@ -185,6 +222,13 @@ namespace cyclops {
         Ref<osg::LightSource> myOsgLightSource;
 
         bool myShaderUpdateNeeded;
+
+        // Light versions last applied to the osg light. When myDirty is set
+        // the osg light and its state set modes are re-applied regardless.
+        bool myDirty;
+        bool myLastEnabled;
+        uint myParamVersion;
+        uint myTransformVersion;
     };
 };
 
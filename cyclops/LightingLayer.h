@@ -73,6 +73,34 @@ namespace cyclops {
 
 		ShaderManager* getShaderManager() { return myShaderManager; }
 
+		//! Sets the maximum number of lights applied to each entity in this
+		//! layer. When more lights reach an entity, only the ones with the
+		//! strongest estimated contribution are applied.
+		void setMaxLightsPerEntity(int value) { myMaxLightsPerEntity = value; }
+		int getMaxLightsPerEntity() { return myMaxLightsPerEntity; }
+
+		//! Enables or disables the shadow atlas. With the atlas enabled, the
+		//! shadow maps of lights in this layer render to rectangles of a 
+		//! single depth texture, and shaders read all of them through a single
+		//! sampler. Rectangle sizes follow the shadow map texture sizes, and 
+		//! are scaled down when they do not fit in the atlas. Sub-layers 
+		//! read shadows from the atlas of this layer, and should not enable
+		//! their own.
+		void setShadowAtlasEnabled(bool value);
+		bool isShadowAtlasEnabled() { return myShadowAtlas != NULL; }
+		//! Sets the maximum number of shadow maps refreshed each frame, among
+		//! the shadow maps of lights in this layer using the Scheduled 
+		//! refresh mode. Dirty shadow maps go first, then the ones with the
+		//! highest importance (light intensity and estimated screen 
+		//! coverage) weighted by the frames since their last refresh. Use 0
+		//! (the default) to refresh all scheduled shadow maps every frame.
+		void setShadowRefreshBudget(int value) { myShadowRefreshBudget = value; }
+		int getShadowRefreshBudget() { return myShadowRefreshBudget; }
+
+		//! Sets the width and height of the shadow atlas texture.
+		void setShadowAtlasSize(int size);
+		int getShadowAtlasSize() { return myShadowAtlasSize; }
+
 	protected:
 		//! This methods are never used directly but are called by Light::setLayer
 		virtual void addLight(Light* l);
@@ -85,9 +113,20 @@ namespace cyclops {
 		void addLightToSubLayers(SceneLayer* layer, Light* l);
 		void removeLightFromSubLayers(SceneLayer* layer, Light* l);
 
+		//! Culls lights against the bounds of entities in this layer, 
+		//! disabling lights whose influence does not reach them.
+		void cullLights();
+		//! Picks the scheduled shadow maps to refresh this frame.
+		void scheduleShadowRefresh();
+
 	private:
 		LightInstanceMap myLights;
 		ShaderManager* myShaderManager;
+		int myMaxLightsPerEntity;
+
+		Ref<ShadowAtlas> myShadowAtlas;
+		int myShadowAtlasSize;
+		int myShadowRefreshBudget;
 		
 		// This is the node over which shadowed scenes are applied.
 		Ref<osg::Group> myPreShadowNode;
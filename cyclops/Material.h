@@ -149,6 +149,10 @@ namespace cyclops {
         //! @internal sets the shader manager used by this material to find
         //! shaders
         void setShaderManager(ShaderManager* sm);
+        //! @internal binds the program again if the shader manager replaced
+        //! its programs since the program was set (i.e. because the light 
+        //! configuration changed).
+        void refreshProgram();
 
         //! The camera that will draw this material. If no camera is specified,
         //! all cameras will draw this material
@@ -187,6 +191,8 @@ namespace cyclops {
 
         String myProgramName;
         ShaderManager* myShaderManager;
+        // Shader manager programs version when the program was bound.
+        int myProgramsVersion;
         //Ref<ProgramAsset> myProgram;
 
         // The camera that will draw this material. If no camera is specified,
@@ -101,6 +101,8 @@ namespace cyclops {
         void handleEvent(const Event& evt);
         bool handleCommand(const String& cmd);
         Engine* getEngine() { return myEngine; }
+        //! Returns the duration of the last frame, in seconds.
+        float getFrameTime() { return myFrameTime; }
 
         //! Sets the background color
         void setBackgroundColor(const Color& color);
@@ -168,6 +170,7 @@ namespace cyclops {
         
         // Engine owns modules like SceneManager so just use a pointer here
         Engine* myEngine;
+        float myFrameTime;
 
 
         // The scene global uniforms.
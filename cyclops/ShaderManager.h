@@ -71,6 +71,24 @@ namespace cyclops {
 			geometryOutVertices(0), 
 			embedded(false)
 		{}
+
+		//! Copies the program definition (names, sources and geometry shader
+		//! parameters) from another asset. Compiled programs and shaders are 
+		//! not copied.
+		void copyDefinition(const ProgramAsset* other)
+		{
+			name = other->name;
+			vertexShaderName = other->vertexShaderName;
+			fragmentShaderName = other->fragmentShaderName;
+			geometryShaderName = other->geometryShaderName;
+			embedded = other->embedded;
+			vertexShaderSource = other->vertexShaderSource;
+			fragmentShaderSource = other->fragmentShaderSource;
+			geometryShaderSource = other->geometryShaderSource;
+			geometryOutVertices = other->geometryOutVertices;
+			geometryInput = other->geometryInput;
+			geometryOutput = other->geometryOutput;
+		}
 	
 		String name;
 		String vertexShaderName;
@@ -87,22 +105,51 @@ namespace cyclops {
 		Ref<osg::Shader> fragmentShaderBinary;
 		Ref<osg::Shader> geometryShaderBinary;
 
+		// Key of this program in the shared program registry. Empty for 
+		// programs that are not shared yet.
+		String registryKey;
+
 		// Geometry shader parameters
 		int geometryOutVertices;
 		PrimitiveType geometryInput;
 		PrimitiveType geometryOutput;
 	};
 
+	///////////////////////////////////////////////////////////////////////////
+	//! Compiled programs are shared between all shader managers: two managers
+	//! with the same shader macros and light variation use the same 
+	//! ProgramAsset and osg::Program. Shared programs are never modified when 
+	//! a manager changes variation: the manager switches to a different 
+	//! (shared or new) program instead, and bumps its program version so 
+	//! users can re-bind programs (see LightingLayer::updateLayer).
 	class CY_API ShaderManager: public ReferenceType
 	{
 	public:
 		typedef Dictionary<String, String> ShaderMacroDictionary;
 		typedef Dictionary<String, String> ShaderCache;
 
+		struct SharedProgram
+		{
+			Ref<ProgramAsset> asset;
+			int users;
+		};
+		typedef Dictionary<String, SharedProgram> ProgramRegistry;
+		typedef Dictionary<String, Ref<osg::Shader> > ShaderRegistry;
+
 		// A shader may process at most 8 simultaneous shadow maps.
 		static const int MaxShadows = 4;
 		// First texture unit used by shadow maps.
 		static const int ShadowFirstTexUnit = 4;
+		// Maximum number of lights that can be culled per-entity (size of the
+		// unif_LightCulled uniform array).
+		static const int MaxLights = 8;
+		// Texture unit used by the shadow atlas (after the standalone shadow
+		// map units).
+		static const int ShadowAtlasTexUnit = ShadowFirstTexUnit + MaxShadows;
+		// Texture unit whose eye planes give scene positions to shadow atlas
+		// lookups. Eye planes only exist for the first gl_MaxTextureCoords
+		// units (often 8), so this can't be the atlas texture unit.
+		static const int ShadowAtlasPositionUnit = ShadowFirstTexUnit - 1;
 
 	public:
 		ShaderManager();
@@ -130,20 +177,51 @@ namespace cyclops {
 
 		void recompileShaders();
 		void update();
+
+		//! Returns a number that changes every time the programs returned by
+		//! getOrCreateProgram are replaced (for instance, when the light 
+		//! configuration changes). Users holding programs should get them
+		//! again when this value changes.
+		int getProgramsVersion() { return myProgramsVersion; }
+
+		//! Sets the shadow atlas used by the shadow maps of this shading
+		//! environment. Pass NULL to use standalone shadow textures.
+		void setShadowAtlas(ShadowAtlas* atlas);
+		ShadowAtlas* getShadowAtlas() { return myShadowAtlas; }
 		//@}
 
+	protected:
+		//! Releases all programs used by this shader manager.
+		void releasePrograms();
+
 	private:
 		void loadShader(osg::Shader* shader, const String& name);
 		void compileShader(osg::Shader* shader, const String& source);
 
+		//! Binds the named program to the shared program for the current
+		//! shader variation, creating and compiling it if needed.
+		ProgramAsset* bindSharedProgram(ProgramAsset* program);
+		void releaseSharedProgram(ProgramAsset* program);
+		String getProgramKey(ProgramAsset* program, const String& variationName);
+		String getShaderKey(ProgramAsset* program, const String& fullShaderName, const String& source);
+		size_t getMacroSignature();
+
 	protected:
+		static ProgramRegistry sPrograms;
+		static ShaderRegistry sShaders;
+
 		Dictionary<String, Ref<ProgramAsset> > myPrograms;
-		Dictionary<String, Ref<osg::Shader> > myShaders;
 
 		ShaderMacroDictionary myShaderMacros;
-		ShaderCache myShaderCache;
+		// Files used to define macros through setShaderMacroToFile, reloaded
+		// by reloadAndRecompileShaders.
+		Dictionary<String, String> myShaderMacroFiles;
+		bool myMacroSignatureDirty;
+		size_t myMacroSignature;
+		int myProgramsVersion;
 
 		List<LightInstance*> myActiveLights;
+		Ref<ShadowAtlas> myShadowAtlas;
 
 		int myNumActiveLights;
 		String myActiveCacheId;
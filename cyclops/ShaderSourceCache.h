@@ -0,0 +1,92 @@
+/******************************************************************************
+ * THE OMEGA LIB PROJECT
+ *-----------------------------------------------------------------------------
+ * Copyright 2010-2015		Electronic Visualization Laboratory, 
+ *							University of Illinois at Chicago
+ * Authors:										
+ *  Alessandro Febretti		febret@gmail.com
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2010-2015, Electronic Visualization Laboratory,  
+ * University of Illinois at Chicago
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification, 
+ * are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this 
+ * list of conditions and the following disclaimer. Redistributions in binary 
+ * form must reproduce the above copyright notice, this list of conditions and 
+ * the following disclaimer in the documentation and/or other materials provided 
+ * with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE  GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-----------------------------------------------------------------------------
+ * What's in this file
+ *	A process-wide cache of shader source files, shared by all shader managers
+ *	and compositors.
+ ******************************************************************************/
+#ifndef __CY_SHADER_SOURCE_CACHE__
+#define __CY_SHADER_SOURCE_CACHE__
+
+#include "cyclopsConfig.h"
+
+#include <ctime>
+
+#define OMEGA_NO_GL_HEADERS
+#include <omega.h>
+
+namespace cyclops {
+    using namespace omega;
+
+    ///////////////////////////////////////////////////////////////////////////
+    //! Caches the content of shader source files. Files are read once per 
+    //! process: later requests for the same file do not touch the filesystem
+    //! until the cache is refreshed. All methods are thread safe.
+    class CY_API ShaderSourceCache
+    {
+    public:
+        //! Returns the source of a shader file, looking it up through the
+        //! data manager. Returns false if the file could not be found.
+        static bool getSource(const String& name, String& outSource);
+        //! Returns the source of a shader file from its full path. 
+        //! Returns false if the file could not be read.
+        static bool getFileSource(const String& path, String& outSource);
+
+        //! Reloads all cached files that changed on disk since they were
+        //! read. Files are compared by modification time and size, and by
+        //! content when they were modified in the second they were read, 
+        //! since modification times have a one second resolution. Returns 
+        //! the number of reloaded files.
+        static int refresh();
+        //! Removes a file from the cache, forcing a reload on next use.
+        static void invalidate(const String& name);
+        static void clear();
+
+    private:
+        struct Entry
+        {
+            String path;
+            String source;
+            time_t stamp;
+            long size;
+            time_t loadTime;
+        };
+
+        static bool loadEntry(const String& path, Entry& entry);
+        static bool getEntrySource(const String& name, const String& path, String& outSource);
+
+    private:
+        static Dictionary<String, Entry> sEntries;
+        static Lock sLock;
+    };
+};
+
+#endif
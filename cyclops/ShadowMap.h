@@ -52,15 +52,19 @@ namespace cyclops {
 
     class LightingLayer;
     class Light;
+    class ShadowAtlas;
 
     ///////////////////////////////////////////////////////////////////////////
     class CY_API ShadowMap: public ReferenceType
     {
     friend class Light;
     friend class LightingLayer;
+    friend class ShadowAtlas;
     public:
         static const int ReceivesShadowTraversalMask = 0x1;
         static const int CastsShadowTraversalMask = 0x2;
+        static const int StaticCasterTraversalMask = ShadowMapGenerator::StaticCasterTraversalMask;
+        static const int DynamicCasterTraversalMask = ShadowMapGenerator::DynamicCasterTraversalMask;
 
     public:
         ShadowMap();
@@ -77,12 +81,85 @@ namespace cyclops {
         void setSoftShadowParameters(float softnessWidth, float jitteringScale)
         { return myShadowMap->setSoftShadowParameters(softnessWidth, jitteringScale); }
 
-        void setDirty() 
-        { myShadowMap->setDirty(); }
+        //! Enables filterable (exponential variance) shadows. Filterable 
+        //! shadows are blurred and mipmapped once per shadow map update, and
+        //! cost a single filtered lookup per fragment. They take precedence
+        //! over soft shadows. Not supported by cascades and shadow atlases.
+        void setFilterable(bool value);
+        bool isFilterable()
+        { return myShadowMap->isFilterable(); }
+        //! Sets the blur radius in texels and the depth warping exponent of
+        //! filterable shadows (0 gives plain variance shadow maps).
+        void setFilterableShadowParameters(float blurRadius, float exponent)
+        { myShadowMap->setFilterableShadowParameters(blurRadius, exponent); }
+
+        //! Marks the shadow map for refresh. Scheduled shadow maps (see 
+        //! Light::ShadowRefreshMode) are refreshed when their layer schedules
+        //! them, before other scheduled shadow maps.
+        void setDirty();
+        //! Returns true if this shadow map is refreshed by its layer shadow
+        //! scheduler.
+        bool isScheduled()
+        { return myScheduled; }
+
+        //! Sets the number of cascades (1 to 4) used for directional light 
+        //! shadows. With more than one cascade, the view frustum is split in
+        //! sections, each one using its own shadow texture of the size set
+        //! by setTextureSize. Cascades are ignored for other light types.
+        void setCascades(int cascades);
+        //! Returns the number of cascades in use by this shadow map.
+        int getCascades()
+        { return myShadowMap->getCascades(); }
+        //! Sets the blend factor between logarithmic (1) and uniform (0) 
+        //! cascade split distances.
+        void setCascadeSplitLambda(float value)
+        { myShadowMap->setCascadeSplitLambda(value); }
+        //! Sets the view distance covered by cascades. Use 0 to cover the 
+        //! whole view frustum.
+        void setCascadeMaxDistance(float value)
+        { myShadowMap->setCascadeMaxDistance(value); }
+
+        //! Enables omnidirectional shadows for point lights. All six cube 
+        //! faces around the light get a shadow map of the size set by 
+        //! setTextureSize. Faces containing no casters are not rendered.
+        //! Ignored for other light types.
+        void setOmnidirectional(bool value);
+        //! Returns true if this shadow map is using omnidirectional shadows.
+        bool isOmnidirectional()
+        { return myShadowMap->isOmnidirectional(); }
+
+        //! Invalidates the cached static caster depth of all shadow maps 
+        //! using the StaticCached refresh mode (see Light::ShadowRefreshMode)
+        static void invalidateStaticCasters()
+        { ShadowMapGenerator::invalidateStaticCasters(); }
+
+        //! Returns the number of shadow passes rendered during the last 
+        //! frame, over all shadow maps.
+        static unsigned int getRenderedPassCount()
+        { return ShadowMapGenerator::getRenderedPassCount(); }
+        //! Returns the number of shadow passes skipped during the last frame
+        //! because their light could not affect the view.
+        static unsigned int getSkippedPassCount()
+        { return ShadowMapGenerator::getSkippedPassCount(); }
+
+        //! Returns the layer this shadow map is attached to.
+        LightingLayer* getLayer()
+        { return myLayer; }
+        //! Returns the atlas this shadow map renders to, or NULL if the 
+        //! shadow map uses its own texture.
+        ShadowAtlas* getAtlas()
+        { return myAtlas; }
+        //! Returns the index of the atlas shadow matrix used by this shadow
+        //! map, or -1 if the shadow map is not in an atlas.
+        int getAtlasSlot()
+        { return myAtlasSlot; }
         
     private:
         //! used by Light to notify tell this shadow map who is its owner.
         void setLight(Light* l); 
+        //! Enables or disables cascades and omnidirectional shadows based on
+        //! the light type.
+        void updateTechnique();
 
         // Attaches this shadow map to the specified layer
         void setLayer(LightingLayer* layer);
@@ -90,6 +167,19 @@ namespace cyclops {
         void removeFromLayer(LightingLayer* layer);
         void setManualRefreshEnabled(bool value) 
         { myShadowMap->setManualRefreshEnabled(value); }
+        void setStaticCachingEnabled(bool value) 
+        { myShadowMap->setStaticCachingEnabled(value); }
+        void setScheduled(bool value)
+        { myScheduled = value; }
+        //! Used by Light to pass its influence radius, used to cull shadow
+        //! passes of lights that can't affect the view.
+        void setInfluenceRadius(float value)
+        { myShadowMap->setInfluenceRadius(value); }
+        //! Used by the layer shadow scheduler to refresh this shadow map.
+        void refresh();
+        //! Used by ShadowAtlas to assign a rectangle of the atlas texture to 
+        //! this shadow map. Pass a NULL atlas to use a standalone texture.
+        void setAtlas(ShadowAtlas* atlas, int slot, const osg::Vec4i& rect);
         
     protected:
         virtual void initialize();
@@ -99,11 +189,72 @@ namespace cyclops {
         bool myInitialized;
         Light* myLight;
         int myShadowTextureUnit;
+        int myRequestedCascades;
+        bool myRequestedOmnidirectional;
+        int myTextureSize;
         LightingLayer* myLayer;
+        ShadowAtlas* myAtlas;
+        int myAtlasSlot;
+
+        // Scheduled refresh state
+        bool myScheduled;
+        bool myRefreshRequested;
+        int myFramesSinceRefresh;
         Ref<ShadowMapGenerator> myShadowMap;
         Ref<osgShadow::ShadowedScene> myShadowedScene;
     };
 
+    ///////////////////////////////////////////////////////////////////////////
+    //! A single depth texture shared by the shadow maps of a lighting layer.
+    //! Each shadow map renders to its own rectangle of the atlas and stores 
+    //! its shadow matrix in a uniform array, so shaders can access all 
+    //! shadows through a single sampler. Shadow matrices map scene positions
+    //! to the light frustum, and the rectangles uniform array maps the 
+    //! frustum to each atlas rectangle, so lookups outside a light frustum
+    //! never reach the rectangle of another light.
+    class CY_API ShadowAtlas: public ReferenceType
+    {
+    public:
+        static const int MinRectSize = 64;
+
+    public:
+        ShadowAtlas(LightingLayer* layer, int size, int slots);
+        ~ShadowAtlas();
+
+        LightingLayer* getLayer() { return myLayer; }
+        int getSize() { return mySize; }
+        osg::Texture2D* getTexture() { return myTexture; }
+        osg::Uniform* getMatricesUniform() { return myMatrices; }
+        osg::Uniform* getRectsUniform() { return myRects; }
+
+        //! Assigns atlas rectangles to the passed shadow maps. Shadow map i 
+        //! stores its shadow matrix in slot slots[i]. Rectangle sizes follow 
+        //! the shadow map texture sizes, and are halved until all shadow 
+        //! maps fit in the atlas. Shadow maps that are not passed anymore are
+        //! removed from the atlas. Returns false and does nothing if the 
+        //! shadow maps did not change since the last call.
+        bool pack(const List<ShadowMap*>& shadows, const List<int>& slots);
+        //! Removes all shadow maps from the atlas.
+        void clear();
+
+    private:
+        void resetSlot(int slot);
+
+    private:
+        LightingLayer* myLayer;
+        int mySize;
+        int mySlots;
+        Ref<osg::Texture2D> myTexture;
+        Ref<osg::Uniform> myMatrices;
+        Ref<osg::Uniform> myRects;
+
+        // The packed shadow maps, and the slots and texture sizes used to 
+        // pack them.
+        List< Ref<ShadowMap> > myShadows;
+        List<int> myShadowSlots;
+        List<int> myShadowSizes;
+    };
+
     ///////////////////////////////////////////////////////////////////////////
     /*class SoftShadowMap: public ShadowMap
     {
@@ -43,12 +43,25 @@
 #include <osg/MatrixTransform>
 #include <osg/LightSource>
 #include <osg/Texture3D>
+#include <osg/Texture2DArray>
+#include <osg/Vec4i>
+
+#include <map>
 
 #include <osgShadow/ShadowTechnique>
 
 namespace cyclops {
 	class CY_API ShadowMapGenerator : public osgShadow::ShadowTechnique
 	{
+    public :
+        /** Maximum number of cascades for cascaded shadow maps */
+        static const int MaxCascades = 4;
+        /** Node mask bits separating static and dynamic shadow casters, used
+          * when static caching is enabled. Nodes with both bits are rendered
+          * in both passes. */
+        static const unsigned int StaticCasterTraversalMask = 0x4;
+        static const unsigned int DynamicCasterTraversalMask = 0x8;
+
     public :
         ShadowMapGenerator();
         ShadowMapGenerator(const ShadowMapGenerator& es, const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY);
@@ -93,7 +106,7 @@ namespace cyclops {
 		{ myManualRefreshEnabled = value; }
 		
 		void setDirty() 
-		{ myDirty = true; }
+		{ myDirty = true; myStaticDirty = true; }
 
 		void setSoft(bool value);
 		bool isSoft() 
@@ -101,8 +114,114 @@ namespace cyclops {
 
 		void setSoftShadowParameters(float softnessWidth, float jitteringScale);
 
+        /** Enable filterable shadow maps. The shadow texture stores the
+          * first two moments of the exponentially warped caster depth, 
+          * blurred with a separable filter and mipmapped after each update,
+          * so shaders can read soft shadows with a single filtered lookup. 
+          * Not supported with cascades or shadow atlases. */
+        void setFilterable(bool value);
+        bool isFilterable() const { return myFilterable; }
+        /** Set the blur radius (in shadow map texels) and the depth warping
+          * exponent of filterable shadow maps. An exponent of 0 gives plain
+          * variance shadow maps. Higher exponents reduce light bleeding. */
+        void setFilterableShadowParameters(float blurRadius, float exponent);
+
+        /** Set the number of cascades used for directional lights. Each
+          * cascade covers the scene up to a split distance from the viewer
+          * and is rendered to a layer of a texture array. Cascades are fit
+          * when the shadow is refreshed, and shared by all views. 1 disables
+          * cascaded shadow maps. */
+        void setCascades(int cascades);
+        int getCascades() const { return myCascades; }
+
+        /** Set the blend factor between logarithmic (1) and uniform (0) 
+          * cascade split distances. */
+        void setCascadeSplitLambda(float value) { mySplitLambda = value; }
+        float getCascadeSplitLambda() const { return mySplitLambda; }
+
+        /** Set the view distance covered by cascades. Use 0 to cover the 
+          * view frustum up to the camera far plane. */
+        void setCascadeMaxDistance(float value) { myCascadeMaxDistance = value; }
+        float getCascadeMaxDistance() const { return myCascadeMaxDistance; }
+
+        /** Enable omnidirectional shadows for point lights. The six cube 
+          * faces are rendered to a 3x2 grid in a single depth texture, each
+          * face cell with the shadow texture size. Faces with no casters 
+          * are skipped, and each face projection is cropped to the casters 
+          * it contains. */
+        void setOmnidirectional(bool value);
+        bool isOmnidirectional() const { return myOmnidirectional; }
+
+        /** Render this shadow map to a rectangle of a shared atlas texture 
+          * instead of its own texture. The shadow matrix, taking scene 
+          * positions to the light frustum, is stored in element slot of the
+          * matrices uniform array. Shaders get scene positions from the eye 
+          * planes of textureUnit, set for each view. Pass a NULL texture to
+          * stop using the atlas. */
+        void setAtlas(osg::Texture2D* texture, osg::Uniform* matrices, int textureUnit, int slot, const osg::Vec4i& rect);
+
+        /** Enable static caster caching. Casters with the static caster bit
+          * in their node mask are rendered to a cached depth texture, only 
+          * when the light or a static caster changes. Every frame the cached
+          * depth is copied to the shadow map, and casters with the dynamic
+          * caster bit are rendered on top. Not supported with cascades or
+          * shadow atlases. */
+        void setStaticCachingEnabled(bool value);
+        bool isStaticCachingEnabled() const { return myStaticCachingEnabled; }
+
+        /** Invalidate the cached static caster depth of all shadow maps. Call
+          * this when static casters move, appear or disappear. */
+        static void invalidateStaticCasters() { sStaticCastersVersion++; }
+
+        /** Set the distance beyond which the light has no visible effect.
+          * Shadow passes are skipped when the light volume is outside the 
+          * view frustum, and shadow lookups are made always lit when no 
+          * caster is within the light volume. FLT_MAX disables culling. */
+        void setInfluenceRadius(float value) { myInfluenceRadius = value; }
+        float getInfluenceRadius() const { return myInfluenceRadius; }
+
+        /** Return the number of shadow passes rendered and skipped by light
+          * culling during the last completed frame, over all shadow maps. */
+        static unsigned int getRenderedPassCount();
+        static unsigned int getSkippedPassCount();
+
+        /** Return true if the camera renders the depth moments of a 
+          * filterable shadow map. Nodes pushing their own state during cull
+          * must not do it for these cameras, since the moments program needs
+          * to run on all casters. */
+        static bool isMomentsCamera(const osg::Camera* camera);
+
 	protected:
 		static void initJitterTexture();
+		osg::Camera* createShadowCamera();
+		void initCascades();
+		void cullAtlas(osgUtil::CullVisitor& cv, bool needShadowRefresh);
+		void initStaticCache();
+		void initFilterable();
+		//! Renders the static casters if the cached depth is out of date.
+		void cullStaticCasters(osgUtil::CullVisitor& cv, unsigned int traversalMask);
+		//! Returns the bounds of the shadow casters in the shadowed scene.
+		//! Bounds are computed at most once per frame for each node, and
+		//! shared by all shadow maps and cameras.
+		osg::BoundingBox getCasterBounds(osgUtil::CullVisitor& cv);
+		//! Returns true if the shadow map has already been rendered during
+		//! this frame on the graphics context of the passed cull visitor. 
+		//! Otherwise, marks it as rendered and returns false.
+		bool isRenderedOnContext(osgUtil::CullVisitor& cv);
+		//! Returns the bounding sphere of the light volume, in the shadowed
+		//! scene reference frame. Returns an invalid sphere if the light 
+		//! volume is unbounded.
+		osg::BoundingSphere getLightBounds(const osg::Light* light, const osg::Vec4& lightPos, const osg::Vec3& lightDir);
+		//! Makes all shadow lookups pass, used when no caster can shadow the
+		//! volume reached by the light.
+		void setUnshadowed(osgUtil::CullVisitor& cv);
+		void cullCascades(osgUtil::CullVisitor& cv, const osg::Vec3& lightDir, const osg::BoundingBox& bb, bool needShadowRefresh);
+		//! Computes the cascade cameras and matrices. Called with the context
+		//! render lock held.
+		void fitCascades(osgUtil::CullVisitor& cv, const osg::Vec3& lightDir, const osg::BoundingBox& bb);
+		void initCube();
+		void cullCube(osgUtil::CullVisitor& cv, const osg::Vec3& lightPos, const osg::BoundingBox& bb, bool needShadowRefresh);
+		void fitCube(const osg::Vec3& lightPos, const osg::BoundingBox& bb);
 
 	protected:
         virtual ~ShadowMapGenerator(void) {};
@@ -129,6 +248,70 @@ namespace cyclops {
 		bool myManualRefreshEnabled;
 		bool myDirty;
 		bool mySoft;
+		float myInfluenceRadius;
+
+		// Cascaded shadow maps
+		int myCascades;
+		float mySplitLambda;
+		float myCascadeMaxDistance;
+		osg::ref_ptr<osg::Texture2DArray> myCascadeTexture;
+		std::vector< osg::ref_ptr<osg::Camera> > myCascadeCameras;
+		osg::ref_ptr<osg::Uniform> myCascadeMatricesUniform;
+		// Cascades are spheres around this world position, fit at the last
+		// refresh.
+		osg::Vec3 myCascadeOrigin;
+		bool myCascadesFit;
+		unsigned int myCascadeFitFrame;
+
+		// Omnidirectional (cube) shadow maps
+		bool myOmnidirectional;
+		osg::ref_ptr<osg::Texture2D> myCubeTexture;
+		osg::ref_ptr<osg::Camera> myCubeCameras[6];
+		osg::ref_ptr<osg::Uniform> myCubeMatricesUniform;
+		// Faces are fit around this world position at the last refresh.
+		// Empty faces have no casters and are not rendered.
+		osg::Vec3 myCubeLightPosition;
+		bool myCubeFaceEmpty[6];
+		bool myCubeFit;
+		unsigned int myCubeFitFrame;
+
+		// Shadow atlas
+		osg::ref_ptr<osg::Texture2D> myAtlasTexture;
+		osg::ref_ptr<osg::Uniform> myAtlasMatrices;
+		osg::ref_ptr<osg::Camera> myAtlasCamera;
+		osg::ref_ptr<osg::TexGen> myAtlasTexGen;
+		int myAtlasTextureUnit;
+		int myAtlasSlot;
+		osg::Vec4i myAtlasRect;
+
+		// Filterable (exponential variance) shadow maps
+		bool myFilterable;
+		float myBlurRadius;
+		float myShadowExponent;
+		osg::ref_ptr<osg::Texture2D> myBlurTextures[2];
+		osg::ref_ptr<osg::Camera> myBlurCameras[2];
+		osg::ref_ptr<osg::Uniform> myBlurStepUniforms[2];
+		osg::ref_ptr<osg::Uniform> myShadowExponentUniform;
+		osg::ref_ptr<osg::Uniform> myMomentsExponentUniform;
+
+		// Frame at which the shadow map was last rendered, for each graphics
+		// context. Views sharing a context reuse the shadow map.
+		std::map<unsigned int, unsigned int> myContextRenderFrame;
+		Lock myContextRenderLock;
+
+		// Static caster caching
+		static unsigned int sStaticCastersVersion;
+		bool myStaticCachingEnabled;
+		bool myStaticDirty;
+		unsigned int myStaticCastersVersion;
+		osg::ref_ptr<osg::Texture2D> myStaticTexture;
+		osg::ref_ptr<osg::Camera> myStaticCamera;
+		osg::Matrix myStaticViewMatrix;
+		osg::Matrix myStaticProjectionMatrix;
+		// Caster bounds used to fit the shadow camera. Kept while the 
+		// current caster bounds fit in them, so dynamic casters moving 
+		// around do not invalidate the static cache.
+		osg::BoundingBox myStaticBounds;
     };
 }
 
@@ -58,6 +58,10 @@ namespace cyclops {
 
 		osg::Node* getNode() { return myNode; }
 
+		//! Binds the sky box program again when the scene manager replaced
+		//! its programs.
+		void update();
+
 	private:
 		osg::Node* createSkyBox();
 		void updateSkyBox();
@@ -68,6 +72,7 @@ namespace cyclops {
 		Ref<osg::Node> myNode;
 		Ref<osg::Geode> myGeode;
 		Ref<osg::Uniform> myTextureUniform;
+		int myProgramsVersion;
 
 		Ref<MoveSkyWithEyePointTransform> myTransform;
 	};
@@ -0,0 +1,66 @@
+# Checks that filterable shadow maps store caster depth moments, even when the
+# caster uses a lit material. A camera looks straight down at the ground
+# below a shadow casting sphere. The sphere is not drawn by this camera, so
+# the center of its output should be in shadow, and its corners lit. If the
+# material state leaks into the moments pass, the sphere writes its lit color
+# to the moments texture and the ground below it stays lit.
+from math import *
+from euclid import *
+from omega import *
+from cyclops import *
+
+size = 128
+
+scene = getSceneManager()
+
+# Ground, drawn by the default camera and the check camera.
+plane = PlaneShape.create(10, 10)
+plane.setPosition(Vector3(0, 0, -4))
+plane.pitch(radians(-90))
+plane.setEffect("colored -d white")
+
+# Material-lit caster, with a bright emissive color.
+sphere = SphereShape.create(0.5, 4)
+sphere.setPosition(Vector3(0, 1, -4))
+sphere.setEffect("colored -d white -e white")
+
+light = Light.create()
+light.setColor(Color("white"))
+light.setAmbient(Color("black"))
+light.setPosition(Vector3(0, 4, -4))
+light.setLightType(LightType.Spot)
+light.setLightDirection(Vector3(0, -1, 0))
+light.setSpotCutoff(60)
+light.setEnabled(True)
+
+sm = ShadowMap()
+sm.setTextureSize(512, 512)
+sm.setFilterable(True)
+light.setShadow(sm)
+
+# Check camera: only draws the ground, through an explicit material.
+cam = getOrCreateCamera('shadowCheck')
+cam.setPosition(Vector3(0, 3, -4))
+cam.pitch(radians(-90))
+cam.setFlag(Material.CameraDrawExplicitMaterials)
+output = PixelData.create(size, size, PixelFormat.FormatRgba)
+cam.getOutput(0).setReadbackTarget(output)
+cam.getOutput(0).setEnabled(True)
+
+groundMaterial = Material.create()
+groundMaterial.parse("colored -d white")
+groundMaterial.setCamera(cam)
+plane.addMaterial(groundMaterial)
+
+def onUpdate(frame, t, dt):
+	# Wait a few frames for the shadow map and readback to be ready.
+	if(frame == 30):
+		output.beginPixelAccess()
+		shadowed = output.getPixelR(size / 2, size / 2)
+		lit = output.getPixelR(size / 8, size / 8)
+		output.endPixelAccess()
+		if(shadowed * 2 < lit):
+			print("filterableShadow: OK (shadowed " + str(shadowed) + ", lit " + str(lit) + ")")
+		else:
+			print("filterableShadow: FAILED (shadowed " + str(shadowed) + ", lit " + str(lit) + ")")
+setUpdateFunction(onUpdate)
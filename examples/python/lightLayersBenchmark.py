@@ -0,0 +1,75 @@
+# Light update benchmark: 8 lights replicated across 16 nested lighting layers
+# (128 light instances). Lights stay still unless animation is enabled, so
+# this measures the per-frame cost of unchanged light instances. The time 
+# spent updating layers is also reported by the 'cyclops layers update' stat.
+from math import *
+from euclid import *
+from omega import *
+from cyclops import *
+from omegaToolkit import *
+
+numLights = 8
+numLayers = 16
+numSamples = 600
+
+scene = getSceneManager()
+
+ui = UiModule.createAndInitialize()
+wf = ui.getWidgetFactory()
+overlay = ui.getUi()
+
+label = wf.createLabel('label', overlay, '')
+label.setPosition(Vector2(5, 5))
+
+# Create the lights in the main lighting layer: they get instanced in all 
+# nested lighting layers.
+lights = []
+for i in range(0, numLights):
+	a = 2 * pi * i / numLights
+	l = Light.create()
+	l.setColor(Color(0.3, 0.3, 0.3, 1))
+	l.setAttenuation(1, 0.1, 0.1)
+	l.setPosition(Vector3(cos(a) * 4, 3, sin(a) * 4 - 6))
+	lights.append(l)
+
+# Create a chain of nested lighting layers, each one with a sphere.
+layer = scene.getLightingLayer()
+for i in range(0, numLayers):
+	child = LightingLayer()
+	layer.addLayer(child)
+	layer = child
+	s = SphereShape.create(0.3, 2)
+	s.setPosition(Vector3((i % 4) * 1.0 - 1.5, (i / 4) * 1.0 + 0.5, -6))
+	s.setEffect("colored -d white")
+	s.setLayer(layer)
+
+animate = False
+frames = 0
+totalTime = 0
+elapsed = 0
+
+def onEvent():
+	global animate
+	e = getEvent()
+	# Toggle light animation to compare against the all-dirty case.
+	if(e.isKeyDown(ord('a'))): animate = not animate
+
+def onUpdate(frame, t, dt):
+	global frames, totalTime, elapsed
+	elapsed = elapsed + dt
+	if(animate):
+		for i in range(0, numLights):
+			a = 2 * pi * i / numLights + elapsed
+			lights[i].setPosition(Vector3(cos(a) * 4, 3, sin(a) * 4 - 6))
+	frames = frames + 1
+	totalTime = totalTime + dt
+	if(frames == numSamples):
+		mode = 'animated' if animate else 'static'
+		msg = "%d lights x %d layers (%s): %.3f ms/frame" % (numLights, numLayers, mode, totalTime * 1000 / frames)
+		label.setText(msg)
+		print(msg)
+		frames = 0
+		totalTime = 0
+
+setEventFunction(onEvent)
+setUpdateFunction(onUpdate)
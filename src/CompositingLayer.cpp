@@ -34,14 +34,109 @@
 #include "cyclops/CompositingLayer.h"
 #include "cyclops/Uniforms.h"
 #include "cyclops/Entity.h"
+#include "cyclops/SceneManager.h"
+#include "cyclops/LightingLayer.h"
+#include "cyclops/ShaderSourceCache.h"
+#include "cyclops/EffectCache.h"
+
+#include <osgUtil/CullVisitor>
 
 using namespace cyclops;
 
+///////////////////////////////////////////////////////////////////////////////
+// Dynamic resolution controller settings. The scale changes when the average
+// frame time leaves a band around the target, and is then held for a number 
+// of frames, so it does not oscillate.
+static const float sResolutionScaleStep = 0.1f;
+static const float sFrameTimeHighRatio = 1.05f;
+static const float sFrameTimeLowRatio = 0.8f;
+static const int sRescaleHoldFrames = 30;
+// Seconds between checks for changed compositor files.
+static const float sReloadCheckInterval = 1.0f;
+// Frames a compositor instance can go without being drawn before it is 
+// released.
+static const unsigned int sInstanceReleaseFrames = 120;
+
+///////////////////////////////////////////////////////////////////////////////
+namespace cyclops {
+	// Draws each view through the compositor instance of its camera.
+	class CompositorInstanceCallback: public osg::NodeCallback
+	{
+	public:
+		CompositorInstanceCallback(CompositingLayer* layer): myLayer(layer)
+		{}
+
+		virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+		{
+			if(nv->getVisitorType() != osg::NodeVisitor::CULL_VISITOR ||
+				myLayer->myCompositor == NULL)
+			{
+				traverse(node, nv);
+				return;
+			}
+
+			osgUtil::CullVisitor* cv = (osgUtil::CullVisitor*)nv;
+			const osg::Viewport* vp = cv->getViewport();
+			const osg::FrameStamp* fs = cv->getFrameStamp();
+			if(vp == NULL || fs == NULL)
+			{
+				traverse(node, nv);
+				return;
+			}
+
+			// Retrieve the omegalib draw context from the osg cull visitor.
+			omegaOsg::OsgDrawInformation* odi = 
+				dynamic_cast<omegaOsg::OsgDrawInformation*>(cv->getRenderStage()->getCamera()->getUserData());
+			Camera* camera = odi != NULL ? odi->context->camera : NULL;
+
+			osg::Vec2i size((int)vp->width(), (int)vp->height());
+			Ref<Compositor> c = myLayer->getCompositorInstance(camera, size, fs->getFrameNumber());
+			// The main compositor is the child of the output node. Until the
+			// instance for this camera is ready, draw the scene as is.
+			if(c == myLayer->myCompositor) traverse(node, nv);
+			else if(c != NULL) c->accept(*nv);
+			else myLayer->myRoot->accept(*nv);
+		}
+
+	private:
+		CompositingLayer* myLayer;
+	};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets the fragment output of the surface shaders used by the lighting layers
+// below a layer.
+static void setFragmentOutput(SceneLayer* layer, const String& file)
+{
+	LightingLayer* ll = dynamic_cast<LightingLayer*>(layer);
+	if(ll != NULL)
+	{
+		ll->getShaderManager()->setShaderMacroToFile("fragmentOutputSection", file);
+		ll->getShaderManager()->recompileShaders();
+	}
+	foreach(Ref<SceneLayer> child, layer->getLayers())
+	{
+		setFragmentOutput(child, file);
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 CompositingLayer::CompositingLayer():
-	myShaderManager(new ShaderManager())
+	myShaderManager(new ShaderManager()),
+	myNormalDepthOutputEnabled(false),
+	myHotReloadEnabled(false),
+	myTimeSinceReloadCheck(0),
+	myDynamicResolutionEnabled(false),
+	myTargetFrameTime(1.0f / 60),
+	myMinResolutionScale(0.5f),
+	myAverageFrameTime(0),
+	myFramesSinceRescale(0),
+	myMainCamera(NULL),
+	myMainCullFrame(0),
+	myLastCullFrame(0)
 {
 	myOutputNode = new osg::Group();
+	myOutputNode->setCullCallback(new CompositorInstanceCallback(this));
 
 	// Since there is no compositor loaded now, directly attach the root group
 	// to the output node.
@@ -71,6 +166,9 @@ void CompositingLayer::reset()
 		myOutputNode->addChild(myRoot);
 		myCompositor = NULL;
 	}
+	clearCompositorInstances();
+	myCompositorFile = "";
+	updateSceneOutputs();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -81,18 +179,106 @@ void CompositingLayer::loadCompositor(const String& filename)
 	myCompositor = readEffectFile(filename);
 	if(myCompositor != NULL)
 	{
+		myCompositorFile = filename;
+		myFramesSinceRescale = 0;
 		myOutputNode->removeChild(myRoot);
 		myOutputNode->addChild(myCompositor);
 		myCompositor->addChild(myRoot);
+		updateSceneOutputs();
+	}
+	// Images of the previous compositor may not be used anymore.
+	EffectCache::releaseUnusedImages();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::updateSceneOutputs()
+{
+	bool normalDepth = myCompositor != NULL && myCompositor->hasMultipleTargetScenePass();
+	if(normalDepth == myNormalDepthOutputEnabled) return;
+	myNormalDepthOutputEnabled = normalDepth;
+
+	String file = normalDepth ? 
+		"cyclops/common/fragmentOutput/normalDepth.frag" : 
+		"cyclops/common/fragmentOutput/default.frag";
+	oflog(Verbose, "CompositingLayer: scene fragment output set to %1%", %file);
+
+	myShaderManager->setShaderMacroToFile("fragmentOutputSection", file);
+	myShaderManager->recompileShaders();
+	foreach(Ref<SceneLayer> child, getLayers())
+	{
+		setFragmentOutput(child, file);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::reloadCompositor()
+{
+	if(myCompositor == NULL) return;
+
+	// Make sure changed shader files are read again.
+	ShaderSourceCache::refresh();
+	if(reloadEffectFile(myCompositor, myCompositorFile))
+	{
+		ofmsg("CompositingLayer: updated compositor %1%", %myCompositorFile);
+		// Instances are copies of the old passes: create them again.
+		clearCompositorInstances();
+		updateSceneOutputs();
+		EffectCache::releaseUnusedImages();
+	}
+	else
+	{
+		ofmsg("CompositingLayer: reloading compositor %1%", %myCompositorFile);
+		String filename = myCompositorFile;
+		bool profiling = isProfilingEnabled();
+		loadCompositor(filename);
+		setProfilingEnabled(profiling);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::setTechnique(const String& name)
+{
+	if(myCompositor != NULL)
+	{
+		const Compositor::PassListMap& techniques = myCompositor->getAllTechniques();
+		if(techniques.find(name) == techniques.end())
+		{
+			ofwarn("CompositingLayer::setTechnique: unknown technique %1%", %name);
+			return;
+		}
+		myCompositor->setCurrentTechnique(name);
+		myInstancesLock.lock();
+		typedef std::map<Camera*, CompositorInstance>::iterator InstanceIterator;
+		for(InstanceIterator it = myCompositorInstances.begin(); it != myCompositorInstances.end(); it++)
+		{
+			it->second.compositor->setCurrentTechnique(name);
+		}
+		myInstancesLock.unlock();
+		updateSceneOutputs();
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+String CompositingLayer::getTechnique()
+{
+	if(myCompositor != NULL) return myCompositor->getCurrentTechnique();
+	return "";
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void CompositingLayer::setPassActive(const String& passName, bool active)
 {
 	if(myCompositor != NULL)
 	{
 		myCompositor->setPassActivated(passName, active);
+		myInstancesLock.lock();
+		typedef std::map<Camera*, CompositorInstance>::iterator InstanceIterator;
+		for(InstanceIterator it = myCompositorInstances.begin(); it != myCompositorInstances.end(); it++)
+		{
+			it->second.compositor->setPassActivated(passName, active);
+		}
+		myInstancesLock.unlock();
+		updateSceneOutputs();
 	}
 }
 
@@ -119,3 +305,281 @@ cyclops::Uniform* CompositingLayer::getUniform(const String& name)
 	}
 	return NULL;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::setDynamicResolutionEnabled(bool value)
+{
+	myDynamicResolutionEnabled = value;
+	myAverageFrameTime = 0;
+	myFramesSinceRescale = 0;
+	// Go back to full resolution when disabling.
+	if(!value && myCompositor != NULL) setCompositorResolutionScale(1.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+float CompositingLayer::getResolutionScale()
+{
+	if(myCompositor != NULL) return myCompositor->getResolutionScale();
+	return 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::updateLayer()
+{
+	if(myCompositor == NULL) return;
+
+	float dt = SceneManager::instance()->getFrameTime();
+	if(myHotReloadEnabled)
+	{
+		myTimeSinceReloadCheck += dt;
+		if(myTimeSinceReloadCheck >= sReloadCheckInterval)
+		{
+			myTimeSinceReloadCheck = 0;
+			if(myCompositor->areSourceFilesChanged()) reloadCompositor();
+		}
+	}
+
+	if(myCompositor == NULL) return;
+	if(myCompositor->getProfilingEnabled()) updateProfilingStats();
+	if(myDynamicResolutionEnabled) updateDynamicResolution();
+	updateCompositorInstances();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Ref<Compositor> CompositingLayer::getCompositorInstance(Camera* camera, const osg::Vec2i& size, unsigned int frame)
+{
+	Ref<Compositor> c = NULL;
+	myInstancesLock.lock();
+	if(frame > myLastCullFrame) myLastCullFrame = frame;
+
+	// The first camera culled takes the main compositor. Views without an 
+	// omegalib camera are drawn by it too.
+	if(myMainCamera == NULL) myMainCamera = camera;
+	if(camera == NULL || camera == myMainCamera)
+	{
+		c = myCompositor;
+		myMainCullFrame = frame;
+	}
+	else
+	{
+		std::map<Camera*, CompositorInstance>::iterator it = myCompositorInstances.find(camera);
+		if(it != myCompositorInstances.end())
+		{
+			c = it->second.compositor;
+			it->second.lastCullFrame = frame;
+		}
+		else
+		{
+			// Tiles of a camera request the size of their largest viewport.
+			osg::Vec2i& requested = myRequestedInstances[camera];
+			requested.set(osg::maximum(size.x(), requested.x()), osg::maximum(size.y(), requested.y()));
+		}
+	}
+	myInstancesLock.unlock();
+	return c;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::updateCompositorInstances()
+{
+	myInstancesLock.lock();
+	typedef std::map<Camera*, CompositorInstance>::iterator InstanceIterator;
+
+	// Release instances of cameras that are not drawn anymore. This also 
+	// keeps a camera created at the address of a deleted one from getting its
+	// instance for long.
+	InstanceIterator it = myCompositorInstances.begin();
+	while(it != myCompositorInstances.end())
+	{
+		if(myLastCullFrame - it->second.lastCullFrame > sInstanceReleaseFrames)
+		{
+			oflog(Verbose, "CompositingLayer: releasing compositor instance (%1% left)",
+				%(myCompositorInstances.size() - 1));
+			myCompositorInstances.erase(it++);
+		}
+		else it++;
+	}
+
+	// If the main camera is not drawn anymore, the main compositor takes over
+	// the camera of an instance, and the instance is released. Cull threads 
+	// still drawing it hold a reference to it.
+	if(myLastCullFrame - myMainCullFrame > sInstanceReleaseFrames && !myCompositorInstances.empty())
+	{
+		it = myCompositorInstances.begin();
+		myMainCamera = it->first;
+		osg::Vec2i size = it->second.compositor->getViewportSize();
+		if(size.x() > 0) myCompositor->setViewportSize(size.x(), size.y());
+		myCompositorInstances.erase(it);
+		myMainCullFrame = myLastCullFrame;
+	}
+
+	typedef std::map<Camera*, osg::Vec2i>::iterator RequestIterator;
+	for(RequestIterator rit = myRequestedInstances.begin(); rit != myRequestedInstances.end(); rit++)
+	{
+		if(rit->first == myMainCamera) continue;
+		oflog(Verbose, "CompositingLayer: creating compositor instance for %1%x%2% viewports",
+			%rit->second.x() %rit->second.y());
+		CompositorInstance& ci = myCompositorInstances[rit->first];
+		ci.compositor = myCompositor->createInstance();
+		ci.compositor->setViewportSize(rit->second.x(), rit->second.y());
+		ci.lastCullFrame = myLastCullFrame;
+	}
+	myRequestedInstances.clear();
+
+	// Buffers are resized here and not while culling, since other views may
+	// be drawing them.
+	myCompositor->updateViewportSize();
+	for(it = myCompositorInstances.begin(); it != myCompositorInstances.end(); it++)
+	{
+		it->second.compositor->updateViewportSize();
+	}
+
+	// Instances drawing viewports of the same size share the render targets
+	// that don't keep contents across frames. Resized instances get their own
+	// copy of them first, so sharing is checked again every frame.
+	for(it = myCompositorInstances.begin(); it != myCompositorInstances.end(); it++)
+	{
+		osg::Vec2i size = it->second.compositor->getViewportSize();
+		for(InstanceIterator other = myCompositorInstances.begin(); other != it; other++)
+		{
+			if(other->second.compositor->getViewportSize() == size)
+			{
+				it->second.compositor->shareRenderTargets(other->second.compositor);
+				break;
+			}
+		}
+	}
+	myInstancesLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::clearCompositorInstances()
+{
+	myInstancesLock.lock();
+	myCompositorInstances.clear();
+	myRequestedInstances.clear();
+	myMainCamera = NULL;
+	myInstancesLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int CompositingLayer::getNumCompositorInstances()
+{
+	myInstancesLock.lock();
+	int n = myCompositorInstances.size();
+	myInstancesLock.unlock();
+	return n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::setCompositorResolutionScale(float scale)
+{
+	myCompositor->setResolutionScale(scale);
+	myInstancesLock.lock();
+	typedef std::map<Camera*, CompositorInstance>::iterator InstanceIterator;
+	for(InstanceIterator it = myCompositorInstances.begin(); it != myCompositorInstances.end(); it++)
+	{
+		it->second.compositor->setResolutionScale(scale);
+	}
+	myInstancesLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::updateProfilingStats()
+{
+	StatsManager* sm = SystemManager::instance()->getStatsManager();
+	const Compositor::PassList& passes = myCompositor->getPassList();
+	for(unsigned int i = 0; i < passes.size(); i++)
+	{
+		const Compositor::PassData& pd = passes[i];
+		if(!pd.timer.valid() || !pd.activated || pd.culled) continue;
+
+		if(myPassCullStats.find(pd.name) == myPassCullStats.end())
+		{
+			myPassCullStats[pd.name] = sm->createStat("cyclops pass " + pd.name + " cull", Stat::Time);
+			myPassGpuStats[pd.name] = sm->createStat("cyclops pass " + pd.name + " gpu", Stat::Time);
+		}
+		myPassCullStats[pd.name]->addSample(pd.timer->getCullTime());
+		myPassGpuStats[pd.name]->addSample(pd.timer->getGpuTime());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::setProfilingEnabled(bool value)
+{
+	if(myCompositor != NULL) myCompositor->setProfilingEnabled(value);
+	myInstancesLock.lock();
+	typedef std::map<Camera*, CompositorInstance>::iterator InstanceIterator;
+	for(InstanceIterator it = myCompositorInstances.begin(); it != myCompositorInstances.end(); it++)
+	{
+		it->second.compositor->setProfilingEnabled(value);
+	}
+	myInstancesLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool CompositingLayer::isProfilingEnabled()
+{
+	if(myCompositor != NULL) return myCompositor->getProfilingEnabled();
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+String CompositingLayer::getProfile()
+{
+	if(myCompositor != NULL) return myCompositor->getProfilingDescription();
+	return "";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+float CompositingLayer::getPassCullTime(const String& passName)
+{
+	Compositor::PassData pd;
+	if(myCompositor != NULL && myCompositor->getPassData(passName, pd) && pd.timer.valid())
+	{
+		return pd.timer->getCullTime();
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+float CompositingLayer::getPassGpuTime(const String& passName)
+{
+	Compositor::PassData pd;
+	if(myCompositor != NULL && myCompositor->getPassData(passName, pd) && pd.timer.valid())
+	{
+		return pd.timer->getGpuTime();
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositingLayer::updateDynamicResolution()
+{
+	// Smooth the frame time, to ignore isolated spikes.
+	float dt = SceneManager::instance()->getFrameTime();
+	if(myAverageFrameTime == 0) myAverageFrameTime = dt;
+	else myAverageFrameTime = myAverageFrameTime * 0.9f + dt * 0.1f;
+
+	myFramesSinceRescale++;
+	if(myFramesSinceRescale < sRescaleHoldFrames) return;
+
+	float scale = myCompositor->getResolutionScale();
+	float newScale = scale;
+	if(myAverageFrameTime > myTargetFrameTime * sFrameTimeHighRatio)
+	{
+		newScale = std::max(myMinResolutionScale, scale - sResolutionScaleStep);
+	}
+	else if(myAverageFrameTime < myTargetFrameTime * sFrameTimeLowRatio)
+	{
+		newScale = std::min(1.0f, scale + sResolutionScaleStep);
+	}
+
+	if(newScale != scale)
+	{
+		oflog(Verbose, "CompositingLayer: frame time %1%ms, resolution scale %2%", 
+			%(myAverageFrameTime * 1000) %newScale);
+		setCompositorResolutionScale(newScale);
+		myFramesSinceRescale = 0;
+	}
+}
@@ -4,9 +4,17 @@
 #include <osg/View>
 #include <osgUtil/CullVisitor>
 #include <osg/BlendFunc>
+#include <osg/Texture2D>
+#include <osg/GLExtensions>
+#include <osg/buffered_value>
 #include <iostream>
+#include <iomanip>
 #include <sstream>
+#include <algorithm>
+#include <deque>
+#include <set>
 #include "cyclops/Compositor.h"
+#include "omegaOsg/omegaOsg/OsgRenderPass.h"
 
 using namespace cyclops;
 
@@ -42,7 +50,11 @@ public:
                 cv->clampProjectionMatrix( projection, znear, zfar );
                 
                 const osg::FrameStamp* fs = cv->getFrameStamp();
-                if ( fs ) _compositor->setPreservedNearAndFar( fs->getFrameNumber(), znear, zfar );
+                if ( fs && cv->getRenderStage() )
+                {
+                    _compositor->setPreservedNearAndFar( cv->getRenderStage()->getCamera(),
+                                                         fs->getFrameNumber(), znear, zfar );
+                }
             }
             else if ( camera->getNumChildren()>0 )  // Use camera's own children as display surface
                 camera->osg::Group::traverse( *nv );
@@ -58,13 +70,401 @@ protected:
     Compositor::PassType _type;
 };
 
+/* Buffer aliasing helpers */
+
+struct BufferLifetime
+{
+    std::string name;
+    int first, last;
+    bool aliasable;
+    bool dynamicResolution;
+    osg::Vec2 viewportScale;  // 0 for buffers which don't follow the viewport size
+    
+    BufferLifetime() : first(-1), last(-1), aliasable(true), dynamicResolution(false) {}
+};
+
+struct SharedRenderTarget
+{
+    std::string owner;
+    osg::ref_ptr<osg::Texture> texture;
+    int last;
+    bool dynamicResolution;
+    osg::Vec2 viewportScale;
+};
+
+static int findProducerPass( const Compositor::PassList& passList, unsigned int consumer, const std::string& buffer )
+{
+    // The producer is the last activated pass writing the buffer before the consumer. If
+    // there is none, the consumer reads what was written during the previous frame.
+    int numPasses = passList.size();
+    for ( int n=1; n<=numPasses; ++n )
+    {
+        int i = ((int)consumer - n + numPasses) % numPasses;
+        const Compositor::PassData& pd = passList[i];
+        if ( !pd.activated ) continue;
+        if ( std::find(pd.outputs.begin(), pd.outputs.end(), buffer)!=pd.outputs.end() )
+            return i;
+    }
+    return -1;
+}
+
+static bool isEarlierBuffer( const BufferLifetime& a, const BufferLifetime& b )
+{ return a.first<b.first; }
+
+static bool isBufferCompatible( const osg::Texture* a, const osg::Texture* b )
+{
+    // Only plain 2D render targets are shared for now
+    const osg::Texture2D* a2D = dynamic_cast<const osg::Texture2D*>(a);
+    const osg::Texture2D* b2D = dynamic_cast<const osg::Texture2D*>(b);
+    if ( !a2D || !b2D ) return false;
+    
+    return a2D->getTextureWidth()==b2D->getTextureWidth() &&
+           a2D->getTextureHeight()==b2D->getTextureHeight() &&
+           a2D->getInternalFormat()==b2D->getInternalFormat() &&
+           a2D->getSourceFormat()==b2D->getSourceFormat() &&
+           a2D->getSourceType()==b2D->getSourceType() &&
+           a2D->getFilter(osg::Texture::MIN_FILTER)==b2D->getFilter(osg::Texture::MIN_FILTER) &&
+           a2D->getFilter(osg::Texture::MAG_FILTER)==b2D->getFilter(osg::Texture::MAG_FILTER) &&
+           a2D->getWrap(osg::Texture::WRAP_S)==b2D->getWrap(osg::Texture::WRAP_S) &&
+           a2D->getWrap(osg::Texture::WRAP_T)==b2D->getWrap(osg::Texture::WRAP_T) &&
+           a2D->getResizeNonPowerOfTwoHint()==b2D->getResizeNonPowerOfTwoHint();
+}
+
+static void replacePassTexture( Compositor::PassData& pd, osg::Texture* oldTex, osg::Texture* newTex )
+{
+    if ( oldTex==newTex || !pd.pass ) return;
+    osg::Camera* camera = pd.pass.get();
+    
+    // Output attachments. Iterate on a copy, since attaching modifies the map
+    osg::Camera::BufferAttachmentMap attachments = camera->getBufferAttachmentMap();
+    for ( osg::Camera::BufferAttachmentMap::iterator itr=attachments.begin();
+          itr!=attachments.end(); ++itr )
+    {
+        const osg::Camera::Attachment& a = itr->second;
+        if ( a._texture.get()==oldTex )
+        {
+            camera->attach( itr->first, newTex, a._level, a._face, a._mipMapGeneration,
+                            a._multisampleSamples, a._multisampleColorSamples );
+        }
+    }
+    
+    // Input textures
+    osg::StateSet* stateset = camera->getStateSet();
+    if ( !stateset ) return;
+    for ( unsigned int unit=0; unit<stateset->getTextureAttributeList().size(); ++unit )
+    {
+        const osg::StateSet::RefAttributePair* pair =
+            stateset->getTextureAttributePair( unit, osg::StateAttribute::TEXTURE );
+        if ( pair && pair->first.get()==oldTex )
+        {
+            osg::StateAttribute::OverrideValue value = pair->second;
+            stateset->setTextureAttributeAndModes( unit, newTex, value );
+        }
+    }
+}
+
+typedef std::map<osg::Uniform*, osg::ref_ptr<osg::Uniform> > UniformReplacementMap;
+
+static void replaceStateSetUniforms( osg::StateSet* stateset, const UniformReplacementMap& replacements )
+{
+    if ( !stateset ) return;
+    
+    // Iterate on a copy, since replacing uniforms modifies the list
+    osg::StateSet::UniformList uniforms = stateset->getUniformList();
+    for ( osg::StateSet::UniformList::iterator itr=uniforms.begin(); itr!=uniforms.end(); ++itr )
+    {
+        UniformReplacementMap::const_iterator ritr = replacements.find( itr->second.first.get() );
+        if ( ritr!=replacements.end() ) stateset->addUniform( ritr->second.get(), itr->second.second );
+    }
+}
+
+/* PassTimer */
+
+void PassTimer::FrameTime::add( unsigned int f, double ms )
+{
+    // Only keep a few frames: results of older frames are too late to be recorded
+    static const unsigned int maxFrames = 4;
+    if ( frames.size()>=maxFrames && f<frames.begin()->first ) return;
+    
+    frames[f] += ms;
+    while ( frames.size()>maxFrames ) frames.erase( frames.begin() );
+    
+    // Results of a frame are complete when results of a later frame come in
+    if ( frames.size()>1 ) last = (++frames.rbegin())->second;
+}
+
+void PassTimer::addCullTime( unsigned int frame, double ms )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _cullTime.add( frame, ms );
+}
+
+void PassTimer::addGpuTime( unsigned int frame, double ms )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _gpuTime.add( frame, ms );
+}
+
+double PassTimer::getCullTime() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _cullTime.last;
+}
+
+double PassTimer::getGpuTime() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    return _gpuTime.last;
+}
+
+/* GpuPassTimer */
+
+#ifndef GL_TIMESTAMP
+#define GL_TIMESTAMP 0x8E28
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+
+typedef void (GL_APIENTRY * GLGenQueriesProc)( GLsizei n, GLuint* ids );
+typedef void (GL_APIENTRY * GLDeleteQueriesProc)( GLsizei n, const GLuint* ids );
+typedef void (GL_APIENTRY * GLQueryCounterProc)( GLuint id, GLenum target );
+typedef void (GL_APIENTRY * GLGetQueryObjectivProc)( GLuint id, GLenum pname, GLint* params );
+typedef void (GL_APIENTRY * GLGetQueryObjectui64vProc)( GLuint id, GLenum pname, unsigned long long* params );
+
+/** Measures the GPU time of a pass with a pair of timestamp queries around it. Results
+    are read when available, so the rendering never waits for them. Without a pass timer
+    (profiling disabled) the queries of each context are deleted the next time it draws */
+class GpuPassTimer : public osg::Referenced
+{
+public:
+    GpuPassTimer( PassTimer* timer ) : _timer(timer) {}
+    
+    void setTimer( PassTimer* timer )
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        _timer = timer;
+    }
+    
+    void begin( osg::RenderInfo& renderInfo )
+    {
+        ContextData& cd = _contextData[renderInfo.getContextID()];
+        osg::ref_ptr<PassTimer> timer = getTimer();
+        if ( !timer )
+        {
+            releaseQueries( cd );
+            return;
+        }
+        if ( !cd.initialized ) initialize( cd );
+        if ( !cd.supported ) return;
+        
+        collectResults( cd, timer.get() );
+        const osg::FrameStamp* fs = renderInfo.getState()->getFrameStamp();
+        cd.current.frame = fs ? fs->getFrameNumber() : 0;
+        cd.current.begin = allocateQuery( cd );
+        cd.queryCounter( cd.current.begin, GL_TIMESTAMP );
+    }
+    
+    void end( osg::RenderInfo& renderInfo )
+    {
+        ContextData& cd = _contextData[renderInfo.getContextID()];
+        if ( !cd.supported || !cd.current.begin ) return;
+        
+        cd.current.end = allocateQuery( cd );
+        cd.queryCounter( cd.current.end, GL_TIMESTAMP );
+        cd.pending.push_back( cd.current );
+        cd.current = Query();
+    }
+    
+protected:
+    struct Query
+    {
+        GLuint begin, end;
+        unsigned int frame;
+        Query() : begin(0), end(0), frame(0) {}
+    };
+    
+    struct ContextData
+    {
+        bool initialized, supported;
+        GLGenQueriesProc genQueries;
+        GLDeleteQueriesProc deleteQueries;
+        GLQueryCounterProc queryCounter;
+        GLGetQueryObjectivProc getQueryObjectiv;
+        GLGetQueryObjectui64vProc getQueryObjectui64v;
+        std::vector<GLuint> freeQueries;
+        std::deque<Query> pending;
+        Query current;
+        
+        ContextData() : initialized(false), supported(false), genQueries(NULL), deleteQueries(NULL),
+                        queryCounter(NULL), getQueryObjectiv(NULL), getQueryObjectui64v(NULL) {}
+    };
+    
+    osg::ref_ptr<PassTimer> getTimer()
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        return _timer;
+    }
+    
+    void initialize( ContextData& cd )
+    {
+        cd.initialized = true;
+        osg::setGLExtensionFuncPtr( cd.genQueries, "glGenQueries", "glGenQueriesARB" );
+        osg::setGLExtensionFuncPtr( cd.deleteQueries, "glDeleteQueries", "glDeleteQueriesARB" );
+        osg::setGLExtensionFuncPtr( cd.queryCounter, "glQueryCounter" );
+        osg::setGLExtensionFuncPtr( cd.getQueryObjectiv, "glGetQueryObjectiv", "glGetQueryObjectivARB" );
+        osg::setGLExtensionFuncPtr( cd.getQueryObjectui64v, "glGetQueryObjectui64v", "glGetQueryObjectui64vEXT" );
+        cd.supported = cd.genQueries && cd.deleteQueries && cd.queryCounter && 
+                       cd.getQueryObjectiv && cd.getQueryObjectui64v;
+        if ( !cd.supported )
+            owarn("Compositor: timer queries not supported, GPU pass times are not available");
+    }
+    
+    GLuint allocateQuery( ContextData& cd )
+    {
+        if ( cd.freeQueries.empty() )
+        {
+            GLuint id = 0;
+            cd.genQueries( 1, &id );
+            return id;
+        }
+        GLuint id = cd.freeQueries.back();
+        cd.freeQueries.pop_back();
+        return id;
+    }
+    
+    void collectResults( ContextData& cd, PassTimer* timer )
+    {
+        while ( !cd.pending.empty() )
+        {
+            const Query& query = cd.pending.front();
+            GLint available = 0;
+            cd.getQueryObjectiv( query.end, GL_QUERY_RESULT_AVAILABLE, &available );
+            if ( !available ) break;
+            
+            unsigned long long beginTime = 0, endTime = 0;
+            cd.getQueryObjectui64v( query.begin, GL_QUERY_RESULT, &beginTime );
+            cd.getQueryObjectui64v( query.end, GL_QUERY_RESULT, &endTime );
+            if ( endTime>beginTime ) timer->addGpuTime( query.frame, (endTime - beginTime) * 1e-6 );
+            
+            cd.freeQueries.push_back( query.begin );
+            cd.freeQueries.push_back( query.end );
+            cd.pending.pop_front();
+        }
+    }
+    
+    void releaseQueries( ContextData& cd )
+    {
+        if ( !cd.supported ) return;
+        for ( unsigned int i=0; i<cd.pending.size(); ++i )
+        {
+            cd.freeQueries.push_back( cd.pending[i].begin );
+            cd.freeQueries.push_back( cd.pending[i].end );
+        }
+        if ( cd.current.begin ) cd.freeQueries.push_back( cd.current.begin );
+        if ( !cd.freeQueries.empty() )
+            cd.deleteQueries( (GLsizei)cd.freeQueries.size(), &cd.freeQueries[0] );
+        cd.freeQueries.clear();
+        cd.pending.clear();
+        cd.current = Query();
+    }
+    
+    osg::ref_ptr<PassTimer> _timer;
+    OpenThreads::Mutex _mutex;
+    osg::buffered_object<ContextData> _contextData;
+};
+
+/** Draw callbacks running the GPU timer around a pass, then calling the callback that
+    was set on the pass before */
+class GpuTimerBeginCallback : public osg::Camera::DrawCallback
+{
+public:
+    GpuTimerBeginCallback( GpuPassTimer* timer, osg::Camera::DrawCallback* nested )
+    : _timer(timer), _nested(nested) {}
+    
+    virtual void operator()( osg::RenderInfo& renderInfo ) const
+    {
+        if ( _nested.valid() ) (*_nested)( renderInfo );
+        _timer->begin( renderInfo );
+    }
+    
+    GpuPassTimer* getTimer() const { return _timer.get(); }
+    osg::Camera::DrawCallback* getNested() const { return _nested.get(); }
+    
+protected:
+    osg::ref_ptr<GpuPassTimer> _timer;
+    osg::ref_ptr<osg::Camera::DrawCallback> _nested;
+};
+
+class GpuTimerEndCallback : public osg::Camera::DrawCallback
+{
+public:
+    GpuTimerEndCallback( GpuPassTimer* timer, osg::Camera::DrawCallback* nested )
+    : _timer(timer), _nested(nested) {}
+    
+    virtual void operator()( osg::RenderInfo& renderInfo ) const
+    {
+        _timer->end( renderInfo );
+        if ( _nested.valid() ) (*_nested)( renderInfo );
+    }
+    
+    osg::Camera::DrawCallback* getNested() const { return _nested.get(); }
+    
+protected:
+    osg::ref_ptr<GpuPassTimer> _timer;
+    osg::ref_ptr<osg::Camera::DrawCallback> _nested;
+};
+
+static void attachPassTimer( Compositor::PassData& pd )
+{
+    if ( pd.timer.valid() || !pd.pass ) return;
+    pd.timer = new PassTimer;
+    
+    // The timer callbacks stay on the pass once installed (see detachPassTimer)
+    GpuTimerBeginCallback* begin = dynamic_cast<GpuTimerBeginCallback*>( pd.pass->getInitialDrawCallback() );
+    if ( begin )
+    {
+        begin->getTimer()->setTimer( pd.timer.get() );
+        return;
+    }
+    
+    // Draw callbacks are only called for passes rendered to their own render stage,
+    // so nested passes only get a cull time
+    osg::ref_ptr<GpuPassTimer> gpuTimer = new GpuPassTimer( pd.timer.get() );
+    pd.pass->setInitialDrawCallback( new GpuTimerBeginCallback(gpuTimer.get(), pd.pass->getInitialDrawCallback()) );
+    pd.pass->setFinalDrawCallback( new GpuTimerEndCallback(gpuTimer.get(), pd.pass->getFinalDrawCallback()) );
+}
+
+static void detachPassTimer( Compositor::PassData& pd )
+{
+    pd.timer = NULL;
+    if ( !pd.pass ) return;
+    
+    // Keep the callbacks: the timer queries are deleted when each context draws the pass
+    GpuTimerBeginCallback* begin = dynamic_cast<GpuTimerBeginCallback*>( pd.pass->getInitialDrawCallback() );
+    if ( begin ) begin->getTimer()->setTimer( NULL );
+}
+
+/** Remove the timer callbacks of a pass, restoring the callbacks they were chained to */
+static void removePassTimerCallbacks( osg::Camera* pass )
+{
+    GpuTimerBeginCallback* begin = dynamic_cast<GpuTimerBeginCallback*>( pass->getInitialDrawCallback() );
+    if ( begin ) pass->setInitialDrawCallback( begin->getNested() );
+    GpuTimerEndCallback* end = dynamic_cast<GpuTimerEndCallback*>( pass->getFinalDrawCallback() );
+    if ( end ) pass->setFinalDrawCallback( end->getNested() );
+}
+
 /* Compositor */
 
 Compositor::Compositor()
-:   _renderTargetResolution(1024.0f, 1024.0f, 1.0f),
-    _renderTargetImpl(osg::Camera::FRAME_BUFFER_OBJECT),
-    _preservedZNear(FLT_MAX), _preservedZFar(-FLT_MAX),
-    _preservingNearFarFrameNumber(0)
+:   _renderTargetResolution(1024.0f, 1024.0f, 1.0f), _viewportSize(0, 0),
+    _frameViewportSize(0, 0), _viewportFrameNumber(0), _viewportSizeRequested(false),
+    _resolutionScale(1.0f),
+    _passCullingEnabled(true), _profilingEnabled(false),
+    _renderTargetImpl(osg::Camera::FRAME_BUFFER_OBJECT)
 {
     getOrCreateQuad();
     setCurrentTechnique( "default" );
@@ -74,14 +474,21 @@ Compositor::Compositor()
 Compositor::Compositor( const Compositor& copy, const osg::CopyOp& copyop )
 :   osg::Group(copy, copyop),
     _passLists(copy._passLists), _textureMap(copy._textureMap),
+    _bufferTextures(copy._bufferTextures), _baseBufferSizes(copy._baseBufferSizes),
+    _viewportBufferScales(copy._viewportBufferScales),
+    _passDefinitions(copy._passDefinitions), _definitionHashes(copy._definitionHashes),
+    _sourceFiles(copy._sourceFiles), _options(copy._options),
     _uniformMap(copy._uniformMap), _shaderMap(copy._shaderMap),
     _inbuiltUniforms(copy._inbuiltUniforms),
     _currentTechnique(copy._currentTechnique), _quad(copy._quad),
     _renderTargetResolution(copy._renderTargetResolution),
-    _renderTargetImpl(copy._renderTargetImpl),
-    _preservedZNear(copy._preservedZNear),
-    _preservedZFar(copy._preservedZFar),
-    _preservingNearFarFrameNumber(copy._preservingNearFarFrameNumber)
+    _viewportSize(copy._viewportSize), _frameViewportSize(copy._frameViewportSize),
+    _viewportFrameNumber(copy._viewportFrameNumber),
+    _viewportSizeRequested(copy._viewportSizeRequested),
+    _resolutionScale(copy._resolutionScale),
+    _passCullingEnabled(copy._passCullingEnabled),
+    _profilingEnabled(copy._profilingEnabled),
+    _renderTargetImpl(copy._renderTargetImpl)
 {
 }
 
@@ -116,6 +523,7 @@ osg::Camera* Compositor::createNewPass( PassType type, const std::string& name )
     newData.pass = camera;
     
     getPassList().push_back( newData );
+    if ( _profilingEnabled ) attachPassTimer( getPassList().back() );
     return camera.get();
 }
 
@@ -127,6 +535,7 @@ bool Compositor::removePass( const std::string& name )
         if ( passList[i].name==name )
         {
             passList.erase( getPassList().begin()+i );
+            updatePassGraph();
             return true;
         }
     }
@@ -173,6 +582,10 @@ bool Compositor::setPassIndex( const std::string& name, unsigned int index )
     if ( passToInsert.pass.valid() )
     {
         passList.insert( passList.begin()+insertIndex, passToInsert );
+        
+        // Buffer lifetimes and dependencies depend on the pass order
+        aliasBuffers();
+        updatePassGraph();
         return true;
     }
     return false;
@@ -198,6 +611,7 @@ bool Compositor::setPassActivated( const std::string& name, bool activated )
         if ( pd.name==name )
         {
             pd.activated = activated;
+            updatePassGraph();
             return true;
         }
     }
@@ -389,6 +803,764 @@ const osg::Shader* Compositor::getShader( const std::string& name ) const
     else return itr->second.get();
 }
 
+unsigned int Compositor::aliasBuffers()
+{
+    // Give every buffer its own render target back, so that the analysis can start over
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            PassData& pd = passList[i];
+            std::vector<std::string> names = pd.inputs;
+            names.insert( names.end(), pd.outputs.begin(), pd.outputs.end() );
+            for ( unsigned int n=0; n<names.size(); ++n )
+            {
+                TextureMap::iterator bitr = _bufferTextures.find( names[n] );
+                if ( bitr!=_bufferTextures.end() )
+                    replacePassTexture( pd, getTexture(names[n]), bitr->second.get() );
+            }
+        }
+    }
+    for ( TextureMap::iterator bitr=_bufferTextures.begin(); bitr!=_bufferTextures.end(); ++bitr )
+        _textureMap[bitr->first] = bitr->second;
+    
+    // Own render targets that were not used while aliased may have an outdated size
+    resizeBuffers();
+    
+    // Buffers used by more than one technique are left alone
+    std::map<std::string, unsigned int> numTechniques;
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        std::set<std::string> used;
+        PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            used.insert( passList[i].inputs.begin(), passList[i].inputs.end() );
+            used.insert( passList[i].outputs.begin(), passList[i].outputs.end() );
+        }
+        for ( std::set<std::string>::iterator uitr=used.begin(); uitr!=used.end(); ++uitr )
+            numTechniques[*uitr]++;
+    }
+    
+    unsigned int numAliased = 0;
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        // Find the first and last pass using each buffer. A buffer that is read before
+        // being written keeps contents from the previous frame, so it can't be shared.
+        PassList& passList = litr->second;
+        std::map<std::string, BufferLifetime> lifetimes;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            const PassData& pd = passList[i];
+            for ( unsigned int n=0; n<pd.inputs.size(); ++n )
+            {
+                if ( _bufferTextures.find(pd.inputs[n])==_bufferTextures.end() ) continue;
+                BufferLifetime& lifetime = lifetimes[pd.inputs[n]];
+                if ( lifetime.first<0 ) { lifetime.first = i; lifetime.aliasable = false; }
+                lifetime.name = pd.inputs[n]; lifetime.last = i;
+            }
+            for ( unsigned int n=0; n<pd.outputs.size(); ++n )
+            {
+                if ( _bufferTextures.find(pd.outputs[n])==_bufferTextures.end() ) continue;
+                BufferLifetime& lifetime = lifetimes[pd.outputs[n]];
+                if ( lifetime.first<0 ) lifetime.first = i;
+                lifetime.name = pd.outputs[n]; lifetime.last = i;
+                if ( pd.dynamicResolution ) lifetime.dynamicResolution = true;
+                
+                // Outputs of passes that are not updated every frame keep their contents
+                if ( pd.updateInterval>1 ) lifetime.aliasable = false;
+            }
+        }
+        
+        std::vector<BufferLifetime> candidates;
+        for ( std::map<std::string, BufferLifetime>::iterator itr=lifetimes.begin();
+              itr!=lifetimes.end(); ++itr )
+        {
+            if ( !itr->second.aliasable || numTechniques[itr->first]!=1 ) continue;
+            
+            std::map<std::string, osg::Vec2>::const_iterator vitr = _viewportBufferScales.find( itr->first );
+            if ( vitr!=_viewportBufferScales.end() ) itr->second.viewportScale = vitr->second;
+            candidates.push_back( itr->second );
+        }
+        std::sort( candidates.begin(), candidates.end(), isEarlierBuffer );
+        
+        // Assign buffers to shared render targets in order of first use. A render
+        // target can be reused once the last pass using its current buffer is done.
+        std::vector<SharedRenderTarget> targets;
+        for ( unsigned int c=0; c<candidates.size(); ++c )
+        {
+            const BufferLifetime& lifetime = candidates[c];
+            osg::Texture* texture = _bufferTextures[lifetime.name].get();
+            
+            int found = -1;
+            for ( unsigned int t=0; t<targets.size() && found<0; ++t )
+            {
+                // Buffers resized by dynamic resolution or by viewport changes can only share
+                // targets with buffers that are resized the same way
+                if ( targets[t].last<lifetime.first && targets[t].dynamicResolution==lifetime.dynamicResolution &&
+                     targets[t].viewportScale==lifetime.viewportScale &&
+                     isBufferCompatible(targets[t].texture.get(), texture) )
+                    found = t;
+            }
+            
+            if ( found<0 )
+            {
+                SharedRenderTarget target;
+                target.owner = lifetime.name;
+                target.texture = texture;
+                target.last = lifetime.last;
+                target.dynamicResolution = lifetime.dynamicResolution;
+                target.viewportScale = lifetime.viewportScale;
+                targets.push_back( target );
+                continue;
+            }
+            
+            SharedRenderTarget& target = targets[found];
+            target.last = lifetime.last;
+            _textureMap[lifetime.name] = target.texture;
+            for ( int i=lifetime.first; i<=lifetime.last; ++i )
+                replacePassTexture( passList[i], texture, target.texture.get() );
+            
+            oflog(Verbose, "Compositor: buffer %1% shares its render target with %2%", %lifetime.name %target.owner);
+            numAliased++;
+        }
+    }
+    return numAliased;
+}
+
+void Compositor::updatePassGraph()
+{
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        PassList& passList = litr->second;
+        
+        // Start from passes that are always needed, then walk back to the producers of
+        // their inputs
+        std::vector<bool> needed( passList.size(), false );
+        std::vector<unsigned int> pending;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            const PassData& pd = passList[i];
+            if ( !pd.activated || !pd.pass ) continue;
+            
+            bool untrackedOutputs = pd.pass->getBufferAttachmentMap().size()>pd.outputs.size();
+            if ( !_passCullingEnabled || pd.isDisplayPass() || untrackedOutputs )
+            {
+                needed[i] = true;
+                pending.push_back( i );
+            }
+        }
+        
+        while ( !pending.empty() )
+        {
+            unsigned int i = pending.back(); pending.pop_back();
+            const PassData& pd = passList[i];
+            for ( unsigned int n=0; n<pd.inputs.size(); ++n )
+            {
+                int producer = findProducerPass( passList, i, pd.inputs[n] );
+                if ( producer>=0 && !needed[producer] )
+                {
+                    needed[producer] = true;
+                    pending.push_back( producer );
+                }
+            }
+        }
+        
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            PassData& pd = passList[i];
+            bool culled = pd.activated && !needed[i];
+            if ( culled && !pd.culled )
+                oflog(Verbose, "Compositor: culling pass %1%, its outputs are not used", %pd.name);
+            pd.culled = culled;
+        }
+    }
+}
+
+bool Compositor::hasMultipleTargetScenePass() const
+{
+    const PassList& passList = getPassList();
+    for ( unsigned int i=0; i<passList.size(); ++i )
+    {
+        const PassData& pd = passList[i];
+        if ( !pd.activated || !pd.pass || pd.type!=FORWARD_PASS ) continue;
+        
+        // Passes with a program replace the scene shaders
+        const osg::StateSet* stateset = pd.pass->getStateSet();
+        if ( stateset && stateset->getAttribute(osg::StateAttribute::PROGRAM) ) continue;
+        
+        unsigned int numColorBuffers = 0;
+        const osg::Camera::BufferAttachmentMap& attachments = pd.pass->getBufferAttachmentMap();
+        for ( osg::Camera::BufferAttachmentMap::const_iterator itr=attachments.begin();
+              itr!=attachments.end(); ++itr )
+        {
+            if ( itr->first==osg::Camera::COLOR_BUFFER ||
+                 (itr->first>=osg::Camera::COLOR_BUFFER0 && itr->first<=osg::Camera::COLOR_BUFFER15) )
+                numColorBuffers++;
+        }
+        if ( numColorBuffers>1 ) return true;
+    }
+    return false;
+}
+
+std::string Compositor::getPassGraphDescription() const
+{
+    std::stringstream ss;
+    ss << "Technique " << _currentTechnique << std::endl;
+    const PassList& passList = getPassList();
+    for ( unsigned int i=0; i<passList.size(); ++i )
+    {
+        const PassData& pd = passList[i];
+        const char* state = !pd.activated ? "inactive" : (pd.culled ? "culled" : "active");
+        ss << "  " << i << ": " << pd.name << " (" << (pd.type==DEFERRED_PASS ? "deferred" : "forward")
+           << (pd.isDisplayPass() ? ", display" : "") << ") " << state << std::endl;
+        
+        for ( unsigned int n=0; n<pd.inputs.size(); ++n )
+        {
+            int producer = findProducerPass( passList, i, pd.inputs[n] );
+            ss << "      in  " << pd.inputs[n];
+            if ( producer<0 ) ss << " (texture)";
+            else if ( producer>=(int)i ) ss << " <- " << passList[producer].name << " (previous frame)";
+            else ss << " <- " << passList[producer].name;
+            ss << std::endl;
+        }
+        for ( unsigned int n=0; n<pd.outputs.size(); ++n )
+        {
+            ss << "      out " << pd.outputs[n];
+            const osg::Texture* texture = getTexture( pd.outputs[n] );
+            if ( texture ) ss << " (" << texture->getTextureWidth() << "x" << texture->getTextureHeight() << ")";
+            ss << std::endl;
+        }
+    }
+    return ss.str();
+}
+
+void Compositor::setProfilingEnabled( bool enabled )
+{
+    if ( enabled==_profilingEnabled ) return;
+    _profilingEnabled = enabled;
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            if ( enabled ) attachPassTimer( passList[i] );
+            else detachPassTimer( passList[i] );
+        }
+    }
+}
+
+std::string Compositor::getProfilingDescription() const
+{
+    std::stringstream ss;
+    ss << "Technique " << _currentTechnique << " (times in ms)" << std::endl;
+    ss << std::fixed << std::setprecision(3);
+    
+    double totalCull = 0.0, totalGpu = 0.0;
+    const PassList& passList = getPassList();
+    for ( unsigned int i=0; i<passList.size(); ++i )
+    {
+        const PassData& pd = passList[i];
+        ss << "  " << std::left << std::setw(32) << pd.name << std::right;
+        if ( !pd.timer )
+        {
+            ss << "  not profiled" << std::endl;
+            continue;
+        }
+        
+        double cullTime = pd.timer->getCullTime(), gpuTime = pd.timer->getGpuTime();
+        ss << "  cull " << std::setw(8) << cullTime << "  gpu " << std::setw(8) << gpuTime;
+        if ( !pd.activated ) ss << "  (inactive)";
+        else if ( pd.culled ) ss << "  (culled)";
+        ss << std::endl;
+        totalCull += cullTime; totalGpu += gpuTime;
+    }
+    ss << "  " << std::left << std::setw(32) << "total" << std::right
+       << "  cull " << std::setw(8) << totalCull << "  gpu " << std::setw(8) << totalGpu << std::endl;
+    return ss.str();
+}
+
+void Compositor::setResolutionScale( float scale )
+{
+    if ( scale==_resolutionScale ) return;
+    _resolutionScale = scale;
+    resizeBuffers();
+}
+
+void Compositor::setCurrentTechnique( const std::string& tech )
+{
+    if ( tech==_currentTechnique ) return;
+    _currentTechnique = tech;
+    
+    // Buffers are only scaled when written by dynamic passes of the current technique
+    if ( _resolutionScale!=1.0f ) resizeBuffers();
+}
+
+void Compositor::setViewportSize( int width, int height )
+{
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _viewportMutex );
+        if ( _viewportSize.x()==width && _viewportSize.y()==height ) return;
+        _viewportSize.set( width, height );
+    }
+    if ( !_viewportBufferScales.empty() )
+    {
+        oflog(Verbose, "Compositor: resizing viewport relative buffers to %1%x%2%", %width %height);
+        resizeBuffers();
+    }
+}
+
+osg::Vec2i Compositor::getViewportSize() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _viewportMutex );
+    return _viewportSize;
+}
+
+void Compositor::requestViewportSize( unsigned int frame, int width, int height )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _viewportMutex );
+    if ( _viewportFrameNumber!=frame )
+    {
+        _viewportFrameNumber = frame;
+        _frameViewportSize.set( width, height );
+    }
+    else
+    {
+        _frameViewportSize.set( osg::maximum(width, _frameViewportSize.x()),
+                                osg::maximum(height, _frameViewportSize.y()) );
+    }
+    _viewportSizeRequested = true;
+}
+
+void Compositor::updateViewportSize()
+{
+    osg::Vec2i size;
+    {
+        // Only apply sizes culled since the last update, so a size set explicitly in
+        // between is not overridden
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _viewportMutex );
+        if ( !_viewportSizeRequested ) return;
+        _viewportSizeRequested = false;
+        size = _frameViewportSize;
+    }
+    if ( size.x()>0 ) setViewportSize( size.x(), size.y() );
+}
+
+Compositor* Compositor::createInstance() const
+{
+    osg::ref_ptr<Compositor> instance = new Compositor( *this );
+    instance->_viewportSize.set( 0, 0 );
+    instance->_frameViewportSize.set( 0, 0 );
+    instance->_viewportFrameNumber = 0;
+    instance->_viewportSizeRequested = false;
+    
+    // Clone the render targets: the textures attached to passes, and the own render
+    // targets of aliased buffers. Aliased buffers keep sharing the same clone.
+    TextureReplacementMap clones;
+    for ( PassListMap::const_iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        const PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            if ( !passList[i].pass ) continue;
+            const osg::Camera::BufferAttachmentMap& attachments = passList[i].pass->getBufferAttachmentMap();
+            for ( osg::Camera::BufferAttachmentMap::const_iterator itr=attachments.begin();
+                  itr!=attachments.end(); ++itr )
+            {
+                osg::Texture* texture = itr->second._texture.get();
+                if ( texture ) clones[texture] = NULL;
+            }
+        }
+    }
+    for ( TextureMap::const_iterator itr=_bufferTextures.begin(); itr!=_bufferTextures.end(); ++itr )
+        clones[itr->second.get()] = NULL;
+    for ( TextureReplacementMap::iterator itr=clones.begin(); itr!=clones.end(); ++itr )
+    {
+        itr->second = static_cast<osg::Texture*>( itr->first->clone(osg::CopyOp::SHALLOW_COPY) );
+    }
+    
+    // Inbuilt uniforms are set from the views drawing each instance, so they are cloned too.
+    // The clones are owned by the uniform map and the pass state sets.
+    UniformReplacementMap uniformClones;
+    for ( InbuiltUniformList::iterator itr=instance->_inbuiltUniforms.begin();
+          itr!=instance->_inbuiltUniforms.end(); ++itr )
+    {
+        osg::Uniform* uniform = itr->second.get();
+        if ( !uniform ) continue;
+        
+        osg::ref_ptr<osg::Uniform>& clone = uniformClones[uniform];
+        if ( !clone ) clone = static_cast<osg::Uniform*>( uniform->clone(osg::CopyOp::SHALLOW_COPY) );
+        itr->second = clone.get();
+    }
+    for ( UniformMap::iterator itr=instance->_uniformMap.begin(); itr!=instance->_uniformMap.end(); ++itr )
+    {
+        UniformReplacementMap::iterator uitr = uniformClones.find( itr->second.get() );
+        if ( uitr!=uniformClones.end() ) itr->second = uitr->second;
+    }
+    
+    // Global uniforms are in the state set of the compositor, shared with the copy
+    if ( instance->getStateSet() && !uniformClones.empty() )
+    {
+        instance->setStateSet( new osg::StateSet(*instance->getStateSet(), osg::CopyOp::SHALLOW_COPY) );
+        replaceStateSetUniforms( instance->getStateSet(), uniformClones );
+    }
+    
+    // Clone the pass cameras, with their state sets but not their uniforms and textures. Local
+    // uniforms written by the compositor itself depend on the instance, so they are cloned too.
+    // The checkerboard update state sets only depend on the frame, so instances share them.
+    static const char* instanceUniforms[] = { "osg_OutputBufferSize" };
+    static const unsigned int numInstanceUniforms = sizeof(instanceUniforms) / sizeof(instanceUniforms[0]);
+    for ( PassListMap::iterator litr=instance->_passLists.begin(); litr!=instance->_passLists.end(); ++litr )
+    {
+        PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            PassData& pd = passList[i];
+            if ( !pd.pass ) continue;
+            
+            pd.pass = new osg::Camera( *pd.pass, osg::CopyOp::DEEP_COPY_STATESETS );
+            pd.pass->setCullCallback( new PassCullCallback(instance.get(), pd.type) );
+            pd.lastUpdateFrame = -1;
+            pd.lastUpdateView = ViewKey();
+            
+            osg::StateSet* stateset = pd.pass->getStateSet();
+            for ( unsigned int u=0; stateset && u<numInstanceUniforms; ++u )
+            {
+                const osg::StateSet::RefUniformPair* pair = stateset->getUniformPair( instanceUniforms[u] );
+                if ( pair )
+                {
+                    osg::StateAttribute::OverrideValue value = pair->second;
+                    stateset->addUniform( static_cast<osg::Uniform*>(pair->first->clone(osg::CopyOp::SHALLOW_COPY)), value );
+                }
+            }
+            
+            replaceStateSetUniforms( stateset, uniformClones );
+            
+            // The copied pass shares the timer callbacks of the original one
+            removePassTimerCallbacks( pd.pass.get() );
+            if ( pd.timer.valid() )
+            {
+                pd.timer = NULL;
+                attachPassTimer( pd );
+            }
+        }
+    }
+    instance->replaceRenderTargets( clones );
+    return instance.release();
+}
+
+unsigned int Compositor::shareRenderTargets( Compositor* other )
+{
+    if ( !other || other==this ) return 0;
+    
+    // Buffers that keep contents across frames: the ones read before being written, as
+    // with buffer aliasing, and the outputs of passes that are not updated every frame
+    std::set<std::string> persistent;
+    for ( PassListMap::const_iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        const PassList& passList = litr->second;
+        std::set<std::string> written;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            const PassData& pd = passList[i];
+            for ( unsigned int n=0; n<pd.inputs.size(); ++n )
+            {
+                if ( written.find(pd.inputs[n])==written.end() ) persistent.insert( pd.inputs[n] );
+            }
+            for ( unsigned int n=0; n<pd.outputs.size(); ++n )
+            {
+                written.insert( pd.outputs[n] );
+                if ( pd.updateInterval>1 ) persistent.insert( pd.outputs[n] );
+            }
+        }
+    }
+    
+    // Aliased buffers share a render target, so it is only shared if all of them can be
+    std::set<osg::Texture*> excluded;
+    TextureReplacementMap replacements;
+    for ( TextureMap::const_iterator itr=_textureMap.begin(); itr!=_textureMap.end(); ++itr )
+    {
+        if ( _bufferTextures.find(itr->first)==_bufferTextures.end() ) continue;
+        osg::Texture* texture = itr->second.get();
+        osg::Texture* otherTexture = other->getTexture( itr->first );
+        if ( !texture || !otherTexture || texture==otherTexture ) continue;
+        
+        TextureReplacementMap::iterator ritr = replacements.find( texture );
+        if ( persistent.find(itr->first)!=persistent.end() || !isBufferCompatible(texture, otherTexture) ||
+             (ritr!=replacements.end() && ritr->second.get()!=otherTexture) )
+            excluded.insert( texture );
+        else
+            replacements[texture] = otherTexture;
+    }
+    for ( std::set<osg::Texture*>::iterator itr=excluded.begin(); itr!=excluded.end(); ++itr )
+        replacements.erase( *itr );
+    if ( replacements.empty() ) return 0;
+    
+    replaceRenderTargets( replacements );
+    for ( TextureReplacementMap::iterator itr=replacements.begin(); itr!=replacements.end(); ++itr )
+    {
+        _sharedRenderTargets.insert( itr->second.get() );
+        other->_sharedRenderTargets.insert( itr->second.get() );
+    }
+    return replacements.size();
+}
+
+void Compositor::replaceRenderTargets( const TextureReplacementMap& replacements )
+{
+    for ( TextureMap::iterator itr=_textureMap.begin(); itr!=_textureMap.end(); ++itr )
+    {
+        TextureReplacementMap::const_iterator ritr = replacements.find( itr->second.get() );
+        if ( ritr!=replacements.end() ) itr->second = ritr->second;
+    }
+    for ( TextureMap::iterator itr=_bufferTextures.begin(); itr!=_bufferTextures.end(); ++itr )
+    {
+        TextureReplacementMap::const_iterator ritr = replacements.find( itr->second.get() );
+        if ( ritr!=replacements.end() ) itr->second = ritr->second;
+    }
+    
+    std::map<osg::ref_ptr<osg::Texture2D>, osg::Vec2i> baseBufferSizes;
+    for ( std::map<osg::ref_ptr<osg::Texture2D>, osg::Vec2i>::const_iterator itr=_baseBufferSizes.begin();
+          itr!=_baseBufferSizes.end(); ++itr )
+    {
+        TextureReplacementMap::const_iterator ritr = replacements.find( itr->first.get() );
+        osg::Texture2D* texture = ritr!=replacements.end() ? dynamic_cast<osg::Texture2D*>( ritr->second.get() )
+                                                           : itr->first.get();
+        if ( texture ) baseBufferSizes[texture] = itr->second;
+    }
+    _baseBufferSizes.swap( baseBufferSizes );
+    
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            for ( TextureReplacementMap::const_iterator itr=replacements.begin(); itr!=replacements.end(); ++itr )
+                replacePassTexture( passList[i], itr->first, itr->second.get() );
+        }
+    }
+    
+    for ( TextureReplacementMap::const_iterator itr=replacements.begin(); itr!=replacements.end(); ++itr )
+        _sharedRenderTargets.erase( itr->first );
+}
+
+bool Compositor::isPassUpdateFrame( PassData& data, const osg::NodeVisitor& nv, osg::StateSet*& updateStateSet )
+{
+    updateStateSet = data.fullUpdateStateSet.get();
+    const osg::FrameStamp* fs = nv.getFrameStamp();
+    if ( !fs ) return true;
+    
+    // Views are told apart by the omegalib draw context: stereo eyes and depth partitions
+    // are culled through the same scene view camera.
+    ViewKey view;
+    const osgUtil::CullVisitor* cv = dynamic_cast<const osgUtil::CullVisitor*>( &nv );
+    osg::Camera* camera = (cv && cv->getRenderStage()) ? cv->getRenderStage()->getCamera() : NULL;
+    omegaOsg::OsgDrawInformation* odi = camera ?
+        dynamic_cast<omegaOsg::OsgDrawInformation*>( camera->getUserData() ) : NULL;
+    if ( odi && odi->context )
+    {
+        view.camera = odi->context->camera;
+        view.eye = (int)odi->context->eye;
+        view.depthPartition = (int)odi->depthPartitionMode;
+    }
+    else
+        view.camera = camera;
+    
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _updateFrameMutex );
+    int frame = (int)fs->getFrameNumber();
+    unsigned int phase = (fs->getFrameNumber() + data.updateOffset) % data.updateInterval;
+    bool sameView = data.lastUpdateView==view;
+    data.lastUpdateView = view;
+    if ( data.checkerboardUpdate )
+    {
+        // Every frame updates a different part of the outputs. Until all of it has been
+        // written once for this view, update the whole outputs. The uniforms are shared by
+        // all views, so pick the state set instead of setting them here.
+        if ( data.lastUpdateFrame<0 || !sameView ) data.lastUpdateFrame = frame;
+        if ( frame - data.lastUpdateFrame>=(int)data.updateInterval )
+            updateStateSet = data.phaseStateSet.get();
+        return true;
+    }
+    
+    if ( data.lastUpdateFrame<0 || phase==0 || !sameView )
+    {
+        data.lastUpdateFrame = frame;
+        return true;
+    }
+    return false;
+}
+
+void Compositor::traverseAllPasses( osg::NodeVisitor& nv )
+{
+    bool isCull = nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR;
+    const osg::FrameStamp* fs = nv.getFrameStamp();
+    PassList& passList = getPassList();
+    for ( unsigned int i=0; i<passList.size(); ++i )
+    {
+        PassData& data = passList[i];
+        if ( data.culled && isCull ) continue;
+        if ( !data.activated || !data.pass.valid() ) continue;
+        
+        // The update phase only depends on the frame, so it is set once for all views
+        if ( data.checkerboardUpdate && fs && nv.getVisitorType()==osg::NodeVisitor::UPDATE_VISITOR )
+        {
+            osg::Uniform* updatePhase = data.phaseStateSet->getUniform( "osg_UpdatePhase" );
+            updatePhase->set( (float)((fs->getFrameNumber() + data.updateOffset) % data.updateInterval) );
+        }
+        
+        osg::StateSet* updateStateSet = NULL;
+        if ( data.updateInterval>1 && isCull && !isPassUpdateFrame(data, nv, updateStateSet) ) continue;
+        
+        osgUtil::CullVisitor* cv = updateStateSet ? dynamic_cast<osgUtil::CullVisitor*>( &nv ) : NULL;
+        if ( cv ) cv->pushStateSet( updateStateSet );
+        if ( data.timer.valid() && isCull )
+        {
+            osg::Timer_t start = osg::Timer::instance()->tick();
+            data.pass->accept( nv );
+            data.timer->addCullTime( fs ? fs->getFrameNumber() : 0,
+                                     osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) );
+        }
+        else
+            data.pass->accept( nv );
+        if ( cv ) cv->popStateSet();
+    }
+}
+
+void Compositor::resizeBuffers()
+{
+    // Render targets following the viewport size, with their size relative to it. Own render
+    // targets of aliased buffers are included, so they are up to date if aliasing is undone.
+    std::map<osg::Texture2D*, osg::Vec2> viewportScales;
+    for ( std::map<std::string, osg::Vec2>::const_iterator vitr=_viewportBufferScales.begin();
+          vitr!=_viewportBufferScales.end(); ++vitr )
+    {
+        osg::Texture2D* texture = dynamic_cast<osg::Texture2D*>( getTexture(vitr->first) );
+        if ( texture ) viewportScales[texture] = vitr->second;
+        
+        TextureMap::iterator bitr = _bufferTextures.find( vitr->first );
+        texture = bitr!=_bufferTextures.end() ? dynamic_cast<osg::Texture2D*>( bitr->second.get() ) : NULL;
+        if ( texture ) viewportScales[texture] = vitr->second;
+    }
+    
+    // Render targets of passes marked with dynamic_resolution="1" in the current technique.
+    // Other techniques may use the same buffers at full resolution.
+    std::set<osg::Texture2D*> scaled;
+    PassListMap::iterator current = _passLists.find( _currentTechnique );
+    if ( current!=_passLists.end() )
+    {
+        PassList& passList = current->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            PassData& pd = passList[i];
+            if ( !pd.dynamicResolution || !pd.pass ) continue;
+            
+            const osg::Camera::BufferAttachmentMap& attachments = pd.pass->getBufferAttachmentMap();
+            for ( osg::Camera::BufferAttachmentMap::const_iterator itr=attachments.begin();
+                  itr!=attachments.end(); ++itr )
+            {
+                osg::Texture2D* texture = dynamic_cast<osg::Texture2D*>( itr->second._texture.get() );
+                if ( texture ) scaled.insert( texture );
+            }
+        }
+    }
+    
+    std::set<osg::Texture2D*> targets( scaled );
+    for ( std::map<osg::Texture2D*, osg::Vec2>::iterator vitr=viewportScales.begin();
+          vitr!=viewportScales.end(); ++vitr )
+        targets.insert( vitr->first );
+    
+    // New sizes of the render targets
+    std::map<osg::Texture2D*, osg::Vec2i> sizes;
+    for ( std::set<osg::Texture2D*>::iterator titr=targets.begin(); titr!=targets.end(); ++titr )
+    {
+        osg::Texture2D* texture = *titr;
+        osg::Vec2 size;
+        std::map<osg::Texture2D*, osg::Vec2>::iterator vitr = viewportScales.find( texture );
+        if ( vitr!=viewportScales.end() && _viewportSize.x()>0 )
+            size.set( _viewportSize.x() * vitr->second.x(), _viewportSize.y() * vitr->second.y() );
+        else
+        {
+            // Remember the size at load time the first time a buffer gets resized
+            if ( _baseBufferSizes.find(texture)==_baseBufferSizes.end() )
+                _baseBufferSizes[texture] = osg::Vec2i( texture->getTextureWidth(), texture->getTextureHeight() );
+            const osg::Vec2i& baseSize = _baseBufferSizes[texture];
+            size.set( baseSize.x(), baseSize.y() );
+        }
+        if ( scaled.find(texture)!=scaled.end() ) size *= _resolutionScale;
+        
+        int w = osg::maximum( 1, (int)(size.x() + 0.5f) );
+        int h = osg::maximum( 1, (int)(size.y() + 0.5f) );
+        if ( texture->getTextureWidth()!=w || texture->getTextureHeight()!=h )
+            sizes[texture] = osg::Vec2i( w, h );
+    }
+    
+    // Render targets shared with other instances get their own copy before being resized
+    TextureReplacementMap copies;
+    for ( std::map<osg::Texture2D*, osg::Vec2i>::iterator itr=sizes.begin(); itr!=sizes.end(); ++itr )
+    {
+        if ( _sharedRenderTargets.find(itr->first)!=_sharedRenderTargets.end() )
+            copies[itr->first] = static_cast<osg::Texture*>( itr->first->clone(osg::CopyOp::SHALLOW_COPY) );
+    }
+    if ( !copies.empty() )
+    {
+        replaceRenderTargets( copies );
+        for ( TextureReplacementMap::iterator itr=copies.begin(); itr!=copies.end(); ++itr )
+        {
+            osg::Texture2D* texture = static_cast<osg::Texture2D*>( itr->first );
+            osg::Texture2D* copy = static_cast<osg::Texture2D*>( itr->second.get() );
+            targets.erase( texture ); targets.insert( copy );
+            sizes[copy] = sizes[texture]; sizes.erase( texture );
+        }
+    }
+    
+    // Textures resized by this call. Every pass writing to them needs to attach them again.
+    std::set<osg::Texture2D*> resized;
+    for ( std::map<osg::Texture2D*, osg::Vec2i>::iterator itr=sizes.begin(); itr!=sizes.end(); ++itr )
+    {
+        osg::Texture2D* texture = itr->first;
+        texture->setTextureSize( itr->second.x(), itr->second.y() );
+        texture->dirtyTextureObject();
+        resized.insert( texture );
+    }
+    
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        PassList& passList = litr->second;
+        for ( unsigned int i=0; i<passList.size(); ++i )
+        {
+            PassData& pd = passList[i];
+            if ( !pd.pass ) continue;
+            
+            osg::Camera* camera = pd.pass.get();
+            osg::Camera::BufferAttachmentMap attachments = camera->getBufferAttachmentMap();
+            for ( osg::Camera::BufferAttachmentMap::iterator itr=attachments.begin();
+                  itr!=attachments.end(); ++itr )
+            {
+                const osg::Camera::Attachment& a = itr->second;
+                osg::Texture2D* texture = dynamic_cast<osg::Texture2D*>( a._texture.get() );
+                if ( !texture || targets.find(texture)==targets.end() ) continue;
+                
+                if ( resized.find(texture)!=resized.end() )
+                {
+                    // Attach again, so the render stage rebuilds its frame buffer object
+                    camera->attach( itr->first, texture, a._level, a._face, a._mipMapGeneration,
+                                    a._multisampleSamples, a._multisampleColorSamples );
+                    
+                    // The contents are lost, so passes with an update interval can't wait
+                    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _updateFrameMutex );
+                    pd.lastUpdateFrame = -1;
+                }
+                int w = texture->getTextureWidth(), h = texture->getTextureHeight();
+                camera->setViewport( 0, 0, w, h );
+                
+                osg::StateSet* stateset = camera->getStateSet();
+                osg::Uniform* outputSize = stateset ? stateset->getUniform("osg_OutputBufferSize") : NULL;
+                if ( outputSize ) outputSize->set( osg::Vec3(w, h, texture->getTextureDepth()) );
+            }
+        }
+    }
+}
+
 osg::Geode* Compositor::getOrCreateQuad()
 {
     if ( !_quad )
@@ -417,96 +1589,171 @@ osg::Geode* Compositor::getOrCreateQuad()
     return _quad.get();
 }
 
-void Compositor::setPreservedNearAndFar( unsigned int frame, double zn, double zf )
+/** Remove the values of cameras that were not culled in the last frames. Cameras are only
+    known by address, so this also keeps a new camera from getting the values of a deleted one. */
+template<typename T>
+static void pruneCameraValues( std::map<const osg::Camera*, T>& cameraValues, unsigned int frame )
+{
+    const unsigned int maxAge = 4;
+    typename std::map<const osg::Camera*, T>::iterator itr = cameraValues.begin();
+    while ( itr!=cameraValues.end() )
+    {
+        if ( itr->second.frame + maxAge<frame ) cameraValues.erase( itr++ );
+        else ++itr;
+    }
+}
+
+void Compositor::setPreservedNearAndFar( const osg::Camera* view, unsigned int frame, double zn, double zf )
 {
-    if ( _preservingNearFarFrameNumber!=frame )
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _inbuiltValuesMutex );
+    pruneCameraValues( _preservedNearAndFar, frame );
+    std::map<const osg::Camera*, PreservedNearAndFar>::iterator itr = _preservedNearAndFar.find( view );
+    if ( itr==_preservedNearAndFar.end() || itr->second.frame!=frame )
     {
-        _preservingNearFarFrameNumber = frame;
-        _preservedZNear = zn;
-        _preservedZFar = zf;
+        PreservedNearAndFar& preserved = _preservedNearAndFar[view];
+        preserved.frame = frame;
+        preserved.zNear = zn;
+        preserved.zFar = zf;
     }
     else
     {
-        _preservedZNear = osg::maximum(zn, _preservedZNear);
-        _preservedZFar = osg::minimum(zf, _preservedZFar);
+        // Several forward passes (or stereo eyes) of the same view in a frame
+        PreservedNearAndFar& preserved = itr->second;
+        preserved.zNear = osg::maximum(zn, preserved.zNear);
+        preserved.zFar = osg::minimum(zf, preserved.zFar);
     }
 }
 
+bool Compositor::getPreservedNearAndFar( const osg::Camera* view, double& zn, double& zf )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _inbuiltValuesMutex );
+    std::map<const osg::Camera*, PreservedNearAndFar>::const_iterator itr = _preservedNearAndFar.find( view );
+    if ( itr==_preservedNearAndFar.end() ) return false;
+    zn = itr->second.zNear;
+    zf = itr->second.zFar;
+    return true;
+}
+
+void Compositor::getInbuiltValues( osgUtil::CullVisitor* cv, unsigned int required, InbuiltValues& values )
+{
+    osg::RefMatrix* projectionMatrix = cv->getProjectionMatrix();
+    osg::RefMatrix* modelViewMatrix = cv->getModelViewMatrix();
+    osg::Matrixd projection = projectionMatrix ? *projectionMatrix : osg::Matrixd();
+    osg::Matrixd modelView = modelViewMatrix ? *modelViewMatrix : osg::Matrixd();
+    
+    values.eyePosition = cv->getEyeLocal();
+    values.viewPoint = cv->getViewPointLocal();
+    values.lookVector = cv->getLookVectorLocal();
+    values.upVector = cv->getUpLocal();
+    if ( cv->getViewport() )
+    {
+        const osg::Viewport* vp = cv->getViewport();
+        values.viewport.set( vp->x(), vp->y(), vp->width(), vp->height() );
+    }
+    
+    // Without a viewport, keep the values of the last one
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _inbuiltValuesMutex );
+        if ( cv->getViewport() ) _lastViewport = values.viewport;
+        else values.viewport = _lastViewport;
+    }
+    
+    // Near and far come from the forward passes of this view in the previous frame, when known
+    double fovy = 0.0, aspectRatio = 0.0, zNear = 0.0, zFar = 0.0;
+    if ( projectionMatrix ) projection.getPerspective( fovy, aspectRatio, zNear, zFar );
+    if ( cv->getRenderStage() ) getPreservedNearAndFar( cv->getRenderStage()->getCamera(), zNear, zFar );
+    values.zNear = zNear; values.zFar = zFar;
+    values.fovInRadians = osg::DegreesToRadians( fovy );
+    values.aspectRatio = aspectRatio;
+    
+    // Only compute the inverse matrices that some uniform needs
+    unsigned int block = 1u << CAMERA_BLOCK;
+    osg::Matrixd windowMatrix = cv->getWindowMatrix();
+    values.windowMatrix = osg::Matrixf( windowMatrix );
+    values.modelViewMatrix = osg::Matrixf( modelView );
+    values.projectionMatrix = osg::Matrixf( projection );
+    if ( required & (block | (1u << INV_WINDOW_MATRIX)) )
+        values.invWindowMatrix = osg::Matrixf( osg::Matrixd::inverse(windowMatrix) );
+    if ( required & (block | (1u << SCENE_INV_MODELVIEW_MATRIX)) )
+        values.invModelViewMatrix = osg::Matrixf( osg::Matrixd::inverse(modelView) );
+    if ( required & (block | (1u << SCENE_INV_PROJECTION_MATRIX)) )
+        values.invProjectionMatrix = osg::Matrixf( osg::Matrixd::inverse(projection) );
+}
+
 void Compositor::traverse( osg::NodeVisitor& nv )
 {
     if ( nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR )
     {
         osgUtil::CullVisitor* cv = static_cast<osgUtil::CullVisitor*>( &nv );
-        osg::RefMatrix* projectionMatrix = cv->getProjectionMatrix();
+        if ( !_viewportBufferScales.empty() && cv->getViewport() )
+        {
+            const osg::FrameStamp* fs = cv->getFrameStamp();
+            requestViewportSize( fs ? fs->getFrameNumber() : 0,
+                                 (int)cv->getViewport()->width(), (int)cv->getViewport()->height() );
+            
+            // Buffers are allocated when first drawn: don't draw them before they are
+            // sized from the viewport (see updateViewportSize())
+            if ( getViewportSize().x()==0 )
+            {
+                osg::Group::traverse( nv );
+                return;
+            }
+        }
         if ( _inbuiltUniforms.size()>0 )
         {
-            double fovy = 0.0, aspectRatio = 0.0, zNear = 0.0, zFar = 0.0;
-            if ( projectionMatrix ) projectionMatrix->getPerspective( fovy, aspectRatio, zNear, zFar );
-            if ( _preservedZNear!=FLT_MAX ) zNear = _preservedZNear;
-            if ( _preservedZFar!=-FLT_MAX ) zFar = _preservedZFar;
+            unsigned int required = 0;
+            for ( InbuiltUniformList::const_iterator itr=_inbuiltUniforms.begin();
+                  itr!=_inbuiltUniforms.end(); ++itr )
+            {
+                if ( itr->second.valid() ) required |= (1u << itr->first);
+            }
             
+            InbuiltValues values;
+            getInbuiltValues( cv, required, values );
             for ( InbuiltUniformList::const_iterator itr=_inbuiltUniforms.begin();
                   itr!=_inbuiltUniforms.end(); ++itr )
             {
-                if ( !itr->second ) continue;
+                osg::Uniform* uniform = itr->second.get();
+                if ( !uniform ) continue;
                 switch ( itr->first )
                 {
-                case EYE_POSITION:
-                    itr->second->set( cv->getEyeLocal() );
-                    break;
-                case VIEW_POINT:
-                    itr->second->set( cv->getViewPointLocal() );
-                    break;
-                case LOOK_VECTOR:
-                    itr->second->set( cv->getLookVectorLocal() );
-                    break;
-                case UP_VECTOR:
-                    itr->second->set( cv->getUpLocal() );
-                    break;
-                case LEFT_VECTOR:
-                    itr->second->set( cv->getLookVectorLocal() ^ cv->getUpLocal() );
-                    break;
-                case VIEWPORT_X:
-                    if ( cv->getViewport() ) itr->second->set( (float)cv->getViewport()->x() );
-                    break;
-                case VIEWPORT_Y:
-                    if ( cv->getViewport() ) itr->second->set( (float)cv->getViewport()->y() );
-                    break;
-                case VIEWPORT_WIDTH:
-                    if ( cv->getViewport() ) itr->second->set( (float)cv->getViewport()->width() );
-                    break;
-                case VIEWPORT_HEIGHT:
-                    if ( cv->getViewport() ) itr->second->set( (float)cv->getViewport()->height() );
-                    break;
-                case WINDOW_MATRIX:
-                    itr->second->set( osg::Matrixf(cv->getWindowMatrix()) );
-                    break;
-                case INV_WINDOW_MATRIX:
-                    itr->second->set( osg::Matrixf::inverse(cv->getWindowMatrix()) );
-                    break;
-                case FRUSTUM_NEAR_PLANE:
-                    itr->second->set( (float)zNear );
-                    break;
-                case FRUSTUM_FAR_PLANE:
-                    itr->second->set( (float)zFar );
-                    break;
-                case SCENE_FOV_IN_RADIANS:
-                    itr->second->set( (float)osg::DegreesToRadians(fovy) );
-                    break;
-                case SCENE_ASPECT_RATIO:
-                    itr->second->set( (float)aspectRatio );
-                    break;
-                case SCENE_MODELVIEW_MATRIX:
-                    if ( cv->getModelViewMatrix() ) itr->second->set( osg::Matrixf(*cv->getModelViewMatrix()) );
-                    break;
-                case SCENE_INV_MODELVIEW_MATRIX:
-                    if ( cv->getModelViewMatrix() ) itr->second->set( osg::Matrixf::inverse(*cv->getModelViewMatrix()) );
-                    break;
-                case SCENE_PROJECTION_MATRIX:
-                    if ( projectionMatrix ) itr->second->set( osg::Matrixf(*projectionMatrix) );
-                    break;
-                case SCENE_INV_PROJECTION_MATRIX:
-                    if ( projectionMatrix ) itr->second->set( osg::Matrixf::inverse(*projectionMatrix) );
+                case EYE_POSITION: uniform->set( values.eyePosition ); break;
+                case VIEW_POINT: uniform->set( values.viewPoint ); break;
+                case LOOK_VECTOR: uniform->set( values.lookVector ); break;
+                case UP_VECTOR: uniform->set( values.upVector ); break;
+                case LEFT_VECTOR: uniform->set( values.lookVector ^ values.upVector ); break;
+                case VIEWPORT_X: uniform->set( values.viewport.x() ); break;
+                case VIEWPORT_Y: uniform->set( values.viewport.y() ); break;
+                case VIEWPORT_WIDTH: uniform->set( values.viewport.z() ); break;
+                case VIEWPORT_HEIGHT: uniform->set( values.viewport.w() ); break;
+                case WINDOW_MATRIX: uniform->set( values.windowMatrix ); break;
+                case INV_WINDOW_MATRIX: uniform->set( values.invWindowMatrix ); break;
+                case FRUSTUM_NEAR_PLANE: uniform->set( values.zNear ); break;
+                case FRUSTUM_FAR_PLANE: uniform->set( values.zFar ); break;
+                case SCENE_FOV_IN_RADIANS: uniform->set( values.fovInRadians ); break;
+                case SCENE_ASPECT_RATIO: uniform->set( values.aspectRatio ); break;
+                case SCENE_MODELVIEW_MATRIX: uniform->set( values.modelViewMatrix ); break;
+                case SCENE_INV_MODELVIEW_MATRIX: uniform->set( values.invModelViewMatrix ); break;
+                case SCENE_PROJECTION_MATRIX: uniform->set( values.projectionMatrix ); break;
+                case SCENE_INV_PROJECTION_MATRIX: uniform->set( values.invProjectionMatrix ); break;
+                case CAMERA_BLOCK:
+                    {
+                        // Vectors and scalars are packed in the columns of the last matrix
+                        const osg::Vec3& eye = values.eyePosition;
+                        const osg::Vec3& look = values.lookVector;
+                        const osg::Vec3& up = values.upVector;
+                        const osg::Vec4& vp = values.viewport;
+                        uniform->setElement( 0, values.modelViewMatrix );
+                        uniform->setElement( 1, values.invModelViewMatrix );
+                        uniform->setElement( 2, values.projectionMatrix );
+                        uniform->setElement( 3, values.invProjectionMatrix );
+                        uniform->setElement( 4, values.windowMatrix );
+                        uniform->setElement( 5, values.invWindowMatrix );
+                        uniform->setElement( 6, osg::Matrixf(eye.x(), eye.y(), eye.z(), values.zNear,
+                                                             look.x(), look.y(), look.z(), values.zFar,
+                                                             up.x(), up.y(), up.z(), values.fovInRadians,
+                                                             vp.x(), vp.y(), vp.z(), vp.w()) );
+                    }
                     break;
                 default: break;
                 }
@@ -516,6 +1763,7 @@ void Compositor::traverse( osg::NodeVisitor& nv )
         return;  // don't traverse as usual
     }
     
+    if ( nv.getVisitorType()==osg::NodeVisitor::UPDATE_VISITOR ) updateViewportSize();
     if ( nv.getVisitorType()==osg::NodeVisitor::UPDATE_VISITOR ||
          nv.getVisitorType()==osg::NodeVisitor::EVENT_VISITOR )
     {
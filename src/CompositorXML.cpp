@@ -21,6 +21,9 @@
 #include<omega.h>
 
 #include "cyclops/Compositor.h"
+#include "cyclops/AnimationTrack.h"
+#include "cyclops/ShaderSourceCache.h"
+#include "cyclops/EffectCache.h"
 
 using namespace cyclops;
 
@@ -29,6 +32,7 @@ struct UniformAnimator : public osg::Uniform::Callback
 {
     virtual void operator()( osg::Uniform* uniform, osg::NodeVisitor* nv )
     {
+        if ( track.isEmpty() ) return;
         double time = nv->getFrameStamp()->getSimulationTime();
         if ( loop )
         {
@@ -37,32 +41,27 @@ struct UniformAnimator : public osg::Uniform::Callback
             time = startTime + fraction_part * duration;
         }
         
-        typename std::map<double, T>::const_iterator itr = keyframes.lower_bound(time);
-        if ( itr==keyframes.begin() )
-            uniform->set( itr->second );
-        else if ( itr==keyframes.end() )
-            uniform->set( keyframes.rbegin()->second );
-        else
+        // Don't dirty the uniform when its value can't have changed
+        if ( evaluated )
         {
-            typename std::map<double, T>::const_iterator itr0 = itr; --itr0;
-            double delta_time = itr->first - itr0->first;
-            if ( delta_time==0.0 )
-                uniform->set( itr0->second );
-            else
-            {
-                double k = (time - itr0->first) / delta_time;
-                uniform->set( (T)(itr0->second * (1.0 - k) + itr->second * k) );
-            }
+            if ( time==lastTime ) return;
+            if ( time<=track.getStartTime() && lastTime<=track.getStartTime() ) return;
+            if ( time>=track.getEndTime() && lastTime>=track.getEndTime() ) return;
         }
+        evaluated = true;
+        lastTime = time;
+        uniform->set( track.evaluate(time) );
     }
     
     UniformAnimator( double d, bool l )
-    : startTime(0.0), duration(d), loop(l) {}
+    : startTime(0.0), duration(d), loop(l), lastTime(0.0), evaluated(false) {}
     
-    std::map<double, T> keyframes;
+    AnimationTrack<T> track;
     double startTime;
     double duration;
     bool loop;
+    double lastTime;
+    bool evaluated;
 };
 
 static bool isXMLNodeType( osgDB::XmlNode* xmlNode )
@@ -91,12 +90,11 @@ static UniformAnimator<T>* createAnimatorFromXML( osgDB::XmlNode* xmlNode )
         if ( !isXMLNodeType(xmlKeyframeNode) ) continue;
         
         double time = atof( xmlKeyframeNode->properties["time"].c_str() );
-        if ( j==0 ) animator->startTime = time;
-        
         std::stringstream ss( xmlKeyframeNode->getTrimmedContents() );
         T value; ss >> value;
-        animator->keyframes[time] = value;
+        animator->track.addKey( time, value );
     }
+    animator->startTime = animator->track.getStartTime();
     return animator.release();
 }
 
@@ -111,6 +109,35 @@ static void inheritXmlNode( osgDB::XmlNode* target, osgDB::XmlNode* source )
     target->children.insert( target->children.begin(), source->children.begin(), source->children.end() );
 }
 
+static unsigned int hashXmlNode( osgDB::XmlNode* xmlNode )
+{
+    std::stringstream ss;
+    xmlNode->write( ss );
+    return EffectCache::hash( ss.str() );
+}
+
+// Hash of a pass definition, including the sources of the shaders defined
+// inside the pass (global shaders are tracked on their own)
+static unsigned int hashPassDefinition( const Compositor* compositor, osgDB::XmlNode* xmlNode, osg::Camera* camera )
+{
+    std::stringstream ss;
+    xmlNode->write( ss );
+    
+    osg::StateSet* stateset = camera->getStateSet();
+    osg::Program* program = stateset!=NULL ?
+        dynamic_cast<osg::Program*>( stateset->getAttribute(osg::StateAttribute::PROGRAM) ) : NULL;
+    if ( program!=NULL )
+    {
+        for ( unsigned int i=0; i<program->getNumShaders(); ++i )
+        {
+            const osg::Shader* shader = program->getShader( i );
+            if ( compositor->getShader(shader->getName())!=shader )
+                ss << shader->getShaderSource();
+        }
+    }
+    return EffectCache::hash( ss.str() );
+}
+
 /* Compositor - XML parsing methods */
 
 osg::Camera* Compositor::createPassFromXML( osgDB::XmlNode* xmlNode )
@@ -130,6 +157,7 @@ osg::Camera* Compositor::createPassFromXML( osgDB::XmlNode* xmlNode )
     
     osg::Camera* camera = createNewPass( passType, name );
     osg::StateSet* stateset = camera->getOrCreateStateSet();
+    std::vector<std::string> inputs, outputs;
     osg::ref_ptr<osg::Program> program = new osg::Program;
     program->setName( name );
     
@@ -195,6 +223,7 @@ osg::Camera* Compositor::createPassFromXML( osgDB::XmlNode* xmlNode )
                 {
                     camera->setViewport( 0, 0, texture->getTextureWidth(), texture->getTextureHeight() );
                     camera->attach( bc, texture, level, face, useMipmap>0?true:false, samples, colorSamples );
+                    outputs.push_back( xmlChild->getTrimmedContents() );
                     numAttached++;
                 }
                 else
@@ -225,7 +254,11 @@ osg::Camera* Compositor::createPassFromXML( osgDB::XmlNode* xmlNode )
                 stateset->addUniform( new osg::Uniform(varname.c_str(), unit) );
                 
                 osg::Texture* texture = getTexture( xmlChild->getTrimmedContents() );
-                if ( texture ) stateset->setTextureAttributeAndModes( unit, texture, modeValue );
+                if ( texture )
+                {
+                    stateset->setTextureAttributeAndModes( unit, texture, modeValue );
+                    inputs.push_back( xmlChild->getTrimmedContents() );
+                }
                 else ofwarn("Compositor: <pass> can't find global texture object %1%", %xmlChild->getTrimmedContents());
             }
         }
@@ -338,6 +371,40 @@ osg::Camera* Compositor::createPassFromXML( osgDB::XmlNode* xmlNode )
         stateset->setAttributeAndModes( program.get(), shaderModeValue );
     }
     
+    PassData& passData = getPassList().back();
+    passData.inputs = inputs;
+    passData.outputs = outputs;
+    passData.dynamicResolution = atoi( xmlNode->properties["dynamic_resolution"].c_str() )>0;
+    
+    int updateInterval = atoi( xmlNode->properties["update_interval"].c_str() );
+    if ( updateInterval>1 && !numAttached )
+        ofwarn("Compositor: <pass> %1% draws to the screen, so it is updated every frame", %name);
+    else if ( updateInterval>1 )
+    {
+        passData.updateInterval = updateInterval;
+        passData.updateOffset = atoi( xmlNode->properties["update_offset"].c_str() );
+        passData.checkerboardUpdate = xmlNode->properties["update_pattern"]=="checkerboard";
+        if ( passData.checkerboardUpdate )
+        {
+            // Pixels of the other phases keep their contents from the previous frames, so
+            // blending would accumulate the results of every frame in them
+            camera->setClearMask( camera->getClearMask() & ~GL_COLOR_BUFFER_BIT );
+            if ( stateset->getMode(GL_BLEND) & osg::StateAttribute::ON )
+                ofwarn("Compositor: <pass> %1% uses update_pattern=\"checkerboard\", so its <blend_mode> is ignored", %name);
+            stateset->setMode( GL_BLEND, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE|osg::StateAttribute::PROTECTED );
+            
+            // Views that did not write all the pixels yet update all of them
+            osg::Uniform* phase = new osg::Uniform( "osg_UpdatePhase", 0.0f );
+            phase->setDataVariance( osg::Object::DYNAMIC );
+            passData.phaseStateSet = new osg::StateSet;
+            passData.phaseStateSet->addUniform( new osg::Uniform("osg_UpdateInterval", (float)updateInterval) );
+            passData.phaseStateSet->addUniform( phase );
+            passData.fullUpdateStateSet = new osg::StateSet;
+            passData.fullUpdateStateSet->addUniform( new osg::Uniform("osg_UpdateInterval", 1.0f) );
+            passData.fullUpdateStateSet->addUniform( new osg::Uniform("osg_UpdatePhase", 0.0f) );
+        }
+    }
+    
     if ( !numAttached )
     {
         // Automatically treat cameras without outputs as nested ones in the normal scene
@@ -359,8 +426,29 @@ osg::Texture* Compositor::createTextureFromXML( osgDB::XmlNode* xmlNode, bool as
         owarn("Compositor: inappropriate to create texture/buffer with empty name");
     
     bool isBufferObject = (xmlNode->name.find("buffer") != std::string::npos);
-    bool useRelativeSize = (atoi(xmlNode->properties["relative_size"].c_str()) > 0);
+    bool useViewportSize = (xmlNode->properties["relative_size"] == "viewport");
+    bool useRelativeSize = useViewportSize || (atoi(xmlNode->properties["relative_size"].c_str()) > 0);
     int w = _renderTargetResolution[0], h = _renderTargetResolution[1], d = _renderTargetResolution[2];
+    bool followsViewport = false;
+    if ( useViewportSize && isBufferObject )
+    {
+        if ( type!="2d" || !asGlobal )
+        {
+            ofwarn("Compositor: buffer %1% can't follow the viewport size, only global 2d buffers can", %name);
+        }
+        else
+        {
+            // Sized from the viewport once it is known: until then, use the render target resolution
+            const std::string& width = xmlNode->properties["width"];
+            const std::string& height = xmlNode->properties["height"];
+            osg::Vec2 scale( width.empty() ? 1.0f : atof(width.c_str()), height.empty() ? 1.0f : atof(height.c_str()) );
+            _viewportBufferScales[name] = scale;
+            followsViewport = true;
+            if ( _viewportSize.x()>0 ) { w = _viewportSize.x(); h = _viewportSize.y(); }
+            w = osg::maximum( 1, (int)(w * scale.x() + 0.5f) );
+            h = osg::maximum( 1, (int)(h * scale.y() + 0.5f) );
+        }
+    }
     if ( type=="1d" )
     {
         osg::Texture1D* tex1D = new osg::Texture1D;
@@ -375,7 +463,9 @@ osg::Texture* Compositor::createTextureFromXML( osgDB::XmlNode* xmlNode, bool as
     else if ( type=="2d" )
     {
         osg::Texture2D* tex2D = new osg::Texture2D;
-        if ( isBufferObject )
+        if ( followsViewport )
+            tex2D->setTextureSize( w, h );
+        else if ( isBufferObject )
         {
             if ( useRelativeSize ) w *= atof( xmlNode->properties["width"].c_str() );
             else w = atoi( xmlNode->properties["width"].c_str() );
@@ -477,8 +567,16 @@ osg::Texture* Compositor::createTextureFromXML( osgDB::XmlNode* xmlNode, bool as
         if ( childName=="file" )
         {
             std::string options = xmlChild->properties["options"];
-            if ( options.empty() ) image = osgDB::readImageFile( xmlChild->getTrimmedContents() );
-            else image = osgDB::readImageFile( xmlChild->getTrimmedContents(), new osgDB::Options(options) );
+            std::string imageFile = osgDB::findDataFile( xmlChild->getTrimmedContents(), _options.get() );
+            if ( imageFile.empty() ) imageFile = xmlChild->getTrimmedContents();
+            if ( options.empty() ) image = EffectCache::getImage( imageFile, _options.get() );
+            else
+            {
+                osg::ref_ptr<osgDB::Options> imageOptions = _options.valid() ?
+                    _options->cloneOptions() : new osgDB::Options;
+                imageOptions->setOptionString( options );
+                image = EffectCache::getImage( imageFile, imageOptions.get() );
+            }
             
             std::string index = xmlChild->properties["index"];
             texture->setImage( atoi(index.c_str()), image );
@@ -502,7 +600,7 @@ osg::Texture* Compositor::createTextureFromXML( osgDB::XmlNode* xmlNode, bool as
             h = atoi( xmlChild->properties["t"].c_str() );
             d = atoi( xmlChild->properties["r"].c_str() );
             
-            std::string rawfile = osgDB::findDataFile( xmlChild->getTrimmedContents() );
+            std::string rawfile = osgDB::findDataFile( xmlChild->getTrimmedContents(), _options.get() );
             std::ifstream ifs( rawfile.c_str(), std::ios::in|std::ios::binary|std::ios::ate );
             if ( ifs )
             {
@@ -645,6 +743,10 @@ osg::Texture* Compositor::createTextureFromXML( osgDB::XmlNode* xmlNode, bool as
     {
         if ( !setTexture(name, texture.get()) )
             ofwarn("Compositor: <texture> object name %1% already exists", %name);
+        
+        // Buffers whose contents must survive between frames can't share their render target
+        int persistent = atoi( xmlNode->properties["persistent"].c_str() );
+        if ( isBufferObject && persistent==0 ) _bufferTextures[name] = texture;
         return texture.get();
     }
     else
@@ -746,6 +848,18 @@ osg::Uniform* Compositor::createUniformFromXML( osgDB::XmlNode* xmlNode, bool as
             else if ( valueName=="inv_modelview_matrix" ) addInbuiltUniform( SCENE_INV_MODELVIEW_MATRIX, uniform );
             else if ( valueName=="projection_matrix" ) addInbuiltUniform( SCENE_PROJECTION_MATRIX, uniform );
             else if ( valueName=="inv_projection_matrix" ) addInbuiltUniform( SCENE_INV_PROJECTION_MATRIX, uniform );
+            
+            // All the camera values in a single uniform, of type mat4
+            else if ( valueName=="camera_block" )
+            {
+                if ( type==osg::Uniform::FLOAT_MAT4 )
+                {
+                    uniform->setNumElements( CAMERA_BLOCK_SIZE );
+                    addInbuiltUniform( CAMERA_BLOCK, uniform );
+                }
+                else
+                    ofwarn("Compositor: <inbuilt_value> camera_block of %1% needs a mat4 uniform", %name);
+            }
             else
             {
                 ofwarn("Compositor: <inbuilt_value> of %1% doesn't have a recognizable value: %2%", %name %valueName);
@@ -853,7 +967,7 @@ osg::Shader* Compositor::createShaderFromXML( osgDB::XmlNode* xmlNode, bool asGl
         }
         else if ( childName=="file" )
         {
-            std::string shaderFile = osgDB::findDataFile( xmlChild->getTrimmedContents() );
+            std::string shaderFile = osgDB::findDataFile( xmlChild->getTrimmedContents(), _options.get() );
             if ( shaderFile.empty() )
             {
                 ofwarn("Compositor: <shader> failed to load <file>: %1%",
@@ -862,7 +976,12 @@ osg::Shader* Compositor::createShaderFromXML( osgDB::XmlNode* xmlNode, bool asGl
             else
             {
                 filePath = osgDB::getFilePath( shaderFile );
-                shader->loadShaderSourceFromFile( shaderFile );
+                addSourceFile( shaderFile );
+                std::string source;
+                if ( ShaderSourceCache::getFileSource(shaderFile, source) )
+                    shader->setShaderSource( source );
+                else
+                    ofwarn("Compositor: <shader> failed to read <file>: %1%", %shaderFile);
             }
         }
         else
@@ -880,15 +999,16 @@ osg::Shader* Compositor::createShaderFromXML( osgDB::XmlNode* xmlNode, bool asGl
         std::string::size_type pos3 = code.find("\"", pos2 + 1);
         if ( pos3==std::string::npos ) break;
         
-        std::string filename = code.substr(pos2 + 1, pos3 - pos2 - 1);
-        filename = osgDB::findDataFile( filename );
-        if ( filename.empty() ) filename = osgDB::findDataFile( filePath + "/" + filename );
+        std::string includeName = code.substr(pos2 + 1, pos3 - pos2 - 1);
+        std::string filename = osgDB::findDataFile( includeName, _options.get() );
+        if ( filename.empty() ) filename = osgDB::findDataFile( filePath + "/" + includeName, _options.get() );
         
-        osg::ref_ptr<osg::Shader> innerShader = osgDB::readShaderFile( shader->getType(), filename );
-        if ( !innerShader ) break;
+        std::string innerSource;
+        if ( !ShaderSourceCache::getFileSource(filename, innerSource) ) break;
+        addSourceFile( filename );
         
-        code.replace( pos, pos3 - pos + 1, innerShader->getShaderSource() );
-        pos += innerShader->getShaderSource().size();
+        code.replace( pos, pos3 - pos + 1, innerSource );
+        pos += innerSource.size();
     }
     shader->setShaderSource( code );
     
@@ -904,6 +1024,7 @@ osg::Shader* Compositor::createShaderFromXML( osgDB::XmlNode* xmlNode, bool asGl
 
 bool Compositor::loadFromXML( osgDB::XmlNode* xmlNode, XmlTemplateMap& templateMap, const osgDB::Options* options )
 {
+    if ( options!=NULL ) _options = options;
     if ( xmlNode->type==osgDB::XmlNode::ROOT )
     {
         for ( unsigned int i=0; i<xmlNode->children.size(); ++i )
@@ -914,6 +1035,7 @@ bool Compositor::loadFromXML( osgDB::XmlNode* xmlNode, XmlTemplateMap& templateM
         }
     }
     
+    std::string firstTechnique;
     for ( unsigned int i=0; i<xmlNode->children.size(); ++i )
     {
         osgDB::XmlNode* xmlChild = xmlNode->children[i];
@@ -948,6 +1070,7 @@ bool Compositor::loadFromXML( osgDB::XmlNode* xmlNode, XmlTemplateMap& templateM
         {
             std::string name = xmlChild->properties["name"];
             setCurrentTechnique( name.empty() ? "default" : name );
+            if ( firstTechnique.empty() ) firstTechnique = _currentTechnique;
             for ( unsigned int j=0; j<xmlChild->children.size(); ++j )
             {
                 osgDB::XmlNode* xmlPassChild = xmlChild->children[j];
@@ -962,41 +1085,183 @@ bool Compositor::loadFromXML( osgDB::XmlNode* xmlNode, XmlTemplateMap& templateM
                 }
                 
                 if ( xmlPassChild->name.find("pass")!=std::string::npos )
-                    createPassFromXML( xmlPassChild );
+                {
+                    osg::Camera* camera = createPassFromXML( xmlPassChild );
+                    PassDefinition& def = _passDefinitions[_currentTechnique + "/" + camera->getName()];
+                    def.xmlNode = xmlPassChild;
+                    def.hash = hashPassDefinition( this, xmlPassChild, camera );
+                }
                 else
                     ofwarn("Compositor: <technique> doesn't recognize child element %1%", %xmlPassChild->name);
             }
         }
         else if ( childName=="buffer" || childName=="texture" )
+        {
             createTextureFromXML( xmlChild, true );
+            _definitionHashes["texture:" + xmlChild->properties["name"]] = hashXmlNode( xmlChild );
+        }
         else if ( childName=="uniform" )
+        {
             createUniformFromXML( xmlChild, true );
+            _definitionHashes["uniform:" + xmlChild->properties["name"]] = hashXmlNode( xmlChild );
+        }
         else if ( childName=="shader" )
+        {
             createShaderFromXML( xmlChild, true );
+            _definitionHashes["shader:" + xmlChild->properties["name"]] = hashXmlNode( xmlChild );
+        }
         else
             ofwarn("Compositor: doesn't recognize global element %1%", %childName);
     }
+    
+    // The first technique of an effect is the one used by default
+    if ( !firstTechnique.empty() ) setCurrentTechnique( firstTechnique );
+    return true;
+}
+
+bool Compositor::reloadFromXML( osgDB::XmlNode* xmlNode, const osgDB::Options* options )
+{
+    // Load the new definition on its own first, then compare it with the current one
+    osg::ref_ptr<Compositor> updated = new Compositor;
+    XmlTemplateMap templateMap;
+    if ( !updated->loadFromXML(xmlNode, templateMap, options) ) return false;
+    
+    // Changes to buffers and textures or to the pass lists need a full reload
+    std::map<std::string, unsigned int>::const_iterator hitr, hitr2;
+    for ( hitr=_definitionHashes.begin(), hitr2=updated->_definitionHashes.begin();
+          hitr!=_definitionHashes.end() && hitr2!=updated->_definitionHashes.end(); ++hitr, ++hitr2 )
+    {
+        if ( hitr->first!=hitr2->first ) return false;
+        if ( hitr->second!=hitr2->second && hitr->first.compare(0, 8, "texture:")==0 ) return false;
+    }
+    if ( _definitionHashes.size()!=updated->_definitionHashes.size() ) return false;
+    
+    if ( _passLists.size()!=updated->_passLists.size() ) return false;
+    for ( PassListMap::const_iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        PassListMap::const_iterator litr2 = updated->_passLists.find( litr->first );
+        if ( litr2==updated->_passLists.end() || litr2->second.size()!=litr->second.size() ) return false;
+        for ( unsigned int i=0; i<litr->second.size(); ++i )
+        {
+            if ( litr->second[i].name!=litr2->second[i].name ) return false;
+        }
+    }
+    
+    // Global uniforms can be updated in place, unless their type changed or they are animated
+    std::vector<std::string> changedUniforms;
+    for ( hitr=_definitionHashes.begin(); hitr!=_definitionHashes.end(); ++hitr )
+    {
+        if ( hitr->first.compare(0, 8, "uniform:")!=0 ) continue;
+        if ( hitr->second==updated->_definitionHashes[hitr->first] ) continue;
+        
+        std::string name = hitr->first.substr( 8 );
+        osg::Uniform* uniform = getUniform( name );
+        osg::Uniform* newUniform = updated->getUniform( name );
+        if ( !uniform || !newUniform || isInbuiltUniform(uniform) || updated->isInbuiltUniform(newUniform) ||
+             uniform->getType()!=newUniform->getType() ||
+             uniform->getNumElements()!=newUniform->getNumElements() ||
+             uniform->getUpdateCallback() || newUniform->getUpdateCallback() )
+            return false;
+        changedUniforms.push_back( name );
+    }
+    
+    // Nothing can fail past this point
+    for ( unsigned int i=0; i<changedUniforms.size(); ++i )
+        getUniform( changedUniforms[i] )->copyData( *updated->getUniform(changedUniforms[i]) );
+    
+    // Global shaders are updated in place, so every pass using them sees the new source
+    for ( ShaderMap::iterator sitr=_shaderMap.begin(); sitr!=_shaderMap.end(); ++sitr )
+    {
+        osg::Shader* newShader = updated->getShader( sitr->first );
+        if ( newShader && newShader->getShaderSource()!=sitr->second->getShaderSource() )
+            sitr->second->setShaderSource( newShader->getShaderSource() );
+    }
+    
+    // Rebuild the passes whose definition changed
+    _options = options;
+    std::string currentTechnique = _currentTechnique;
+    unsigned int numRebuilt = 0;
+    for ( PassListMap::iterator litr=_passLists.begin(); litr!=_passLists.end(); ++litr )
+    {
+        const std::string& technique = litr->first;
+        for ( unsigned int i=0; i<litr->second.size(); ++i )
+        {
+            std::string key = technique + "/" + litr->second[i].name;
+            const PassDefinition& newDef = updated->_passDefinitions[key];
+            if ( !newDef.xmlNode.valid() || _passDefinitions[key].hash==newDef.hash ) continue;
+            
+            // The new pass gets appended to the technique: move it in place of the old one.
+            // Switch techniques without resizing buffers, the current one is restored below.
+            _currentTechnique = technique;
+            createPassFromXML( newDef.xmlNode.get() );
+            PassList& passList = getPassList();
+            bool activated = passList[i].activated;
+            passList[i] = passList.back();
+            passList[i].activated = activated;
+            passList.pop_back();
+            
+            _passDefinitions[key] = newDef;
+            numRebuilt++;
+        }
+    }
+    _currentTechnique = currentTechnique;
+    
+    _definitionHashes = updated->_definitionHashes;
+    _sourceFiles = updated->_sourceFiles;
+    
+    if ( numRebuilt>0 )
+    {
+        // Also resizes the outputs of the new passes like the rest of the buffers
+        aliasBuffers();
+        updatePassGraph();
+    }
+    oflog(Verbose, "[Compositor::reloadFromXML] %1% uniforms updated, %2% passes rebuilt",
+        %changedUniforms.size() %numRebuilt);
     return true;
 }
 
+void Compositor::addSourceFile( const std::string& path )
+{
+    _sourceFiles[path] = EffectCache::getFileStamp( path );
+}
+
+bool Compositor::areSourceFilesChanged() const
+{
+    for ( std::map<std::string, time_t>::const_iterator itr=_sourceFiles.begin();
+          itr!=_sourceFiles.end(); ++itr )
+    {
+        if ( EffectCache::getFileStamp(itr->first)!=itr->second ) return true;
+    }
+    return false;
+}
+
 /* Global functions */
 
+// Options used to load an effect file: files referenced by the effect are
+// searched next to it first.
+static osgDB::Options* createEffectOptions( const std::string& fullpath, const osgDB::Options* options )
+{
+    osgDB::Options* effectOptions = options!=NULL ? options->cloneOptions() : new osgDB::Options;
+    effectOptions->getDatabasePathList().push_front( osgDB::getFilePath(fullpath) );
+    return effectOptions;
+}
+
 Compositor* cyclops::readEffectFile( const std::string& filename, const osgDB::Options* options )
 {
 	String fullpath;
 	if(DataManager::findFile(filename, fullpath))
 	{
-		osg::ref_ptr<osgDB::XmlNode> xmlRoot = osgDB::readXmlFile( fullpath, options );
+		List<String> files;
+		osg::ref_ptr<osgDB::XmlNode> xmlRoot = EffectCache::getEffect( fullpath, &files );
 		if ( xmlRoot.valid() )
 		{
-			osgDB::FilePathList& filePaths = osgDB::getDataFilePathList();
-			filePaths.push_back( osgDB::getFilePath(filename) );
-        
+			osg::ref_ptr<osgDB::Options> effectOptions = createEffectOptions( fullpath, options );
 			osg::ref_ptr<Compositor> compositor = new Compositor;
 			Compositor::XmlTemplateMap templateMap;
-			compositor->loadFromXML( xmlRoot.get(), templateMap, options );
-        
-			filePaths.pop_back();
+			compositor->loadFromXML( xmlRoot.get(), templateMap, effectOptions.get() );
+			compositor->aliasBuffers();
+			compositor->updatePassGraph();
+			foreach(String file, files) compositor->addSourceFile( file );
 			return compositor.release();
 		}
 	}
@@ -1016,7 +1281,24 @@ Compositor* cyclops::readEffectStream( std::istream& stream, const osgDB::Option
         osg::ref_ptr<Compositor> compositor = new Compositor;
         Compositor::XmlTemplateMap templateMap;
         compositor->loadFromXML( xmlRoot.get(), templateMap, options );
+        compositor->aliasBuffers();
+        compositor->updatePassGraph();
         return compositor.release();
     }
     return NULL;
 }
+
+bool cyclops::reloadEffectFile( Compositor* compositor, const std::string& filename, const osgDB::Options* options )
+{
+    String fullpath;
+    if ( !DataManager::findFile(filename, fullpath) ) return false;
+    
+    List<String> files;
+    osg::ref_ptr<osgDB::XmlNode> xmlRoot = EffectCache::getEffect( fullpath, &files );
+    if ( !xmlRoot.valid() ) return false;
+    
+    osg::ref_ptr<osgDB::Options> effectOptions = createEffectOptions( fullpath, options );
+    if ( !compositor->reloadFromXML(xmlRoot.get(), effectOptions.get()) ) return false;
+    foreach(String file, files) compositor->addSourceFile( file );
+    return true;
+}
@@ -0,0 +1,241 @@
+/******************************************************************************
+ * THE OMEGA LIB PROJECT
+ *-----------------------------------------------------------------------------
+ * Copyright 2010-2015		Electronic Visualization Laboratory, 
+ *							University of Illinois at Chicago
+ * Authors:										
+ *  Alessandro Febretti		febret@gmail.com
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2010-2015, Electronic Visualization Laboratory,  
+ * University of Illinois at Chicago
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification, 
+ * are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this 
+ * list of conditions and the following disclaimer. Redistributions in binary 
+ * form must reproduce the above copyright notice, this list of conditions and 
+ * the following disclaimer in the documentation and/or other materials provided 
+ * with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE  GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-----------------------------------------------------------------------------
+ * What's in this file
+ *	A process-wide cache of parsed compositor effect definitions and images.
+ ******************************************************************************/
+#include "cyclops/EffectCache.h"
+
+// We need to include this instead of fstream or we get duplicate symbols on
+// linking.
+#include <osgDB/ReadFile>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osg/ImageStream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using namespace cyclops;
+
+Dictionary<unsigned int, osg::ref_ptr<osgDB::XmlNode> > EffectCache::sEffects;
+Dictionary<String, unsigned int> EffectCache::sFileHashes;
+Dictionary<String, EffectCache::CachedImage> EffectCache::sImages;
+Lock EffectCache::sLock;
+
+// Maximum include nesting, to stop on recursive includes.
+static const int sMaxIncludeDepth = 8;
+
+///////////////////////////////////////////////////////////////////////////////
+static osgDB::XmlNode* cloneXmlNode(const osgDB::XmlNode* node)
+{
+    osgDB::XmlNode* clone = new osgDB::XmlNode;
+    clone->type = node->type;
+    clone->name = node->name;
+    clone->contents = node->contents;
+    clone->properties = node->properties;
+    for(unsigned int i = 0; i < node->children.size(); i++)
+    {
+        clone->children.push_back(cloneXmlNode(node->children[i].get()));
+    }
+    return clone;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+time_t EffectCache::getFileStamp(const String& path)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0) return st.st_mtime;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+unsigned int EffectCache::hash(const String& data)
+{
+    unsigned int h = 2166136261u;
+    for(size_t i = 0; i < data.size(); i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osgDB::XmlNode* EffectCache::getEffect(const String& path, List<String>* outFiles)
+{
+    return getEffect(path, outFiles, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osgDB::XmlNode* EffectCache::getEffect(const String& path, List<String>* outFiles, int depth)
+{
+    std::ifstream t(path.c_str());
+    if(!t.is_open()) return NULL;
+    std::stringstream buffer;
+    buffer << t.rdbuf();
+    String content = buffer.str();
+    unsigned int h = hash(content);
+
+    if(outFiles != NULL) outFiles->push_back(path);
+
+    osg::ref_ptr<osgDB::XmlNode> effect;
+    sLock.lock();
+    if(sEffects.find(h) != sEffects.end()) effect = sEffects[h];
+    sLock.unlock();
+
+    if(!effect.valid())
+    {
+        // Parse outside of the lock. If two threads parse the same content at 
+        // the same time, they will both store the same definition.
+        std::istringstream stream(content);
+        effect = osgDB::readXmlStream(stream);
+        if(!effect.valid()) return NULL;
+        oflog(Verbose, "[EffectCache] parsed %1%", %path);
+
+        sLock.lock();
+        // Drop the definition of the previous content of this file.
+        if(sFileHashes.find(path) != sFileHashes.end()) sEffects.erase(sFileHashes[path]);
+        sEffects[h] = effect;
+        sFileHashes[path] = h;
+        sLock.unlock();
+    }
+
+    osgDB::XmlNode* copy = cloneXmlNode(effect.get());
+    resolveIncludes(copy, path, outFiles, depth);
+    return copy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void EffectCache::resolveIncludes(osgDB::XmlNode* node, const String& path, List<String>* outFiles, int depth)
+{
+    unsigned int i = 0;
+    while(i < node->children.size())
+    {
+        osgDB::XmlNode* child = node->children[i].get();
+        if(child->name != "include")
+        {
+            resolveIncludes(child, path, outFiles, depth);
+            i++;
+            continue;
+        }
+
+        // Look for included files next to the including file first.
+        String name = child->getTrimmedContents();
+        String includePath = osgDB::concatPaths(osgDB::getFilePath(path), name);
+        osg::ref_ptr<osgDB::XmlNode> included;
+        if(depth >= sMaxIncludeDepth)
+        {
+            ofwarn("[EffectCache] %1%: too many nested includes", %path);
+        }
+        else if(getFileStamp(includePath) == 0 && !DataManager::findFile(name, includePath))
+        {
+            ofwarn("[EffectCache] %1%: could not find included file %2%", %path %name);
+        }
+        else
+        {
+            included = getEffect(includePath, outFiles, depth + 1);
+        }
+
+        // Replace the include with the content of the included compositor.
+        node->children.erase(node->children.begin() + i);
+        if(!included.valid()) continue;
+
+        osgDB::XmlNode* root = included.get();
+        for(unsigned int j = 0; j < included->children.size(); j++)
+        {
+            if(included->children[j]->name == "compositor") root = included->children[j].get();
+        }
+        node->children.insert(node->children.begin() + i, root->children.begin(), root->children.end());
+        i += root->children.size();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::Image* EffectCache::getImage(const String& path, const osgDB::Options* options)
+{
+    String key = path;
+    if(options != NULL) key = path + "|" + options->getOptionString();
+
+    // Images are revalidated using the stamp of the file they were read from.
+    String file = osgDB::findDataFile(path, options);
+    time_t stamp = getFileStamp(file);
+
+    sLock.lock();
+    Dictionary<String, CachedImage>::iterator it = sImages.find(key);
+    if(it != sImages.end() && it->second.file == file && it->second.stamp == stamp)
+    {
+        osg::Image* image = it->second.image.get();
+        sLock.unlock();
+        return image;
+    }
+    sLock.unlock();
+
+    osg::ref_ptr<osg::Image> image = osgDB::readImageFile(path, options);
+    if(!image.valid()) return NULL;
+
+    // Image streams keep a playback state, so each effect needs its own.
+    if(dynamic_cast<osg::ImageStream*>(image.get()) == NULL)
+    {
+        CachedImage ci;
+        ci.image = image;
+        ci.file = file;
+        ci.stamp = stamp;
+        sLock.lock();
+        sImages[key] = ci;
+        sLock.unlock();
+    }
+    return image.release();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void EffectCache::releaseUnusedImages()
+{
+    sLock.lock();
+    Dictionary<String, CachedImage>::iterator it = sImages.begin();
+    while(it != sImages.end())
+    {
+        // The cache holds the only reference: no effect uses the image.
+        if(it->second.image->referenceCount() == 1) sImages.erase(it++);
+        else it++;
+    }
+    sLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void EffectCache::clear()
+{
+    sLock.lock();
+    sEffects.clear();
+    sFileHashes.clear();
+    sImages.clear();
+    sLock.unlock();
+}
@@ -35,6 +35,7 @@
  ******************************************************************************/
 #include "cyclops/EffectNode.h"
 #include "cyclops/SceneManager.h"
+#include "cyclops/ShadowMapGenerator.h"
 
 #include <osgFX/Technique>
 #include <osg/PolygonMode>
@@ -123,6 +124,15 @@ void EffectNode::setShaderManager(ShaderManager* sm)
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void EffectNode::refreshPrograms()
+{
+    foreach(Material* m, myMaterials)
+    {
+        m->refreshProgram();
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void EffectNode::traverse(osg::NodeVisitor& nv)
 {
@@ -131,6 +141,15 @@ void EffectNode::traverse(osg::NodeVisitor& nv)
         // Do a traversal for each active material.
         osgUtil::CullVisitor* cv = (osgUtil::CullVisitor*)&nv;
 
+        // Filterable shadow passes write caster depth moments: pushing the
+        // material state (and its protected program) here would write the 
+        // lit material color instead.
+        if(ShadowMapGenerator::isMomentsCamera(cv->getCurrentRenderStage()->getCamera()))
+        {
+            Group::traverse(nv);
+            return;
+        }
+
         // Retrieve the omegalib draw context from the osg cull visitor.
         omegaOsg::OsgDrawInformation* odi = 
             dynamic_cast<omegaOsg::OsgDrawInformation*>(cv->getRenderStage()->getCamera()->getUserData());
@@ -54,11 +54,27 @@ Entity::Entity(SceneManager* scene):
         myEffect(NULL),
         myOsgSceneObject(NULL),
         myCastShadow(true),
+        myStaticShadowCaster(false),
         myCullingActive(true),
+        myLastCasterPosition(Vector3f::Zero()),
+        myLastCasterOrientation(Quaternion::Identity()),
+        myLastCasterScale(Vector3f::Ones()),
+        myLastCasterVisible(false),
+        myCulledLights(0),
         myLayer(NULL)
 {
     // By default attach new entities to the root node of the scene.
     myEffect = new EffectNode(scene);
+
+    // All lights are enabled by default. Lighting layers will update this
+    // uniform with the lights that do not reach this entity.
+    myLightCulledUniform = new osg::Uniform(osg::Uniform::FLOAT, 
+        "unif_LightCulled", ShaderManager::MaxLights);
+    for(int i = 0; i < ShaderManager::MaxLights; i++)
+    {
+        myLightCulledUniform->setElement(i, 0.0f);
+    }
+    myEffect->getOrCreateStateSet()->addUniform(myLightCulledUniform);
     Engine* engine = mySceneManager->getEngine();
 
     // Add an empty material by default
@@ -70,6 +86,7 @@ Entity::Entity(SceneManager* scene):
 ///////////////////////////////////////////////////////////////////////////////
 Entity::~Entity()
 {
+    if(myCastShadow && myStaticShadowCaster) ShadowMap::invalidateStaticCasters();
     setLayer(NULL);
     // Make sure rigid body is unregistered.
     myRigidBody->setEnabled(false);
@@ -86,6 +103,27 @@ void Entity::setLayer(SceneLayer* layer)
 ///////////////////////////////////////////////////////////////////////////////
 void Entity::updateTraversal(const UpdateContext& context)
 {
+    // Static casters moving or changing visibility invalidate cached 
+    // static shadows.
+    if(myCastShadow && myStaticShadowCaster)
+    {
+        if(myLastCasterPosition != getDerivedPosition() ||
+            !myLastCasterOrientation.coeffs().isApprox(getDerivedOrientation().coeffs()) ||
+            myLastCasterScale != getDerivedScale() ||
+            myLastCasterVisible != isVisible())
+        {
+            myLastCasterPosition = getDerivedPosition();
+            myLastCasterOrientation = getDerivedOrientation();
+            myLastCasterScale = getDerivedScale();
+            myLastCasterVisible = isVisible();
+            ShadowMap::invalidateStaticCasters();
+        }
+    }
+
+    // Shader managers replace shared programs when their shader variation 
+    // changes: pick up the new ones.
+    myEffect->refreshPrograms();
+
     if(myRigidBody)
     {
         myRigidBody->updateEntity();
@@ -93,6 +131,19 @@ void Entity::updateTraversal(const UpdateContext& context)
     SceneNode::updateTraversal(context);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void Entity::setCulledLights(uint mask)
+{
+    // Only touch the uniform when the culled light set changes, so static
+    // scenes do not dirty entity state every frame.
+    if(mask == myCulledLights) return;
+    myCulledLights = mask;
+    for(int i = 0; i < ShaderManager::MaxLights; i++)
+    {
+        myLightCulledUniform->setElement(i, (mask & (1 << i)) ? 1.0f : 0.0f);
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void Entity::initialize(osg::Node* node)
 {
@@ -216,20 +267,41 @@ void Entity::setShaderManager(ShaderManager* sm)
 ///////////////////////////////////////////////////////////////////////////////
 void Entity::castShadow(bool value)
 {
+    if(myStaticShadowCaster && value != myCastShadow) 
+    {
+        ShadowMap::invalidateStaticCasters();
+    }
     myCastShadow = value;
     if(myOsgNode != NULL)
     {
         if(!myCastShadow)
         {
-            myOsgNode->setNodeMask(0xffffffff & ~ShadowMap::CastsShadowTraversalMask);
+            myOsgNode->setNodeMask(0xffffffff & ~(ShadowMap::CastsShadowTraversalMask |
+                ShadowMap::StaticCasterTraversalMask | ShadowMap::DynamicCasterTraversalMask));
+        }
+        else if(myStaticShadowCaster)
+        {
+            myOsgNode->setNodeMask(0xffffffff & ~ShadowMap::DynamicCasterTraversalMask);
         }
         else
         {
-            myOsgNode->setNodeMask(0xffffffff);
+            myOsgNode->setNodeMask(0xffffffff & ~ShadowMap::StaticCasterTraversalMask);
         }
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void Entity::setStaticShadowCaster(bool value)
+{
+    if(value != myStaticShadowCaster)
+    {
+        myStaticShadowCaster = value;
+        // Update the node mask (and invalidate static shadows if needed).
+        if(myCastShadow) ShadowMap::invalidateStaticCasters();
+        castShadow(myCastShadow);
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 bool Entity::doesCastShadow()
 {
@@ -38,6 +38,10 @@
 
 using namespace cyclops;
 
+// Light intensity below which a light is considered to have no influence on
+// a surface (roughly one step of an 8-bit color channel).
+static const float sInfluenceThreshold = 1.0f / 256.0f;
+
 ///////////////////////////////////////////////////////////////////////////////
 Light* Light::create()
 {
@@ -51,6 +55,7 @@ Light::Light(SceneManager* scene):
     myColor(Color::White),
     myAmbient(Color::Black),
     myAttenuation(Vector3f(1.0, 0.0, 0.0)),
+    myInfluenceRadius(0),
     myEnabled(true),
     // NOTE: for non-spot lights FOV needs to be > of 180 otherwise shadow maps
     // will try to use a non-existent light direction vector so setup a shadow
@@ -58,7 +63,11 @@ Light::Light(SceneManager* scene):
     mySpotCutoff(180),
     mySpotExponent(1),
     myLayer(NULL),
-    myShadowRefreshMode(OnFrame)
+    myShadowRefreshMode(OnFrame),
+    myParamVersion(0),
+    myTransformVersion(0),
+    myLastPosition(Vector3f::Zero()),
+    myLastOrientation(Quaternion::Identity())
 {
     getEngine()->getScene()->addChild(this);
     setLayer(mySceneManager->getLightingLayer());
@@ -74,7 +83,8 @@ Light::~Light()
 ///////////////////////////////////////////////////////////////////////////////
 void Light::updateTraversal(const UpdateContext& context)
 {
-    if(myShadow != NULL && myShadowRefreshMode == OnLightMove)
+    if(myShadow != NULL && 
+        (myShadowRefreshMode == OnLightMove || myShadowRefreshMode == Scheduled))
     {
         if(myLastShadowPos != getDerivedPosition())
         {
@@ -82,6 +92,7 @@ void Light::updateTraversal(const UpdateContext& context)
             myLastShadowPos = getDerivedPosition();
         }
     }
+    if(myShadow != NULL) myShadow->setInfluenceRadius(getInfluenceRadius());
     SceneNode::updateTraversal(context);
 }
 
@@ -91,6 +102,7 @@ void Light::setEnabled(bool value)
     if(myEnabled != value)
     {
         myEnabled = value;
+        myParamVersion++;
         if(myShadow != NULL)
         {
             if(myEnabled)
@@ -123,7 +135,7 @@ void Light::setShadowRefreshMode(ShadowRefreshMode srm)
     myShadowRefreshMode = srm;
     if(myShadow != NULL)
     {
-        if(myShadowRefreshMode != OnFrame)
+        if(myShadowRefreshMode != OnFrame && myShadowRefreshMode != StaticCached)
         {
             myShadow->setManualRefreshEnabled(true);
         }
@@ -131,6 +143,8 @@ void Light::setShadowRefreshMode(ShadowRefreshMode srm)
         {
             myShadow->setManualRefreshEnabled(false);
         }
+        myShadow->setStaticCachingEnabled(myShadowRefreshMode == StaticCached);
+        myShadow->setScheduled(myShadowRefreshMode == Scheduled);
     }
 }
 
@@ -159,9 +173,62 @@ void Light::setLightType(LightType type)
     case Directional: myLightFunction = "directionalLightFunction"; break;
     case Spot: myLightFunction = "spotLightFunction"; break;
     }
+    myParamVersion++;
+    // Shadow cascades are only supported by directional lights, and
+    // omnidirectional shadows by point lights.
+    if(myShadow != NULL) myShadow->updateTechnique();
     requestShaderUpdate();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+uint Light::getTransformVersion()
+{
+    // Checked lazily instead of in updateTraversal, so light instances see
+    // the current transform regardless of update order. A light shared by
+    // many layers only bumps its version once per change.
+    const Vector3f& pos = getDerivedPosition();
+    const Quaternion& orient = getDerivedOrientation();
+    if(pos != myLastPosition || orient.coeffs() != myLastOrientation.coeffs())
+    {
+        myLastPosition = pos;
+        myLastOrientation = orient;
+        myTransformVersion++;
+    }
+    return myTransformVersion;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+float Light::getInfluenceRadius()
+{
+    // Directional lights can reach anything.
+    if(myType == Directional) return FLT_MAX;
+    if(myInfluenceRadius > 0) return myInfluenceRadius;
+    // We can't make assumptions on what custom light functions do with 
+    // attenuation.
+    if(myType == Custom) return FLT_MAX;
+
+    // Find the distance at which the attenuated light intensity falls below
+    // the influence threshold, solving
+    // c + l * d + q * d^2 = maxIntensity / threshold
+    float maxIntensity = 0;
+    for(int i = 0; i < 3; i++)
+    {
+        maxIntensity = std::max(maxIntensity, myColor[i]);
+        maxIntensity = std::max(maxIntensity, myAmbient[i]);
+    }
+    float k = maxIntensity / sInfluenceThreshold;
+    float c = myAttenuation[0];
+    float l = myAttenuation[1];
+    float q = myAttenuation[2];
+
+    if(c >= k) return 0;
+    if(q > 0) return (-l + sqrt(l * l - 4 * q * (c - k))) / (2 * q);
+    if(l > 0) return (k - c) / l;
+    
+    // No distance attenuation: influence is unbounded.
+    return FLT_MAX;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 LightInstance* Light::createInstance(osg::Group* rootNode)
 {
@@ -193,7 +260,11 @@ LightInstance::LightInstance(Light* l, osg::Group* root):
     myLight(l),
     myGroup(root),
     myShaderUpdateNeeded(true),
-    myIndex(0)
+    myIndex(0),
+    myDirty(true),
+    myLastEnabled(false),
+    myParamVersion(0),
+    myTransformVersion(0)
 {
     myOsgLight = new osg::Light();
     myOsgLightSource = new osg::LightSource();
@@ -209,52 +280,80 @@ LightInstance::~LightInstance()
 ///////////////////////////////////////////////////////////////////////////////
 void LightInstance::setLightIndex(int index)
 {
-    myIndex = index;
-    myOsgLight->setLightNum(myIndex);
+    if(myIndex != index)
+    {
+        myIndex = index;
+        myOsgLight->setLightNum(myIndex);
+        // The light number changed: re-apply the light to the state set.
+        myDirty = true;
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 bool LightInstance::update()
 {
-    if(myLight->myEnabled)
+    bool enabled = myLight->myEnabled;
+    if(enabled != myLastEnabled)
     {
-        osg::Light* ol = myOsgLight;
-        osg::LightSource* ols = myOsgLightSource;
-        const Vector3f pos = myLight->getDerivedPosition();
+        myLastEnabled = enabled;
+        myDirty = true;
+    }
 
-        if(myLight->myType != Light::Directional)
-        {
-            ol->setPosition(osg::Vec4(pos[0], pos[1], pos[2], 1.0));
-        }
-        else
+    if(enabled)
+    {
+        uint paramVersion = myLight->getParamVersion();
+        uint transformVersion = myLight->getTransformVersion();
+
+        // Nothing changed since the last update: leave the osg light alone.
+        if(myDirty || 
+            paramVersion != myParamVersion || 
+            transformVersion != myTransformVersion)
         {
-            ol->setPosition(osg::Vec4(pos[0], pos[1], pos[2], 0.0));
-        }
-        ol->setAmbient(COLOR_TO_OSG(myLight->myAmbient));
-        ol->setDiffuse(COLOR_TO_OSG(myLight->myColor));
-        ol->setSpecular(COLOR_TO_OSG(myLight->myColor));
-        ol->setConstantAttenuation(myLight->myAttenuation[0]);
-        ol->setLinearAttenuation(myLight->myAttenuation[1]);
-        ol->setQuadraticAttenuation(myLight->myAttenuation[2]);
+            osg::Light* ol = myOsgLight;
+            osg::LightSource* ols = myOsgLightSource;
+            const Vector3f pos = myLight->getDerivedPosition();
 
-        // Re-orient light direction based on light node orientation.
-        Vector3f lightDir = myLight->getDerivedOrientation() * myLight->myLightDirection;
+            if(myLight->myType != Light::Directional)
+            {
+                ol->setPosition(osg::Vec4(pos[0], pos[1], pos[2], 1.0));
+            }
+            else
+            {
+                ol->setPosition(osg::Vec4(pos[0], pos[1], pos[2], 0.0));
+            }
+            ol->setAmbient(COLOR_TO_OSG(myLight->myAmbient));
+            ol->setDiffuse(COLOR_TO_OSG(myLight->myColor));
+            ol->setSpecular(COLOR_TO_OSG(myLight->myColor));
+            ol->setConstantAttenuation(myLight->myAttenuation[0]);
+            ol->setLinearAttenuation(myLight->myAttenuation[1]);
+            ol->setQuadraticAttenuation(myLight->myAttenuation[2]);
 
-        ol->setDirection(osg::Vec3(lightDir[0], lightDir[1], lightDir[2]));
-        ol->setSpotCutoff(myLight->mySpotCutoff);
-        ol->setSpotExponent(myLight->mySpotExponent);
+            // Re-orient light direction based on light node orientation.
+            Vector3f lightDir = myLight->getDerivedOrientation() * myLight->myLightDirection;
 
-        ols->setLight(ol);
+            ol->setDirection(osg::Vec3(lightDir[0], lightDir[1], lightDir[2]));
+            ol->setSpotCutoff(myLight->mySpotCutoff);
+            ol->setSpotExponent(myLight->mySpotExponent);
 
-        osg::StateSet* sState = myGroup->getOrCreateStateSet();
-        ols->setStateSetModes(*sState,osg::StateAttribute::ON);
+            if(myDirty)
+            {
+                ols->setLight(ol);
+
+                osg::StateSet* sState = myGroup->getOrCreateStateSet();
+                ols->setStateSetModes(*sState,osg::StateAttribute::ON);
+            }
+
+            myParamVersion = paramVersion;
+            myTransformVersion = transformVersion;
+        }
     }
-    else
+    else if(myDirty)
     {
         osg::StateSet* sState = myGroup->getOrCreateStateSet();
         myOsgLightSource->setStateSetModes(*sState,osg::StateAttribute::OFF); 
         myOsgLightSource->setLight(NULL);
     }
+    myDirty = false;
 
     bool update = myShaderUpdateNeeded;
     myShaderUpdateNeeded = false;
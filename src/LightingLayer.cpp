@@ -34,12 +34,34 @@
 #include "cyclops/LightingLayer.h"
 #include "cyclops/Entity.h"
 
+#include <algorithm>
+#include <functional>
+
 using namespace omega;
 using namespace cyclops;
 
+// Light data used by LightingLayer::cullLights
+struct CullableLight
+{
+    int index;
+    float radius;
+    Vector3f position;
+    Vector3f attenuation;
+};
+
+// Sort key used to pick the most relevant lights when an entity is reached by
+// more lights than allowed.
+typedef std::pair<float, int> LightWeight;
+
+// Sort key used to pick the scheduled shadow maps to refresh.
+typedef std::pair<float, ShadowMap*> ShadowPriority;
+
 ///////////////////////////////////////////////////////////////////////////////
 LightingLayer::LightingLayer():
-    myShaderManager(new ShaderManager())
+    myShaderManager(new ShaderManager()),
+    myMaxLightsPerEntity(ShaderManager::MaxLights),
+    myShadowAtlasSize(4096),
+    myShadowRefreshBudget(0)
 {
     myPreShadowNode = new osg::Group();
     myPreShadowNode->addChild(myRoot);
@@ -47,7 +69,10 @@ LightingLayer::LightingLayer():
 
 ///////////////////////////////////////////////////////////////////////////////
 LightingLayer::LightingLayer(ShaderManager* sm):
-    myShaderManager(sm)
+    myShaderManager(sm),
+    myMaxLightsPerEntity(ShaderManager::MaxLights),
+    myShadowAtlasSize(4096),
+    myShadowRefreshBudget(0)
 {
     myPreShadowNode = new osg::Group();
     myPreShadowNode->addChild(myRoot);
@@ -58,6 +83,48 @@ LightingLayer::~LightingLayer()
 {
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void LightingLayer::setShadowAtlasEnabled(bool value)
+{
+    if(value == isShadowAtlasEnabled()) return;
+
+    osg::StateSet* ss = myRoot->getOrCreateStateSet();
+    if(value)
+    {
+        myShadowAtlas = new ShadowAtlas(this, myShadowAtlasSize, ShaderManager::MaxLights);
+        // Shaders only sample the atlas: no need to enable texture modes
+        ss->setTextureAttribute(ShaderManager::ShadowAtlasTexUnit, myShadowAtlas->getTexture());
+        ss->addUniform(new osg::Uniform("shadowAtlas", ShaderManager::ShadowAtlasTexUnit));
+        ss->addUniform(myShadowAtlas->getMatricesUniform());
+        ss->addUniform(myShadowAtlas->getRectsUniform());
+    }
+    else
+    {
+        ss->removeTextureAttribute(ShaderManager::ShadowAtlasTexUnit, myShadowAtlas->getTexture());
+        ss->removeUniform("shadowAtlas");
+        ss->removeUniform(myShadowAtlas->getMatricesUniform());
+        ss->removeUniform(myShadowAtlas->getRectsUniform());
+        myShadowAtlas->clear();
+        myShadowAtlas = NULL;
+    }
+    // Shadow maps get packed into the atlas (or get their own texture units 
+    // back) on the next shader manager update.
+    myShaderManager->setShadowAtlas(myShadowAtlas);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void LightingLayer::setShadowAtlasSize(int size)
+{
+    if(size == myShadowAtlasSize) return;
+    myShadowAtlasSize = size;
+    if(isShadowAtlasEnabled())
+    {
+        // Re-create the atlas with the new size.
+        setShadowAtlasEnabled(false);
+        setShadowAtlasEnabled(true);
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void LightingLayer::addEntity(Entity* e)
 {
@@ -182,4 +249,123 @@ void LightingLayer::removeLightFromSubLayers(SceneLayer* layer, Light* l)
 void LightingLayer::updateLayer()
 {
     myShaderManager->update();
+
+    scheduleShadowRefresh();
+    cullLights();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void LightingLayer::scheduleShadowRefresh()
+{
+    Camera* cam = Engine::instance()->getDefaultCamera();
+    Vector3f eye = cam->getDerivedPosition();
+
+    Vector<ShadowPriority> candidates;
+    typedef KeyValue<Light*, LightInstance*> LightInstanceMapItem;
+    foreach(LightInstanceMapItem i, myLights)
+    {
+        Light* l = i.getKey();
+        ShadowMap* sm = l->getShadow();
+        // Only schedule shadow maps owned by this layer (lights from parent
+        // layers are scheduled by their own layer).
+        if(!l->isEnabled() || sm == NULL || !sm->isScheduled() || 
+            sm->getLayer() != this) continue;
+
+        sm->myFramesSinceRefresh++;
+        if(sm->myRefreshRequested)
+        {
+            candidates.push_back(ShadowPriority(FLT_MAX, sm));
+            continue;
+        }
+
+        // Estimate the light importance as its intensity times the fraction
+        // of the view its influence can cover.
+        const Color& c = l->getColor();
+        float importance = std::max(c[0], std::max(c[1], c[2]));
+        float radius = l->getInfluenceRadius();
+        if(radius != FLT_MAX)
+        {
+            float d = (l->getDerivedPosition() - eye).norm();
+            if(d > radius) importance *= (radius * radius) / (d * d);
+        }
+        // Keep a minimum importance so every shadow map gets refreshed 
+        // eventually.
+        importance = std::max(importance, 0.001f);
+        candidates.push_back(ShadowPriority(importance * sm->myFramesSinceRefresh, sm));
+    }
+
+    int n = candidates.size();
+    if(myShadowRefreshBudget > 0 && myShadowRefreshBudget < n) n = myShadowRefreshBudget;
+    std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(), 
+        std::greater<ShadowPriority>());
+    for(int i = 0; i < n; i++) candidates[i].second->refresh();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void LightingLayer::cullLights()
+{
+    // Collect the enabled lights in this layer that can be culled.
+    Vector<CullableLight> lights;
+    bool needsCulling = false;
+    typedef KeyValue<Light*, LightInstance*> LightInstanceMapItem;
+    foreach(LightInstanceMapItem i, myLights)
+    {
+        Light* l = i.getKey();
+        LightInstance* li = i.getValue();
+        if(l->isEnabled() && li->getLightIndex() < ShaderManager::MaxLights)
+        {
+            CullableLight cl;
+            cl.index = li->getLightIndex();
+            cl.radius = l->getInfluenceRadius();
+            cl.position = l->getDerivedPosition();
+            cl.attenuation = l->getAttenuation();
+            lights.push_back(cl);
+            if(cl.radius != FLT_MAX) needsCulling = true;
+        }
+    }
+    if((int)lights.size() > myMaxLightsPerEntity) needsCulling = true;
+
+    foreach(Entity* e, myEntities)
+    {
+        uint culled = 0;
+        if(needsCulling)
+        {
+            const Vector3f& center = e->getBoundCenter();
+            float radius = e->getBoundRadius();
+
+            Vector<LightWeight> reaching;
+            foreach(const CullableLight& cl, lights)
+            {
+                if(cl.radius == FLT_MAX)
+                {
+                    reaching.push_back(LightWeight(FLT_MAX, cl.index));
+                    continue;
+                }
+                float d = (cl.position - center).norm() - radius;
+                if(d > cl.radius)
+                {
+                    culled |= (1 << cl.index);
+                }
+                else
+                {
+                    // Weight reaching lights by their attenuation at the
+                    // entity bounds.
+                    if(d < 0) d = 0;
+                    const Vector3f& a = cl.attenuation;
+                    reaching.push_back(LightWeight(
+                        1.0f / (a[0] + a[1] * d + a[2] * d * d), cl.index));
+                }
+            }
+            if((int)reaching.size() > myMaxLightsPerEntity)
+            {
+                std::sort(reaching.begin(), reaching.end());
+                int numCulled = reaching.size() - myMaxLightsPerEntity;
+                for(int i = 0; i < numCulled; i++)
+                {
+                    culled |= (1 << reaching[i].second);
+                }
+            }
+        }
+        e->setCulledLights(culled);
+    }
 }
@@ -57,7 +57,7 @@ Material::Material(osg::StateSet* ss, SceneManager* sm): Uniforms(ss),
 	// meterial. If the material owner entity gets attached to a different
 	// scene layer providing its own shader manager, this will be substituted
 	// through the setShaderManager method.
-	mySceneManager(sm), myShaderManager(sm),
+	mySceneManager(sm), myShaderManager(sm), myProgramsVersion(-1),
     myForceTransparentBin(false)
 {
 	reset();
@@ -315,6 +315,7 @@ void Material::reset()
 bool Material::setProgram(const String& name)
 {
 	myProgramName = name;
+	myProgramsVersion = myShaderManager->getProgramsVersion();
 
 	// Shortcut: if program name is null, disable shader programs for this 
 	// material.
@@ -345,6 +346,8 @@ bool Material::setProgram(const String& name)
 	StringUtils::trim(pvar);
 
 	ProgramAsset* pa = getOrCreateProgram(pname, pvar);
+	// Creating the program may have replaced other programs of the manager.
+	myProgramsVersion = myShaderManager->getProgramsVersion();
 	if(pa != NULL)
 	{
 		myStateSet->setAttributeAndModes(pa->program, 
@@ -407,6 +410,15 @@ void Material::setShaderManager(ShaderManager* sm)
 	setProgram(myProgramName);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void Material::refreshProgram()
+{
+	if(myProgramsVersion != myShaderManager->getProgramsVersion())
+	{
+		setProgram(myProgramName);
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 bool Material::isPointSprite()
 {
@@ -47,6 +47,7 @@
 #include "cyclops/Shapes.h"
 #include "cyclops/ModelGeometry.h"
 #include "cyclops/LightingLayer.h"
+#include "cyclops/EffectCache.h"
 
 // Bullet and osgBullet
 #include <btBulletDynamicsCommon.h>
@@ -163,7 +164,8 @@ SceneManager::SceneManager():
     myDynamicsWorld(NULL),
     myPhysicsEnabled(false),
     myColDetectionEnabled(false),
-    myEngine(Engine::instance())
+    myEngine(Engine::instance()),
+    myFrameTime(0)
 {
     myOsg = OsgModule::instance();
 
@@ -291,17 +293,33 @@ void SceneManager::unload()
     myModelDictionary.clear();
 
     oflog(Verbose, "[SceneManager::unload] releasing <%1%> programs", %myPrograms.size());
-    myPrograms.clear();
+    releasePrograms();
 
     oflog(Verbose, "[SceneManager::unload] releasing <%1%> textures", %myTextures.size());
     myTextures.clear();
+
+    // Drop cached compositor definitions and images.
+    EffectCache::clear();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void SceneManager::update(const UpdateContext& context) 
 {
+    myFrameTime = context.dt;
+
     // Update the scene layers.
+    static Stat* layerUpdateTime = SystemManager::instance()->getStatsManager()->createStat("cyclops layers update", Stat::Time);
+    layerUpdateTime->startTiming();
     myCompositingLayer->update();
+    layerUpdateTime->stopTiming();
+
+    if(mySkyBox != NULL) mySkyBox->update();
+
+    // Publish the shadow pass counts of the last frame.
+    static Stat* shadowPassesRendered = SystemManager::instance()->getStatsManager()->createStat("cyclops shadow passes rendered", Stat::Count1);
+    static Stat* shadowPassesSkipped = SystemManager::instance()->getStatsManager()->createStat("cyclops shadow passes skipped", Stat::Count2);
+    shadowPassesRendered->addSample(ShadowMap::getRenderedPassCount());
+    shadowPassesSkipped->addSample(ShadowMap::getSkippedPassCount());
 
     // Loop through pixel buffers associated to textures. If a texture pixel buffer is dirty, 
     // update the relative texture.
@@ -680,15 +698,41 @@ bool SceneManager::handleCommand(const String& cmd)
     if(args[0] == "?" && args.size() == 1)
     {
         omsg("SceneManager");
-        omsg("\t shaderInfo  - prints list of cached shaders");
+        omsg("\t shaderInfo  - prints list of cached shaders and shared programs");
+        omsg("\t compositorInfo  - prints the pass graph of the scene compositor");
+        omsg("\t compositorProfile [on|off] - toggles compositor pass profiling, or prints pass times");
     }
     else if(args[0] == "shaderInfo")
     {
         typedef Dictionary<String, Ref<osg::Shader> >::Item ShaderItem;
-        foreach(ShaderItem si, myShaders)
+        foreach(ShaderItem si, sShaders)
         {
             omsg(si.getKey());
         }
+        typedef ProgramRegistry::Item ProgramItem;
+        foreach(ProgramItem pi, sPrograms)
+        {
+            omsg(ostr("%1% (users: %2%)", %pi.getKey() %pi.getValue().users));
+        }
+        return true;
+    }
+    else if(args[0] == "compositorInfo")
+    {
+        Compositor* compositor = myCompositingLayer->getCompositor();
+        if(compositor == NULL) omsg("No compositor loaded");
+        else
+        {
+            omsg(compositor->getPassGraphDescription());
+            int instances = myCompositingLayer->getNumCompositorInstances();
+            if(instances > 0) omsg(ostr("Compositor instances for other cameras: %1%", %instances));
+        }
+        return true;
+    }
+    else if(args[0] == "compositorProfile")
+    {
+        if(args.size() > 1) myCompositingLayer->setProfilingEnabled(args[1] == "on");
+        else if(!myCompositingLayer->isProfilingEnabled()) omsg("Compositor profiling is disabled");
+        else omsg(myCompositingLayer->getProfile());
         return true;
     }
     return false;
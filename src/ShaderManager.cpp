@@ -37,6 +37,7 @@
  ******************************************************************************/
 #include "cyclops/ShaderManager.h"
 #include "cyclops/ShadowMap.h"
+#include "cyclops/ShaderSourceCache.h"
 
 // We need to include this instead of fstream or we get duplicate symbols on
 // linking.
@@ -45,9 +46,52 @@
 using namespace omega;
 using namespace cyclops;
 
+ShaderManager::ProgramRegistry ShaderManager::sPrograms;
+ShaderManager::ShaderRegistry ShaderManager::sShaders;
+
+///////////////////////////////////////////////////////////////////////////////
+static size_t hashString(const String& str)
+{
+#ifdef OMEGA_OS_WIN
+	std::hash<String> hashFx;
+#else
+	std::tr1::hash<String> hashFx;
+#endif
+	return hashFx(str);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Local macros are defined by the shaders themselves (using $@name ... $) and
+// expanded by compileShader for each light or shadow map.
+static bool isLocalMacro(const String& name)
+{
+	return name == "fragmentLightSection" ||
+		name == "vertexShadowSection" ||
+		name == "vertexShadowAtlasSection";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the light shadow map if shader code can be generated for it, that is
+// if it has an atlas slot or a texture unit. A shadow map that just left an 
+// atlas has neither until the owning shader manager assigns it a unit: the 
+// light is treated as unshadowed until then.
+static ShadowMap* getBoundShadow(Light* light)
+{
+	ShadowMap* shadow = light->getShadow();
+	if(shadow != NULL && 
+		(shadow->getAtlasSlot() >= 0 || shadow->getTextureUnit() >= 0))
+	{
+		return shadow;
+	}
+	return NULL;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ShaderManager::ShaderManager():
-	myNumActiveLights(0)
+	myNumActiveLights(0),
+	myMacroSignatureDirty(true),
+	myMacroSignature(0),
+	myProgramsVersion(0)
 {
 	// Standard shaders
 #ifdef APPLE
@@ -69,6 +113,7 @@ ShaderManager::ShaderManager():
 
 	setShaderMacroToString("customFragmentDefs", "");
 	setShaderMacroToFile("postLightingSection", "cyclops/common/postLighting/default.frag");
+	setShaderMacroToFile("fragmentOutputSection", "cyclops/common/fragmentOutput/default.frag");
 
 	setShaderMacroToFile("fsinclude shadowFunctions", "cyclops/common/forward/shadowFunctions.frag");
 	setShaderMacroToFile("vsinclude shadowFunctions", "cyclops/common/forward/shadowFunctions.vert");
@@ -84,7 +129,19 @@ ShaderManager::ShaderManager():
 ///////////////////////////////////////////////////////////////////////////////
 ShaderManager::~ShaderManager()
 {
+	releasePrograms();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShaderManager::releasePrograms()
+{
+	typedef Dictionary<String, Ref<ProgramAsset> >::Item ProgramAssetItem;
+	foreach(ProgramAssetItem item, myPrograms)
+	{
+		releaseSharedProgram(item.getValue());
+	}
 	myPrograms.clear();
+	myProgramsVersion++;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -108,18 +165,18 @@ void ShaderManager::removeLightInstance(LightInstance* li)
 void ShaderManager::setShaderMacroToString(const String& macroName, const String& macroString)
 {
 	myShaderMacros[macroName] = macroString;
+	myShaderMacroFiles.erase(macroName);
+	myMacroSignatureDirty = true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void ShaderManager::setShaderMacroToFile(const String& macroName, const String& name)
 {
-	String path;
-	if(DataManager::findFile(name, path))
+	String source;
+	if(ShaderSourceCache::getSource(name, source))
 	{
-		std::ifstream t(path.c_str());
-		std::stringstream buffer;
-		buffer << t.rdbuf();
-		setShaderMacroToString(macroName, buffer.str());
+		setShaderMacroToString(macroName, source);
+		myShaderMacroFiles[macroName] = name;
 	}
 	else
 	{
@@ -133,30 +190,56 @@ void ShaderManager::update()
 	int i = 0;
 	int numShadows = 0;
 	bool needShaderUpdate = false;
+	List<ShadowMap*> atlasShadows;
+	List<int> atlasSlots;
 	foreach(LightInstance* l, myActiveLights)
 	{
 		Light* light = l->getLight();
 		if(light->isEnabled())
 		{
 			l->setLightIndex(i++);
-			// If light has a shadow map, allocate a texture unit to it
 			ShadowMap* shadow = light->getShadow();
-			if(shadow != NULL)
+			if(shadow != NULL && myShadowAtlas != NULL && 
+				shadow->getLayer() == myShadowAtlas->getLayer() &&
+				l->getLightIndex() < MaxLights)
 			{
-				int unit = ShadowFirstTexUnit + numShadows++;
-				// Re-set the texture unit only if needed (for performance)
-				if(unit != shadow->getTextureUnit())
-				{
-					shadow->setTextureUnit(unit);
-					// Shadow texture unit assignment changed: update 
-					// shaders accordingly.
-					needShaderUpdate = true;
-				}
+				// Shadow maps of our own layer go in the atlas, using the 
+				// light index as the atlas slot.
+				atlasShadows.push_back(shadow);
+				atlasSlots.push_back(l->getLightIndex());
 			}
 		}
 		needShaderUpdate |= l->update();
 	}
 
+	// Atlas assignment changed: update shaders accordingly. Other shader 
+	// managers using these lights are notified through the lights (see 
+	// ShadowMap::setAtlas). Pack before assigning texture units, so shadow
+	// maps that did not fit in the atlas fall back to their own texture.
+	if(myShadowAtlas != NULL)
+	{
+		needShaderUpdate |= myShadowAtlas->pack(atlasShadows, atlasSlots);
+	}
+
+	foreach(LightInstance* l, myActiveLights)
+	{
+		Light* light = l->getLight();
+		ShadowMap* shadow = light->getShadow();
+		if(light->isEnabled() && shadow != NULL && shadow->getAtlas() == NULL)
+		{
+			// If light has a shadow map, allocate a texture unit to it
+			int unit = ShadowFirstTexUnit + numShadows++;
+			// Re-set the texture unit only if needed (for performance)
+			if(unit != shadow->getTextureUnit())
+			{
+				shadow->setTextureUnit(unit);
+				// Shadow texture unit assignment changed: update 
+				// shaders accordingly.
+				needShaderUpdate = true;
+			}
+		}
+	}
+
 	// If the number of lights changed, reset the shaders
 	if(i != myNumActiveLights || needShaderUpdate)
 	{
@@ -172,32 +255,28 @@ void ShaderManager::update()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void ShaderManager::loadShader(osg::Shader* shader, const String& name)
+void ShaderManager::setShadowAtlas(ShadowAtlas* atlas)
 {
-	// If shader source is not in the cache, load it now.
-	if(myShaderCache.find(name) == myShaderCache.end())
+	if(atlas != myShadowAtlas)
 	{
-		String path;
-		if(DataManager::findFile(name, path))
-		{
-			oflog(Verbose, "Loading shader: %1%", %name);
-
-			std::ifstream t(path.c_str());
-			std::stringstream buffer;
-			buffer << t.rdbuf();
-			String shaderSrc = buffer.str();
-
-			myShaderCache[name] = shaderSrc;
-		}
-		else
-		{
-			ofwarn("Could not find shader file %1%", %name);
-		}
+		if(myShadowAtlas != NULL) myShadowAtlas->clear();
+		myShadowAtlas = atlas;
+		// Force a shader update on the next update call.
+		myNumActiveLights = -1;
 	}
+}
 
-	if(myShaderCache.find(name) != myShaderCache.end())
+///////////////////////////////////////////////////////////////////////////////
+void ShaderManager::loadShader(osg::Shader* shader, const String& name)
+{
+	String shaderSrc;
+	if(ShaderSourceCache::getSource(name, shaderSrc))
 	{
-		compileShader(shader, myShaderCache[name]);
+		compileShader(shader, shaderSrc);
+	}
+	else
+	{
+		ofwarn("Could not find shader file %1%", %name);
 	}
 }
 
@@ -205,8 +284,24 @@ void ShaderManager::loadShader(osg::Shader* shader, const String& name)
 void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 {
 	String shaderPreSrc = source;
+	String shaderHeader = "";
 	String lightSectionMacroName = "fragmentLightSection";
 	String shadowSectionMacroName = "vertexShadowSection";
+	String atlasShadowSectionMacroName = "vertexShadowAtlasSection";
+
+	// Atlas shadows are declared in shadowFunctions, which needs to know 
+	// whether the atlas is in use.
+	bool useAtlas = false;
+	foreach(LightInstance* li, myActiveLights)
+	{
+		Light* light = li->getLight();
+		if(light->isEnabled() && getBoundShadow(light) != NULL &&
+			light->getShadow()->getAtlasSlot() >= 0)
+		{
+			useAtlas = true;
+		}
+	}
+	if(useAtlas) shaderHeader = "#define SHADOW_ATLAS\n";
 
 	if(shader->getType() == osg::Shader::FRAGMENT)
 	{
@@ -215,7 +310,42 @@ void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 		foreach(LightInstance* li, myActiveLights)
 		{
 			Light* light = li->getLight();
-			if(light->isEnabled() && light->getShadow() != NULL)
+			if(light->isEnabled() && getBoundShadow(light) != NULL &&
+				light->getShadow()->getAtlasSlot() >= 0)
+			{
+				// Atlas uniforms are declared in shadowFunctions.
+			}
+			else if(light->isEnabled() && getBoundShadow(light) != NULL &&
+				light->getShadow()->getCascades() > 1)
+			{
+				// Cascaded shadow maps use a shadow texture array, and need
+				// the texture array extension.
+				int unit = light->getShadow()->getTextureUnit();
+				shadowTexUniforms += ostr("uniform sampler2DArrayShadow shadowTexture%1%;\n", %unit);
+				shadowTexUniforms += ostr("uniform mat4 shadowCascadeMatrices%1%[%2%];\n", 
+					%unit %ShadowMapGenerator::MaxCascades);
+				shaderHeader = 
+					"#extension GL_EXT_texture_array : enable\n"
+					"#define CASCADED_SHADOWS\n" + 
+					String(useAtlas ? "#define SHADOW_ATLAS\n" : "");
+			}
+			else if(light->isEnabled() && getBoundShadow(light) != NULL &&
+				light->getShadow()->isOmnidirectional())
+			{
+				// Cube shadow map faces, in a single texture.
+				int unit = light->getShadow()->getTextureUnit();
+				shadowTexUniforms += ostr("uniform sampler2DShadow shadowTexture%1%;\n", %unit);
+				shadowTexUniforms += ostr("uniform mat4 shadowCubeMatrices%1%[6];\n", %unit);
+			}
+			else if(light->isEnabled() && getBoundShadow(light) != NULL &&
+				light->getShadow()->isFilterable())
+			{
+				// Filterable shadow maps store depth moments.
+				int unit = light->getShadow()->getTextureUnit();
+				shadowTexUniforms += ostr("uniform sampler2D shadowTexture%1%;\n", %unit);
+				shadowTexUniforms += ostr("uniform float shadowExponent%1%;\n", %unit);
+			}
+			else if(light->isEnabled() && getBoundShadow(light) != NULL)
 			{
 				int unit = light->getShadow()->getTextureUnit();
 				shadowTexUniforms += ostr("uniform sampler2DShadow shadowTexture%1%;\n", %unit);
@@ -238,8 +368,7 @@ void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 	{
 		foreach(ShaderMacroDictionary::Item macro, myShaderMacros)
 		{
-			if(macro.getKey() != lightSectionMacroName &&
-				macro.getKey() != shadowSectionMacroName)
+			if(!isLocalMacro(macro.getKey()))
 			{
 				String macroName = ostr("@%1%", %macro.getKey());
 				shaderPreSrc = StringUtils::replaceAll(shaderPreSrc, macroName, macro.getValue());
@@ -247,8 +376,7 @@ void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 		}
 	}
 
-	// Read local macro definitions (only supported one now are
-	// fragmentLightSection and vertexShadowSection)
+	// Read local macro definitions (see isLocalMacro)
 	String shaderSrc = "";
 	Vector<String> segments = StringUtils::split(shaderPreSrc, "$");
 	//ofmsg("segments %1%", %segments.size());
@@ -285,10 +413,44 @@ void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 				"@lightIndex", 
 				boost::lexical_cast<String>(li->getLightIndex()));
 
+			// Skip the light section for entities this light does not reach
+			// (see LightingLayer::cullLights). The branch is uniform across
+			// a draw call, so culled lights cost no shading work.
+			if(li->getLightIndex() < MaxLights)
+			{
+				fragmentShaderLightCodeIndexed = ostr(
+					"if(unif_LightCulled[%1%] == 0.0)\n{\n%2%\n}\n",
+					%li->getLightIndex() %fragmentShaderLightCodeIndexed);
+			}
+
 			// Add the shadow value to the section
-			if(light->getShadow() != NULL)
+			if(getBoundShadow(light) != NULL)
 			{
-				if(light->getShadow()->isSoft())
+				if(light->getShadow()->getAtlasSlot() >= 0)
+				{
+					fragmentShaderLightCodeIndexed = StringUtils::replaceAll(fragmentShaderLightCodeIndexed,
+						"@shadowValue", ostr("computeAtlasShadowMap(%1%)", %light->getShadow()->getAtlasSlot()));
+				}
+				else if(light->getShadow()->getCascades() > 1)
+				{
+					int unit = light->getShadow()->getTextureUnit();
+					fragmentShaderLightCodeIndexed = StringUtils::replaceAll(fragmentShaderLightCodeIndexed,
+						"@shadowValue", ostr("computeCascadedShadowMap(shadowTexture%1%, gl_TexCoord[%1%], shadowCascadeMatrices%1%, %2%.0)", 
+						%unit %light->getShadow()->getCascades()));
+				}
+				else if(light->getShadow()->isOmnidirectional())
+				{
+					int unit = light->getShadow()->getTextureUnit();
+					fragmentShaderLightCodeIndexed = StringUtils::replaceAll(fragmentShaderLightCodeIndexed,
+						"@shadowValue", ostr("computeCubeShadowMap(shadowTexture%1%, gl_TexCoord[%1%], shadowCubeMatrices%1%)", %unit));
+				}
+				else if(light->getShadow()->isFilterable())
+				{
+					int unit = light->getShadow()->getTextureUnit();
+					fragmentShaderLightCodeIndexed = StringUtils::replaceAll(fragmentShaderLightCodeIndexed,
+						"@shadowValue", ostr("computeVarianceShadowMap(shadowTexture%1%, gl_TexCoord[%1%], shadowExponent%1%)", %unit));
+				}
+				else if(light->getShadow()->isSoft())
 				{
 					int unit = light->getShadow()->getTextureUnit();
 					fragmentShaderLightCodeIndexed = StringUtils::replaceAll(fragmentShaderLightCodeIndexed,
@@ -314,23 +476,38 @@ void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 			fragmentShaderLightSection += fragmentShaderLightCodeIndexed;
 		}
 	}
+	if(fragmentShaderLightSection != "" &&
+		shaderSrc.find("@" + lightSectionMacroName) != String::npos)
+	{
+		shaderSrc = ostr("uniform float unif_LightCulled[%1%];\n", %MaxLights) + shaderSrc;
+	}
 	shaderSrc = StringUtils::replaceAll(shaderSrc, 
 		"@" + lightSectionMacroName, 
 		fragmentShaderLightSection);
 
 	// Vertex special section: setup shadows 
 	String shadowSectionCode = "";
-	String shadowSectionInstance = myShaderMacros["vertexShadowSection"];
+	String shadowSectionInstance = myShaderMacros[shadowSectionMacroName];
+	if(useAtlas) 
+	{
+		shadowSectionCode += StringUtils::replaceAll(
+			myShaderMacros[atlasShadowSectionMacroName], 
+			"@shadowAtlasUnit", boost::lexical_cast<String>(ShadowAtlasPositionUnit));
+	}
 	foreach(LightInstance* li, myActiveLights)
 	{
 		Light* light = li->getLight();
 		if(light->isEnabled())
 		{
 			// Add the shadow value to the section
-			if(light->getShadow() != NULL)
+			if(getBoundShadow(light) != NULL && light->getShadow()->getAtlasSlot() < 0)
 			{
 				int unit = light->getShadow()->getTextureUnit();
-				String funcCall = StringUtils::replaceAll(shadowSectionInstance,
+				// Cascaded and cube shadow maps use texture coordinates 
+				// relative to the cascades origin or the light, generated 
+				// like plain shadow maps.
+				String funcCall = StringUtils::replaceAll(
+					shadowSectionInstance,
 					"@shadowUnit", boost::lexical_cast<String>(unit));
 				shadowSectionCode += funcCall;
 			}
@@ -343,7 +520,9 @@ void ShaderManager::compileShader(osg::Shader* shader, const String& source)
 	// omsg("#############################################################");
 	// omsg(shaderSrc);
 	// omsg("#############################################################");
-	shader->setShaderSource(shaderSrc);
+	// The header contains directives that need to be at the very beginning
+	// of the shader.
+	shader->setShaderSource(shaderHeader + shaderSrc);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -356,65 +535,190 @@ ProgramAsset* ShaderManager::getOrCreateProgram(const String& name, const String
 	}
 
 	ProgramAsset* asset = new ProgramAsset();
-	asset->program = new osg::Program();
 	asset->name = name;
-	asset->program->setName(name);
 	asset->fragmentShaderName = fragmentShaderName;
 	asset->vertexShaderName = vertexShaderName;
 
 	myPrograms[name] = asset;
 
 	// Do not remove this, bitch!
-	recompileShaders(asset, myShaderVariationName);
-
-	return asset;
+	return bindSharedProgram(asset);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 ProgramAsset* ShaderManager::createProgramFromString(const String& name, const String& vertexShaderCode, const String& fragmentShaderCode)
 {
 	ProgramAsset* asset = new ProgramAsset();
-	asset->program = new osg::Program();
 	asset->name = name;
-	asset->program->setName(name);
 	asset->fragmentShaderSource = fragmentShaderCode;
 	asset->fragmentShaderName = name + "Fragment";
 	asset->vertexShaderSource = vertexShaderCode;
 	asset->vertexShaderName = name + "Vertex";
 	asset->embedded = true;
 
+	if(myPrograms.find(name) != myPrograms.end())
+	{
+		releaseSharedProgram(myPrograms[name]);
+	}
 	myPrograms[name] = asset;
 
-	recompileShaders(asset, myShaderVariationName);
-
-	return asset;
+	return bindSharedProgram(asset);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void ShaderManager::addProgram(ProgramAsset* program)
 {
-	myPrograms[program->name] = program;
-	program->program = new osg::Program();
-	program->program->setName(program->name);
-	recompileShaders(program, myShaderVariationName);
+	// The passed program is used as a definition only: the program actually
+	// used by this manager may be shared with other managers.
+	ProgramAsset* asset = new ProgramAsset();
+	asset->copyDefinition(program);
+
+	if(myPrograms.find(program->name) != myPrograms.end())
+	{
+		releaseSharedProgram(myPrograms[program->name]);
+	}
+	myPrograms[program->name] = asset;
+
+	bindSharedProgram(asset);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void ShaderManager::updateProgram(ProgramAsset* program)
 {
+	if(myPrograms.find(program->name) == myPrograms.end())
+	{
+		addProgram(program);
+		return;
+	}
+
+	ProgramAsset* current = myPrograms[program->name];
+
 	// Delete current shaders to force reload.
 	String fullVertexShaderName = program->vertexShaderName + myShaderVariationName;
 	String fullFragmentShaderName = program->fragmentShaderName + myShaderVariationName;
 
 	// Delete binaries...
-	myShaders[fullVertexShaderName] = NULL;
-	myShaders[fullFragmentShaderName] = NULL;
+	sShaders.erase(getShaderKey(current, fullVertexShaderName, current->vertexShaderSource));
+	sShaders.erase(getShaderKey(current, fullFragmentShaderName, current->fragmentShaderSource));
 
 	// Delete source cache...
-	myShaderCache.erase(program->vertexShaderName);
-	myShaderCache.erase(program->fragmentShaderName);
+	ShaderSourceCache::invalidate(program->vertexShaderName);
+	ShaderSourceCache::invalidate(program->fragmentShaderName);
+
+	if(program != current &&
+		(program->vertexShaderName != current->vertexShaderName ||
+		program->fragmentShaderName != current->fragmentShaderName ||
+		program->geometryShaderName != current->geometryShaderName ||
+		program->vertexShaderSource != current->vertexShaderSource ||
+		program->fragmentShaderSource != current->fragmentShaderSource ||
+		program->geometryShaderSource != current->geometryShaderSource))
+	{
+		// The program definition changed: do not touch the (possibly shared) 
+		// current program, switch to a program for the new definition.
+		addProgram(program);
+	}
+	else
+	{
+		// Same definition, shaders changed on disk: recompile in place, so 
+		// all managers sharing this program see the new shaders.
+		recompileShaders(current, myShaderVariationName);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ProgramAsset* ShaderManager::bindSharedProgram(ProgramAsset* program)
+{
+	String key = getProgramKey(program, myShaderVariationName);
+	if(program->registryKey == key) return program;
+
+	// Keep a reference to the program, since replacing it in the program
+	// dictionary may release it.
+	Ref<ProgramAsset> oldProgram = program;
+
+	ProgramAsset* asset = NULL;
+	if(sPrograms.find(key) != sPrograms.end())
+	{
+		SharedProgram& sp = sPrograms[key];
+		sp.users++;
+		asset = sp.asset;
+	}
+	else
+	{
+		asset = new ProgramAsset();
+		asset->copyDefinition(program);
+		asset->program = new osg::Program();
+		asset->program->setName(asset->name);
+		asset->registryKey = key;
+
+		SharedProgram sp;
+		sp.asset = asset;
+		sp.users = 1;
+		sPrograms[key] = sp;
+
+		oflog(Verbose, "[ShaderManager] creating shared program %1%", %key);
+		recompileShaders(asset, myShaderVariationName);
+	}
+
+	releaseSharedProgram(oldProgram);
+	myPrograms[asset->name] = asset;
+	myProgramsVersion++;
+	return asset;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShaderManager::releaseSharedProgram(ProgramAsset* program)
+{
+	if(program->registryKey == "") return;
+	if(sPrograms.find(program->registryKey) != sPrograms.end())
+	{
+		SharedProgram& sp = sPrograms[program->registryKey];
+		if(sp.asset == program && --sp.users == 0)
+		{
+			sPrograms.erase(program->registryKey);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+String ShaderManager::getProgramKey(ProgramAsset* program, const String& variationName)
+{
+	size_t signature = getMacroSignature();
+	if(program->embedded)
+	{
+		signature ^= hashString(program->vertexShaderSource + 
+			program->fragmentShaderSource + 
+			program->geometryShaderSource);
+	}
+	return ostr("%1%%2%#%3$x", %program->name %variationName %signature);
+}
 
-	recompileShaders(program, myShaderVariationName);
+///////////////////////////////////////////////////////////////////////////////
+String ShaderManager::getShaderKey(ProgramAsset* program, const String& fullShaderName, const String& source)
+{
+	size_t signature = getMacroSignature();
+	if(program->embedded) signature ^= hashString(source);
+	return ostr("%1%#%2$x", %fullShaderName %signature);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t ShaderManager::getMacroSignature()
+{
+	if(myMacroSignatureDirty)
+	{
+		// Sum item hashes so the signature does not depend on the macro 
+		// dictionary ordering. Light and shadow sections are defined by the
+		// shaders themselves and do not contribute to the signature.
+		myMacroSignature = 0;
+		foreach(ShaderMacroDictionary::Item macro, myShaderMacros)
+		{
+			if(!isLocalMacro(macro.getKey()))
+			{
+				myMacroSignature += hashString(macro.getKey() + "=" + macro.getValue());
+			}
+		}
+		myMacroSignatureDirty = false;
+	}
+	return myMacroSignature;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -432,7 +736,8 @@ void ShaderManager::recompileShaders(ProgramAsset* program, const String& svaria
 	//osgProg->releaseGLObjects();
 
 	String fullVertexShaderName = program->vertexShaderName + var;
-	osg::Shader* vertexShader = myShaders[fullVertexShaderName];
+	String vertexShaderKey = getShaderKey(program, fullVertexShaderName, program->vertexShaderSource);
+	osg::Shader* vertexShader = sShaders[vertexShaderKey];
 	// If the shader does not exist in the shader registry, we need to create it now.
 	if(vertexShader == NULL)
 	{
@@ -451,13 +756,14 @@ void ShaderManager::recompileShaders(ProgramAsset* program, const String& svaria
 		{
 			loadShader(vertexShader, program->vertexShaderName);
 		}
-		myShaders[fullVertexShaderName] = vertexShader;
+		sShaders[vertexShaderKey] = vertexShader;
 	}
 	program->vertexShaderBinary = vertexShader;
 	osgProg->addShader(vertexShader);
 
 	String fullFragmentShaderName = program->fragmentShaderName + var;
-	osg::Shader* fragmentShader = myShaders[fullFragmentShaderName];
+	String fragmentShaderKey = getShaderKey(program, fullFragmentShaderName, program->fragmentShaderSource);
+	osg::Shader* fragmentShader = sShaders[fragmentShaderKey];
 	// If the shader does not exist in the shader registry, we need to create it now.
 	if(fragmentShader == NULL)
 	{
@@ -475,7 +781,7 @@ void ShaderManager::recompileShaders(ProgramAsset* program, const String& svaria
 		{
 			loadShader(fragmentShader, program->fragmentShaderName);
 		}
-		myShaders[fullFragmentShaderName] = fragmentShader;
+		sShaders[fragmentShaderKey] = fragmentShader;
 	}
 	program->fragmentShaderBinary = fragmentShader;
 	osgProg->addShader(fragmentShader);
@@ -484,7 +790,8 @@ void ShaderManager::recompileShaders(ProgramAsset* program, const String& svaria
 	if(program->geometryShaderName != "")
 	{
 		String fullGeometryShaderName = program->geometryShaderName + var;
-		osg::Shader* geometryShader = myShaders[fullGeometryShaderName];
+		String geometryShaderKey = getShaderKey(program, fullGeometryShaderName, program->geometryShaderSource);
+		osg::Shader* geometryShader = sShaders[geometryShaderKey];
 		// If the shader does not exist in the shader registry, we need to create it now.
 		if(geometryShader == NULL)
 		{
@@ -502,7 +809,7 @@ void ShaderManager::recompileShaders(ProgramAsset* program, const String& svaria
 			{
 				loadShader(geometryShader, program->geometryShaderName);
 			}
-			myShaders[fullGeometryShaderName] = geometryShader;
+			sShaders[geometryShaderKey] = geometryShader;
 		}
 		program->geometryShaderBinary = geometryShader;
 		osgProg->addShader(geometryShader);
@@ -540,7 +847,7 @@ void ShaderManager::recompileShaders()
 		if(l->isEnabled())
 		{
 			lightFunc.append(l->getLightFunction());
-			if(l->getShadow() != NULL)
+			if(getBoundShadow(l) != NULL)
 			{
 				// Here we could append a different string for different shadow
 				// functions so we can cache different shader sets.
@@ -548,28 +855,36 @@ void ShaderManager::recompileShaders()
                 // since setting a single different character on the string does not 
                 // generate a different hash value on Visual Studio 2010
                 // ('cause their hash func implementation is silly).
-				lightFunc.append(ostr("shadow%1%%2%", 
-					%l->getShadow()->getTextureUnit() 
-                    %(l->getShadow()->isSoft() ? "SOFT" : "HARD")));
+				if(l->getShadow()->getAtlasSlot() >= 0)
+				{
+					lightFunc.append(ostr("shadowATLAS%1%", %l->getShadow()->getAtlasSlot()));
+				}
+				else
+				{
+					lightFunc.append(ostr("shadow%1%%2%CSM%3%%4%", 
+						%l->getShadow()->getTextureUnit() 
+						%(l->getShadow()->isFilterable() ? "EVSM" : 
+							(l->getShadow()->isSoft() ? "SOFT" : "HARD"))
+						%l->getShadow()->getCascades()
+						%(l->getShadow()->isOmnidirectional() ? "CUBE" : "FLAT")));
+				}
 			}
 		}
 	}
-#ifdef OMEGA_OS_WIN
-	std::hash<String> hashFx;
-#else
-	std::tr1::hash<String> hashFx;
-#endif
-	size_t lightFuncHash = hashFx(lightFunc);
+	size_t lightFuncHash = hashString(lightFunc);
 
 	// Update the shader variation name
 	myShaderVariationName = ostr(".%1%%2%-%3$x", %myActiveCacheId %myNumActiveLights %lightFuncHash);
 
 	//ofmsg("Recompiling shaders (variation: %1%)", %myShaderVariationName);
 
+	// Switch all programs to the shared programs for the new variation. 
+	// Iterate on a copy, since binding replaces dictionary entries.
 	typedef Dictionary<String, Ref<ProgramAsset> >::Item ProgramAssetItem;
-	foreach(ProgramAssetItem item, myPrograms)
+	Dictionary<String, Ref<ProgramAsset> > programs = myPrograms;
+	foreach(ProgramAssetItem item, programs)
 	{
-		recompileShaders(item.getValue(), myShaderVariationName);
+		bindSharedProgram(item.getValue());
 	}
 
 	//time->stopTiming();
@@ -578,7 +893,23 @@ void ShaderManager::recompileShaders()
 ///////////////////////////////////////////////////////////////////////////////
 void ShaderManager::reloadAndRecompileShaders()
 {
-	myShaderCache.clear();
-	myShaders.clear();
+	// Reload changed shader files and re-apply macros defined by files.
+	ShaderSourceCache::refresh();
+	Dictionary<String, String> macroFiles = myShaderMacroFiles;
+	typedef Dictionary<String, String>::Item MacroFileItem;
+	foreach(MacroFileItem item, macroFiles)
+	{
+		setShaderMacroToFile(item.getKey(), item.getValue());
+	}
+
+	sShaders.clear();
 	recompileShaders();
+
+	// Recompile the current programs in place: managers sharing them will
+	// see the reloaded shaders too.
+	typedef Dictionary<String, Ref<ProgramAsset> >::Item ProgramAssetItem;
+	foreach(ProgramAssetItem item, myPrograms)
+	{
+		recompileShaders(item.getValue(), myShaderVariationName);
+	}
 }
@@ -0,0 +1,174 @@
+/******************************************************************************
+ * THE OMEGA LIB PROJECT
+ *-----------------------------------------------------------------------------
+ * Copyright 2010-2015		Electronic Visualization Laboratory, 
+ *							University of Illinois at Chicago
+ * Authors:										
+ *  Alessandro Febretti		febret@gmail.com
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2010-2015, Electronic Visualization Laboratory,  
+ * University of Illinois at Chicago
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification, 
+ * are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this 
+ * list of conditions and the following disclaimer. Redistributions in binary 
+ * form must reproduce the above copyright notice, this list of conditions and 
+ * the following disclaimer in the documentation and/or other materials provided 
+ * with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE  GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, 
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-----------------------------------------------------------------------------
+ * What's in this file
+ *	A process-wide cache of shader source files, shared by all shader managers
+ *	and compositors.
+ ******************************************************************************/
+#include "cyclops/ShaderSourceCache.h"
+
+// We need to include this instead of fstream or we get duplicate symbols on
+// linking.
+#include <osgDB/ReadFile>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using namespace cyclops;
+
+Dictionary<String, ShaderSourceCache::Entry> ShaderSourceCache::sEntries;
+Lock ShaderSourceCache::sLock;
+
+///////////////////////////////////////////////////////////////////////////////
+static void getFileInfo(const String& path, time_t& stamp, long& size)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0)
+    {
+        stamp = st.st_mtime;
+        size = (long)st.st_size;
+    }
+    else
+    {
+        stamp = 0;
+        size = -1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShaderSourceCache::getSource(const String& name, String& outSource)
+{
+    return getEntrySource(name, "", outSource);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShaderSourceCache::getFileSource(const String& path, String& outSource)
+{
+    return getEntrySource(path, path, outSource);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShaderSourceCache::getEntrySource(const String& name, const String& path, String& outSource)
+{
+    sLock.lock();
+    if(sEntries.find(name) != sEntries.end())
+    {
+        outSource = sEntries[name].source;
+        sLock.unlock();
+        return true;
+    }
+    sLock.unlock();
+
+    // Not cached: read the file outside of the lock. If two threads load the
+    // same file at the same time, they will both store the same content.
+    Entry entry;
+    entry.path = path;
+    if(entry.path == "" && !DataManager::findFile(name, entry.path)) return false;
+    if(!loadEntry(entry.path, entry)) return false;
+
+    oflog(Verbose, "[ShaderSourceCache] loaded %1%", %entry.path);
+
+    sLock.lock();
+    sEntries[name] = entry;
+    sLock.unlock();
+
+    outSource = entry.source;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShaderSourceCache::loadEntry(const String& path, Entry& entry)
+{
+    std::ifstream t(path.c_str());
+    if(!t.is_open()) return false;
+
+    // Get the file info before reading, so a write during the read shows up
+    // as a change on the next refresh.
+    getFileInfo(path, entry.stamp, entry.size);
+    entry.loadTime = time(NULL);
+
+    std::stringstream buffer;
+    buffer << t.rdbuf();
+    entry.source = buffer.str();
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int ShaderSourceCache::refresh()
+{
+    int reloaded = 0;
+    sLock.lock();
+    typedef Dictionary<String, Entry>::Item EntryItem;
+    foreach(EntryItem item, sEntries)
+    {
+        Entry& entry = sEntries[item.getKey()];
+        time_t stamp;
+        long size;
+        getFileInfo(entry.path, stamp, size);
+        if(stamp != entry.stamp || size != entry.size)
+        {
+            if(loadEntry(entry.path, entry))
+            {
+                oflog(Verbose, "[ShaderSourceCache] reloaded %1%", %entry.path);
+                reloaded++;
+            }
+        }
+        else if(entry.stamp >= entry.loadTime)
+        {
+            // The file was modified in the second it was read: a later edit
+            // in the same second would not change its stamp. Compare content.
+            String source = entry.source;
+            if(loadEntry(entry.path, entry) && entry.source != source)
+            {
+                oflog(Verbose, "[ShaderSourceCache] reloaded %1%", %entry.path);
+                reloaded++;
+            }
+        }
+    }
+    sLock.unlock();
+    return reloaded;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShaderSourceCache::invalidate(const String& name)
+{
+    sLock.lock();
+    sEntries.erase(name);
+    sLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShaderSourceCache::clear()
+{
+    sLock.lock();
+    sEntries.clear();
+    sLock.unlock();
+}
@@ -36,6 +36,8 @@
 #include "cyclops/LightingLayer.h"
 #include "cyclops/ShadowMap.h"
 
+#include <algorithm>
+
 using namespace cyclops;
 
 
@@ -44,7 +46,15 @@ ShadowMap::ShadowMap():
 	myLayer(NULL),
 	myLight(NULL),
 	myInitialized(false),
-	myShadowTextureUnit(-1)
+	myShadowTextureUnit(-1),
+	myRequestedCascades(1),
+	myRequestedOmnidirectional(false),
+	myTextureSize(512),
+	myAtlas(NULL),
+	myAtlasSlot(-1),
+	myScheduled(false),
+	myRefreshRequested(true),
+	myFramesSinceRefresh(0)
 {
 	myShadowedScene = new osgShadow::ShadowedScene();
 	myShadowedScene->setReceivesShadowTraversalMask(ShadowMap::ReceivesShadowTraversalMask);
@@ -66,6 +76,46 @@ void ShadowMap::setLight(Light* l)
 { 
 	checkInitialized(); 
 	myLight = l; 
+	updateTechnique();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::setCascades(int cascades)
+{
+	myRequestedCascades = cascades;
+	updateTechnique();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::setOmnidirectional(bool value)
+{
+	myRequestedOmnidirectional = value;
+	updateTechnique();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::updateTechnique()
+{
+	bool omnidirectional = myLight != NULL && 
+		myLight->getLightType() == Light::Point && myRequestedOmnidirectional;
+	if(omnidirectional != myShadowMap->isOmnidirectional())
+	{
+		myShadowMap->setOmnidirectional(omnidirectional);
+		// Omnidirectional shadows use different shader code.
+		if(myLight != NULL) myLight->requestShaderUpdate();
+	}
+
+	int cascades = 1;
+	if(myLight != NULL && myLight->getLightType() == Light::Directional)
+	{
+		cascades = myRequestedCascades;
+	}
+	if(cascades != myShadowMap->getCascades())
+	{
+		myShadowMap->setCascades(cascades);
+		// Cascaded shadows use different shader code.
+		if(myLight != NULL) myLight->requestShaderUpdate();
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -125,9 +175,52 @@ int ShadowMap::getTextureUnit()
 void ShadowMap::setTextureSize(int width, int height)
 {
 	checkInitialized(); 
+	myTextureSize = width > height ? width : height;
 	myShadowMap->setTextureSize(osg::Vec2s(width, height));
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::setDirty()
+{
+	checkInitialized();
+	// Scheduled shadow maps get refreshed when the layer scheduler picks 
+	// them. Refresh requests get the highest priority.
+	if(myScheduled) myRefreshRequested = true;
+	else myShadowMap->setDirty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::refresh()
+{
+	checkInitialized();
+	myRefreshRequested = false;
+	myFramesSinceRefresh = 0;
+	myShadowMap->setDirty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::setAtlas(ShadowAtlas* atlas, int slot, const osg::Vec4i& rect)
+{
+	checkInitialized();
+	bool changed = (atlas != myAtlas || slot != myAtlasSlot);
+	myAtlas = atlas;
+	myAtlasSlot = slot;
+	if(atlas != NULL)
+	{
+		myShadowMap->setAtlas(atlas->getTexture(), atlas->getMatricesUniform(), 
+			ShaderManager::ShadowAtlasPositionUnit, slot, rect);
+	}
+	else
+	{
+		myShadowMap->setAtlas(NULL, NULL, -1, -1, rect);
+		// Force the shader manager to assign a texture unit again. Until it
+		// does, shaders treat the light as unshadowed.
+		myShadowTextureUnit = -1;
+	}
+	// Atlas shadows use different shader code.
+	if(changed && myLight != NULL) myLight->requestShaderUpdate();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void ShadowMap::initialize()
 {
@@ -147,6 +240,176 @@ void ShadowMap::setSoft(bool value)
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+ShadowAtlas::ShadowAtlas(LightingLayer* layer, int size, int slots):
+	myLayer(layer),
+	mySize(size),
+	mySlots(slots)
+{
+	myTexture = new osg::Texture2D;
+	myTexture->setTextureSize(size, size);
+	myTexture->setInternalFormat(GL_DEPTH_COMPONENT);
+	myTexture->setShadowComparison(true);
+	myTexture->setShadowTextureMode(osg::Texture2D::LUMINANCE);
+	myTexture->setFilter(osg::Texture2D::MIN_FILTER,osg::Texture2D::LINEAR);
+	myTexture->setFilter(osg::Texture2D::MAG_FILTER,osg::Texture2D::LINEAR);
+	myTexture->setWrap(osg::Texture2D::WRAP_S,osg::Texture2D::CLAMP_TO_BORDER);
+	myTexture->setWrap(osg::Texture2D::WRAP_T,osg::Texture2D::CLAMP_TO_BORDER);
+	myTexture->setBorderColor(osg::Vec4(1.0f,1.0f,1.0f,1.0f));
+
+	myMatrices = new osg::Uniform(osg::Uniform::FLOAT_MAT4, "shadowAtlasMatrices", slots);
+	myRects = new osg::Uniform(osg::Uniform::FLOAT_VEC4, "shadowAtlasRects", slots);
+	for(int i = 0; i < slots; i++) resetSlot(i);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ShadowAtlas::~ShadowAtlas()
+{
+	clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowAtlas::resetSlot(int slot)
+{
+	// A matrix mapping every position to depth 0: lookups through unused 
+	// slots always pass the shadow comparison, so lights without shadows
+	// are fully lit.
+	osg::Matrixf m(
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 1);
+	myMatrices->setElement(slot, m);
+	myRects->setElement(slot, osg::Vec4f(0, 0, 0, 0));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowAtlas::clear()
+{
+	foreach(ShadowMap* sm, myShadows)
+	{
+		if(sm->getAtlas() == this) sm->setAtlas(NULL, -1, osg::Vec4i());
+	}
+	myShadows.clear();
+	myShadowSlots.clear();
+	myShadowSizes.clear();
+	for(int i = 0; i < mySlots; i++) resetSlot(i);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShadowAtlas::pack(const List<ShadowMap*>& shadows, const List<int>& slots)
+{
+	// Check whether anything changed since the last packing.
+	List<int> sizes;
+	foreach(ShadowMap* sm, shadows) sizes.push_back(sm->myTextureSize);
+
+	if(shadows.size() == myShadows.size() && 
+		slots == myShadowSlots && sizes == myShadowSizes)
+	{
+		bool same = true;
+		List< Ref<ShadowMap> >::iterator it = myShadows.begin();
+		foreach(ShadowMap* sm, shadows)
+		{
+			if(sm != it->get()) { same = false; break; }
+			++it;
+		}
+		if(same) return false;
+	}
+
+	// Remove shadow maps that are not in the atlas anymore.
+	foreach(ShadowMap* sm, myShadows)
+	{
+		if(std::find(shadows.begin(), shadows.end(), sm) == shadows.end() &&
+			sm->getAtlas() == this)
+		{
+			sm->setAtlas(NULL, -1, osg::Vec4i());
+		}
+	}
+	for(int i = 0; i < mySlots; i++) resetSlot(i);
+
+	// Shelf packing of square rectangles, largest first. Rectangles are 
+	// rounded to powers of two and all scaled down by two until they fit,
+	// so lights keep their relative shadow resolution.
+	Vector<ShadowMap*> sorted(shadows.begin(), shadows.end());
+	Vector<int> sortedSlots(slots.begin(), slots.end());
+	Vector<int> sortedSizes;
+	foreach(int size, sizes)
+	{
+		int s = MinRectSize;
+		while(s < size && s < mySize) s *= 2;
+		sortedSizes.push_back(s);
+	}
+	// Insertion sort (we have at most a handful of shadow maps)
+	for(unsigned int i = 1; i < sorted.size(); i++)
+	{
+		for(unsigned int j = i; j > 0 && sortedSizes[j] > sortedSizes[j - 1]; j--)
+		{
+			std::swap(sorted[j], sorted[j - 1]);
+			std::swap(sortedSlots[j], sortedSlots[j - 1]);
+			std::swap(sortedSizes[j], sortedSizes[j - 1]);
+		}
+	}
+
+	Vector<osg::Vec4i> rects(sorted.size());
+	for(int scale = 1; ; scale *= 2)
+	{
+		int x = 0;
+		int y = 0;
+		int shelfHeight = 0;
+		bool fits = true;
+		for(unsigned int i = 0; i < sorted.size(); i++)
+		{
+			int s = std::max(sortedSizes[i] / scale, (int)MinRectSize);
+			if(x + s > mySize)
+			{
+				x = 0;
+				y += shelfHeight;
+				shelfHeight = 0;
+			}
+			if(y + s > mySize)
+			{
+				fits = false;
+				break;
+			}
+			rects[i] = osg::Vec4i(x, y, s, s);
+			x += s;
+			shelfHeight = std::max(shelfHeight, s);
+		}
+		if(fits) break;
+		if(sortedSizes.front() / scale <= MinRectSize)
+		{
+			ofwarn("ShadowAtlas::pack: %1% shadow maps do not fit in a %2%x%2% atlas", 
+				%sorted.size() %mySize);
+			foreach(ShadowMap* sm, sorted) sm->setAtlas(NULL, -1, osg::Vec4i());
+			rects.clear();
+			break;
+		}
+	}
+
+	for(unsigned int i = 0; i < rects.size(); i++)
+	{
+		const osg::Vec4i& r = rects[i];
+		myRects->setElement(sortedSlots[i], osg::Vec4f(r[0], r[1], r[2], r[3]) / (float)mySize);
+		sorted[i]->setAtlas(this, sortedSlots[i], r);
+	}
+
+	myShadows.clear();
+	foreach(ShadowMap* sm, shadows) myShadows.push_back(sm);
+	myShadowSlots = slots;
+	myShadowSizes = sizes;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMap::setFilterable(bool value)
+{ 
+    if(myShadowMap->isFilterable() != value)
+    {
+        myShadowMap->setFilterable(value); 
+        if(myLight != NULL) myLight->requestShaderUpdate();
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //void SoftShadowMap::initialize()
 //{
@@ -39,9 +39,13 @@
 #include <osg/ComputeBoundsVisitor>
 #include <osg/PolygonOffset>
 #include <osg/CullFace>
+#include <osg/Depth>
 #include <osg/io_utils>
+#include <osg/Polytope>
 
 #include <iostream>
+#include <cfloat>
+#include <map>
 //for debug
 #include <osg/LightSource>
 #include <osg/PolygonMode>
@@ -56,7 +60,172 @@
 
 using namespace cyclops;
 
+// Two-channel float formats, used by filterable shadow maps.
+#ifndef GL_RG
+#define GL_RG 0x8227
+#endif
+#ifndef GL_RG32F
+#define GL_RG32F 0x8230
+#endif
+
 Ref<osg::Texture3D> ShadowMapGenerator::myJitterTexture;
+unsigned int ShadowMapGenerator::sStaticCastersVersion = 0;
+
+// Caster bounds cache, used by ShadowMapGenerator::getCasterBounds. 
+struct CasterBoundsCacheEntry
+{
+    unsigned int frameNumber;
+    osg::BoundingBox bounds;
+};
+typedef std::map<const osg::Node*, CasterBoundsCacheEntry> CasterBoundsCache;
+static CasterBoundsCache sCasterBoundsCache;
+static unsigned int sCasterBoundsCacheFrame = 0;
+static Lock sCasterBoundsCacheLock;
+
+// Shadow pass counters. Passes are counted during the current frame, and 
+// the counts are published when the next frame starts.
+static unsigned int sPassCounterFrame = 0;
+static unsigned int sRenderedPasses = 0;
+static unsigned int sSkippedPasses = 0;
+static unsigned int sLastRenderedPasses = 0;
+static unsigned int sLastSkippedPasses = 0;
+static Lock sPassCounterLock;
+
+// Vertex shader for full screen quads, with vertices in clip space.
+static const char* sFullScreenQuadVertexShader =
+    "void main()\n"
+    "{\n"
+    "    gl_Position = vec4(gl_Vertex.xy, 0.0, 1.0);\n"
+    "    gl_TexCoord[0] = vec4(gl_Vertex.xy * 0.5 + 0.5, 0.0, 1.0);\n"
+    "}\n";
+
+// Shader used to copy the cached static caster depth to the shadow map.
+static const char* sDepthCopyFragmentShader =
+    "uniform sampler2D staticDepth;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragDepth = texture2D(staticDepth, gl_TexCoord[0].xy).r;\n"
+    "}\n";
+
+// Shaders writing the moments of the warped depth for filterable shadow maps.
+static const char* sMomentsVertexShader =
+    "void main()\n"
+    "{\n"
+    "    gl_Position = ftransform();\n"
+    "}\n";
+static const char* sMomentsFragmentShader =
+    "uniform float momentsExponent;\n"
+    "void main()\n"
+    "{\n"
+    "    float d = gl_FragCoord.z;\n"
+    "    float w = momentsExponent > 0.0 ? exp(momentsExponent * d) : d;\n"
+    "    gl_FragColor = vec4(w, w * w, 0.0, 1.0);\n"
+    "}\n";
+
+// Name of the cameras writing moments, used by isMomentsCamera
+static const char* sMomentsCameraName = "ShadowMapGenerator.moments";
+
+// Separable 9-tap gaussian blur, using linear filtering to read two texels 
+// per tap.
+static const char* sBlurFragmentShader =
+    "uniform sampler2D source;\n"
+    "uniform vec2 blurStep;\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 uv = gl_TexCoord[0].xy;\n"
+    "    vec2 o1 = blurStep * 1.3846153846;\n"
+    "    vec2 o2 = blurStep * 3.2307692308;\n"
+    "    gl_FragColor = texture2D(source, uv) * 0.2270270270 +\n"
+    "        (texture2D(source, uv + o1) + texture2D(source, uv - o1)) * 0.3162162162 +\n"
+    "        (texture2D(source, uv + o2) + texture2D(source, uv - o2)) * 0.0702702703;\n"
+    "}\n";
+
+///////////////////////////////////////////////////////////////////////////////
+// Cull callback for the shadow camera when static caching is enabled: draws 
+// the depth copy quad before traversing the (dynamic) shadow casters.
+class DynamicCasterCullCallback: public osg::NodeCallback
+{
+public:
+    DynamicCasterCullCallback(osgShadow::ShadowTechnique* st, osg::Node* depthCopy):
+        myShadowTechnique(st), myDepthCopy(depthCopy) {}
+
+    virtual void operator()(osg::Node*, osg::NodeVisitor* nv)
+    {
+        myDepthCopy->accept(*nv);
+        if(myShadowTechnique->getShadowedScene())
+        {
+            myShadowTechnique->getShadowedScene()->osg::Group::traverse(*nv);
+        }
+    }
+
+private:
+    osgShadow::ShadowTechnique* myShadowTechnique;
+    osg::ref_ptr<osg::Node> myDepthCopy;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Compares two matrices with a tolerance. Light matrices are recomputed from
+// eye space every frame, so they are subject to small numerical variations.
+static bool matricesEquivalent(const osg::Matrix& a, const osg::Matrix& b)
+{
+    for(int i = 0; i < 16; i++)
+    {
+        double x = a.ptr()[i];
+        double y = b.ptr()[i];
+        if(fabs(x - y) > 1e-4 * (1.0 + fabs(x))) return false;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void countShadowPass(const osg::FrameStamp* fs, bool rendered)
+{
+    if(fs == NULL) return;
+    sPassCounterLock.lock();
+    if(fs->getFrameNumber() != sPassCounterFrame)
+    {
+        sLastRenderedPasses = sRenderedPasses;
+        sLastSkippedPasses = sSkippedPasses;
+        sRenderedPasses = 0;
+        sSkippedPasses = 0;
+        sPassCounterFrame = fs->getFrameNumber();
+    }
+    if(rendered) sRenderedPasses++;
+    else sSkippedPasses++;
+    sPassCounterLock.unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static bool sphereIntersectsBox(const osg::BoundingSphere& bs, const osg::BoundingBox& bb)
+{
+    // Squared distance from the sphere center to the closest box point.
+    float d2 = 0;
+    for(int i = 0; i < 3; i++)
+    {
+        float c = bs.center()[i];
+        if(c < bb._min[i]) d2 += (bb._min[i] - c) * (bb._min[i] - c);
+        else if(c > bb._max[i]) d2 += (c - bb._max[i]) * (c - bb._max[i]);
+    }
+    return d2 <= bs.radius2();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+unsigned int ShadowMapGenerator::getRenderedPassCount()
+{
+    return sLastRenderedPasses;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+unsigned int ShadowMapGenerator::getSkippedPassCount()
+{
+    return sLastSkippedPasses;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShadowMapGenerator::isMomentsCamera(const osg::Camera* camera)
+{
+    return camera != NULL && camera->getName() == sMomentsCameraName;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 ShadowMapGenerator::ShadowMapGenerator():
@@ -66,8 +235,25 @@ ShadowMapGenerator::ShadowMapGenerator():
     myManualRefreshEnabled(false),
     myDirty(true),
     mySoft(false),
+    myInfluenceRadius(FLT_MAX),
     myJitteringScale(1.0f),
-    mySoftnessWidth(0.002f)
+    mySoftnessWidth(0.002f),
+    myCascades(1),
+    mySplitLambda(0.75f),
+    myCascadeMaxDistance(0),
+    myCascadesFit(false),
+    myCascadeFitFrame(0),
+    myOmnidirectional(false),
+    myCubeFit(false),
+    myCubeFitFrame(0),
+    myAtlasTextureUnit(-1),
+    myAtlasSlot(-1),
+    myFilterable(false),
+    myBlurRadius(1.0f),
+    myShadowExponent(30.0f),
+    myStaticCachingEnabled(false),
+    myStaticDirty(true),
+    myStaticCastersVersion(0)
 {
     _stateset = new osg::StateSet;
     _texture = new osg::Texture2D;
@@ -118,7 +304,54 @@ void ShadowMapGenerator::setTextureUnit(unsigned int unit)
         (float)mySoftnessWidth);
     _stateset->addUniform(mySoftnessWidthUniform);
 
-    _stateset->setTextureAttributeAndModes(_shadowTextureUnit,_texture.get(),osg::StateAttribute::ON); // | osg::StateAttribute::OVERRIDE);
+    if(myShadowExponentUniform != NULL)
+    {
+        _stateset->removeUniform(myShadowExponentUniform);
+    }
+    myShadowExponentUniform = new osg::Uniform(
+        ostr("shadowExponent%1%", %_shadowTextureUnit).c_str(),
+        (float)myShadowExponent);
+    _stateset->addUniform(myShadowExponentUniform);
+
+    if(myCascadeMatricesUniform != NULL)
+    {
+        _stateset->removeUniform(myCascadeMatricesUniform);
+        myCascadeMatricesUniform = NULL;
+    }
+    if(myCubeMatricesUniform != NULL)
+    {
+        _stateset->removeUniform(myCubeMatricesUniform);
+        myCubeMatricesUniform = NULL;
+    }
+
+    if(myCascadeTexture != NULL)
+    {
+        // Cascaded shadow maps: bind the texture array and the per-cascade
+        // matrices used by the shader to pick a cascade.
+        myCascadeMatricesUniform = new osg::Uniform(osg::Uniform::FLOAT_MAT4,
+            ostr("shadowCascadeMatrices%1%", %_shadowTextureUnit), MaxCascades);
+        _stateset->addUniform(myCascadeMatricesUniform);
+        myCascadesFit = false;
+        _stateset->setTextureAttributeAndModes(_shadowTextureUnit,myCascadeTexture.get(),osg::StateAttribute::ON);
+    }
+    else if(myCubeTexture != NULL)
+    {
+        // Cube shadow maps: bind the face grid texture and the per-face 
+        // matrices. The shader picks a face from the texture coordinates,
+        // which are positions relative to the light.
+        myCubeMatricesUniform = new osg::Uniform(osg::Uniform::FLOAT_MAT4,
+            ostr("shadowCubeMatrices%1%", %_shadowTextureUnit), 6);
+        // Until faces are fit, map everything outside the face cells.
+        osg::Matrixf emptyFace = osg::Matrixf::scale(0, 0, 0) * osg::Matrixf::translate(-1, -1, 0);
+        for(int f = 0; f < 6; f++) myCubeMatricesUniform->setElement(f, emptyFace);
+        _stateset->addUniform(myCubeMatricesUniform);
+        myCubeFit = false;
+        _stateset->setTextureAttributeAndModes(_shadowTextureUnit,myCubeTexture.get(),osg::StateAttribute::ON);
+    }
+    else
+    {
+        _stateset->setTextureAttributeAndModes(_shadowTextureUnit,_texture.get(),osg::StateAttribute::ON); // | osg::StateAttribute::OVERRIDE);
+    }
     _stateset->setTextureMode(_shadowTextureUnit,GL_TEXTURE_GEN_S,osg::StateAttribute::ON);
     _stateset->setTextureMode(_shadowTextureUnit,GL_TEXTURE_GEN_T,osg::StateAttribute::ON);
     _stateset->setTextureMode(_shadowTextureUnit,GL_TEXTURE_GEN_R,osg::StateAttribute::ON);
@@ -147,6 +380,140 @@ void ShadowMapGenerator::setSoftShadowParameters(float softnessWidth, float jitt
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setOmnidirectional(bool value)
+{
+    if(myOmnidirectional != value)
+    {
+        myOmnidirectional = value;
+        dirty();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setFilterable(bool value)
+{
+    if(myFilterable != value)
+    {
+        myFilterable = value;
+        dirty();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setFilterableShadowParameters(float blurRadius, float exponent)
+{
+    myBlurRadius = blurRadius;
+    myShadowExponent = exponent;
+    if(myShadowExponentUniform != NULL) myShadowExponentUniform->set(myShadowExponent);
+    if(myMomentsExponentUniform != NULL) myMomentsExponentUniform->set(myShadowExponent);
+    if(myBlurCameras[0].valid())
+    {
+        float w = myBlurRadius / _textureSize.x();
+        float h = myBlurRadius / _textureSize.y();
+        myBlurStepUniforms[0]->set(osg::Vec2(w, 0));
+        myBlurStepUniforms[1]->set(osg::Vec2(0, h));
+        // The clear value is the warped far depth.
+        float far = myShadowExponent > 0 ? exp(myShadowExponent) : 1.0f;
+        _camera->setClearColor(osg::Vec4(far, far * far, 0, 1));
+    }
+    myDirty = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::initFilterable()
+{
+    // The final moments texture, mipmapped after each blur.
+    _texture->setInternalFormat(GL_RG32F);
+    _texture->setSourceFormat(GL_RG);
+    _texture->setSourceType(GL_FLOAT);
+    _texture->setShadowComparison(false);
+    _texture->setFilter(osg::Texture2D::MIN_FILTER,osg::Texture2D::LINEAR_MIPMAP_LINEAR);
+    _texture->setFilter(osg::Texture2D::MAG_FILTER,osg::Texture2D::LINEAR);
+    _texture->setWrap(osg::Texture2D::WRAP_S,osg::Texture2D::CLAMP_TO_EDGE);
+    _texture->setWrap(osg::Texture2D::WRAP_T,osg::Texture2D::CLAMP_TO_EDGE);
+
+    // Ping-pong textures: the shadow camera writes the moments to the first 
+    // one, the horizontal blur writes to the second one, and the vertical
+    // blur writes to the shadow texture.
+    for(int i = 0; i < 2; i++)
+    {
+        myBlurTextures[i] = new osg::Texture2D;
+        myBlurTextures[i]->setTextureSize(_textureSize.x(), _textureSize.y());
+        myBlurTextures[i]->setInternalFormat(GL_RG32F);
+        myBlurTextures[i]->setSourceFormat(GL_RG);
+        myBlurTextures[i]->setSourceType(GL_FLOAT);
+        myBlurTextures[i]->setFilter(osg::Texture2D::MIN_FILTER,osg::Texture2D::LINEAR);
+        myBlurTextures[i]->setFilter(osg::Texture2D::MAG_FILTER,osg::Texture2D::LINEAR);
+        myBlurTextures[i]->setWrap(osg::Texture2D::WRAP_S,osg::Texture2D::CLAMP_TO_EDGE);
+        myBlurTextures[i]->setWrap(osg::Texture2D::WRAP_T,osg::Texture2D::CLAMP_TO_EDGE);
+    }
+
+    // Render caster moments instead of depth. Material programs are 
+    // protected and would win over the moments program: EffectNode does not
+    // apply materials when culling for cameras named like this one (see 
+    // isMomentsCamera).
+    _camera->setName(sMomentsCameraName);
+    _camera->detach(osg::Camera::DEPTH_BUFFER);
+    _camera->attach(osg::Camera::DEPTH_BUFFER, GL_DEPTH_COMPONENT24);
+    _camera->attach(osg::Camera::COLOR_BUFFER, myBlurTextures[0].get());
+    _camera->setClearMask(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+
+    osg::StateSet* stateset = _camera->getOrCreateStateSet();
+    osg::Program* momentsProgram = new osg::Program;
+    momentsProgram->addShader(new osg::Shader(osg::Shader::VERTEX, sMomentsVertexShader));
+    momentsProgram->addShader(new osg::Shader(osg::Shader::FRAGMENT, sMomentsFragmentShader));
+    stateset->setAttributeAndModes(momentsProgram, 
+        osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE | osg::StateAttribute::PROTECTED);
+    myMomentsExponentUniform = new osg::Uniform("momentsExponent", myShadowExponent);
+    stateset->addUniform(myMomentsExponentUniform);
+
+    osg::Program* blurProgram = new osg::Program;
+    blurProgram->addShader(new osg::Shader(osg::Shader::VERTEX, sFullScreenQuadVertexShader));
+    blurProgram->addShader(new osg::Shader(osg::Shader::FRAGMENT, sBlurFragmentShader));
+
+    for(int i = 0; i < 2; i++)
+    {
+        osg::Camera* camera = new osg::Camera;
+        camera->setReferenceFrame(osg::Camera::ABSOLUTE_RF);
+        camera->setClearMask(0);
+        camera->setComputeNearFarMode(osg::Camera::DO_NOT_COMPUTE_NEAR_FAR);
+        camera->setViewport(0,0,_textureSize.x(),_textureSize.y());
+        // Render after the shadow camera.
+        camera->setRenderOrder(osg::Camera::PRE_RENDER, i + 1);
+        camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+        if(i == 0)
+        {
+            camera->attach(osg::Camera::COLOR_BUFFER, myBlurTextures[1].get());
+        }
+        else
+        {
+            // Generate mipmaps once the blurred moments are ready.
+            camera->attach(osg::Camera::COLOR_BUFFER, _texture.get(), 0, 0, true);
+        }
+
+        osg::Geode* quad = new osg::Geode;
+        quad->addDrawable(osg::createTexturedQuadGeometry(
+            osg::Vec3(-1.0f, -1.0f, 0.0f), osg::Vec3(2.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 2.0f, 0.0f)));
+        quad->setCullingActive(false);
+        camera->addChild(quad);
+
+        osg::StateSet* ss = camera->getOrCreateStateSet();
+        ss->setAttributeAndModes(blurProgram, osg::StateAttribute::ON);
+        ss->setTextureAttributeAndModes(0, myBlurTextures[i].get(), osg::StateAttribute::ON);
+        ss->addUniform(new osg::Uniform("source", 0));
+        myBlurStepUniforms[i] = new osg::Uniform("blurStep", osg::Vec2(0, 0));
+        ss->addUniform(myBlurStepUniforms[i]);
+        ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+        ss->setMode(GL_CULL_FACE, osg::StateAttribute::OFF);
+
+        myBlurCameras[i] = camera;
+    }
+
+    // Set blur steps and clear color.
+    setFilterableShadowParameters(myBlurRadius, myShadowExponent);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void ShadowMapGenerator::setPolygonOffset(const osg::Vec2& polyOffset)
 {
@@ -160,6 +527,56 @@ void ShadowMapGenerator::setTextureSize(const osg::Vec2s& textureSize)
     dirty();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setCascades(int cascades)
+{
+    if(cascades < 1) cascades = 1;
+    if(cascades > MaxCascades) cascades = MaxCascades;
+    if(myCascades != cascades)
+    {
+        myCascades = cascades;
+        dirty();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setAtlas(osg::Texture2D* texture, osg::Uniform* matrices, int textureUnit, int slot, const osg::Vec4i& rect)
+{
+    if(texture != myAtlasTexture.get())
+    {
+        // Stop binding our own shadow texture: the atlas texture is bound
+        // by the lighting layer.
+        if(texture != NULL && _texture.valid())
+        {
+            _stateset->removeTextureAttribute(_shadowTextureUnit, _texture.get());
+        }
+        myAtlasTexture = texture;
+        // Re-initialize to create (or destroy) the atlas camera.
+        dirty();
+    }
+    myAtlasMatrices = matrices;
+    myAtlasTextureUnit = textureUnit;
+    myAtlasSlot = slot;
+    myAtlasRect = rect;
+    if(myAtlasCamera.valid())
+    {
+        myAtlasCamera->setViewport(rect[0], rect[1], rect[2], rect[3]);
+    }
+    // The atlas rectangle may have changed: render again.
+    myDirty = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setStaticCachingEnabled(bool value)
+{
+    if(value != myStaticCachingEnabled)
+    {
+        myStaticCachingEnabled = value;
+        // Re-initialize to create (or destroy) the static caster camera.
+        dirty();
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void ShadowMapGenerator::setLight(osg::Light* light)
 {
@@ -246,14 +663,646 @@ void ShadowMapGenerator::init()
     _texgen = new osg::TexGen;
     _dirty = false;
 
-    // Force-reset the shadow texture unit, to register the new texture.
-    setTextureUnit(_shadowTextureUnit);
+    if(myCascades > 1)
+    {
+        initCascades();
+    }
+    else
+    {
+        myCascadeTexture = NULL;
+        myCascadeCameras.clear();
+    }
+
+    if(myOmnidirectional)
+    {
+        initCube();
+    }
+    else
+    {
+        myCubeTexture = NULL;
+        for(int i = 0; i < 6; i++) myCubeCameras[i] = NULL;
+    }
+
+    if(myFilterable)
+    {
+        initFilterable();
+    }
+    else
+    {
+        myBlurCameras[0] = NULL;
+        myBlurCameras[1] = NULL;
+        myMomentsExponentUniform = NULL;
+    }
+
+    // Static caching copies depth, which is not compatible with filterable 
+    // shadow maps.
+    if(myStaticCachingEnabled && !myFilterable)
+    {
+        initStaticCache();
+    }
+    else
+    {
+        myStaticTexture = NULL;
+        myStaticCamera = NULL;
+    }
+
+    if(myAtlasTexture.valid())
+    {
+        // Atlas mode: render to our rectangle of the atlas texture. The 
+        // atlas texture binding is managed by the lighting layer.
+        if(myCascades > 1 || myOmnidirectional || myFilterable)
+        {
+            ofwarn("ShadowMapGenerator: %1%%2%%3%shadows are not supported in a shadow atlas, using a regular shadow map", 
+                %(myCascades > 1 ? "cascaded " : "")
+                %(myOmnidirectional ? "omnidirectional " : "")
+                %(myFilterable ? "filterable " : ""));
+        }
+        myAtlasCamera = createShadowCamera();
+        myAtlasCamera->setViewport(myAtlasRect[0], myAtlasRect[1], myAtlasRect[2], myAtlasRect[3]);
+        myAtlasCamera->attach(osg::Camera::DEPTH_BUFFER, myAtlasTexture.get());
+
+        // Eye planes giving scene positions, positioned for each view.
+        myAtlasTexGen = new osg::TexGen;
+        myAtlasTexGen->setMode(osg::TexGen::EYE_LINEAR);
+        myAtlasTexGen->setPlanesFromMatrix(osg::Matrix::identity());
+    }
+    else
+    {
+        myAtlasCamera = NULL;
+        myAtlasTexGen = NULL;
+        // Force-reset the shadow texture unit, to register the new texture.
+        setTextureUnit(_shadowTextureUnit);
+    }
 
     // Setting the dirty flag to true makes sure we regenerate the shadow map
     // after initializing it.
     myDirty = true;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::initCascades()
+{
+    myCascadeTexture = new osg::Texture2DArray;
+    myCascadeTexture->setTextureSize(_textureSize.x(), _textureSize.y(), myCascades);
+    myCascadeTexture->setInternalFormat(GL_DEPTH_COMPONENT);
+    myCascadeTexture->setShadowComparison(true);
+    myCascadeTexture->setShadowTextureMode(osg::Texture::LUMINANCE);
+    myCascadeTexture->setFilter(osg::Texture::MIN_FILTER,osg::Texture::LINEAR);
+    myCascadeTexture->setFilter(osg::Texture::MAG_FILTER,osg::Texture::LINEAR);
+    myCascadeTexture->setWrap(osg::Texture::WRAP_S,osg::Texture::CLAMP_TO_BORDER);
+    myCascadeTexture->setWrap(osg::Texture::WRAP_T,osg::Texture::CLAMP_TO_BORDER);
+    myCascadeTexture->setBorderColor(osg::Vec4(1.0f,1.0f,1.0f,1.0f));
+
+    // One render to texture camera per cascade, each rendering to its own
+    // texture array layer.
+    myCascadeCameras.clear();
+    for(int i = 0; i < myCascades; i++)
+    {
+        osg::Camera* camera = createShadowCamera();
+        camera->attach(osg::Camera::DEPTH_BUFFER, myCascadeTexture.get(), 0, i);
+        myCascadeCameras.push_back(camera);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::initStaticCache()
+{
+    // Depth texture storing the static casters. Read as plain depth values
+    // by the depth copy shader.
+    myStaticTexture = new osg::Texture2D;
+    myStaticTexture->setTextureSize(_textureSize.x(), _textureSize.y());
+    myStaticTexture->setInternalFormat(GL_DEPTH_COMPONENT);
+    myStaticTexture->setFilter(osg::Texture2D::MIN_FILTER,osg::Texture2D::NEAREST);
+    myStaticTexture->setFilter(osg::Texture2D::MAG_FILTER,osg::Texture2D::NEAREST);
+    myStaticTexture->setWrap(osg::Texture2D::WRAP_S,osg::Texture2D::CLAMP_TO_EDGE);
+    myStaticTexture->setWrap(osg::Texture2D::WRAP_T,osg::Texture2D::CLAMP_TO_EDGE);
+
+    // The static camera renders before the shadow camera.
+    myStaticCamera = createShadowCamera();
+    myStaticCamera->setRenderOrder(osg::Camera::PRE_RENDER, -1);
+    myStaticCamera->attach(osg::Camera::DEPTH_BUFFER, myStaticTexture.get());
+
+    // Full screen quad copying the static depth to the shadow map. Vertices
+    // are in clip space and the shaders ignore transforms.
+    osg::Geometry* quad = osg::createTexturedQuadGeometry(
+        osg::Vec3(-1.0f, -1.0f, 0.0f), osg::Vec3(2.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 2.0f, 0.0f));
+    osg::Geode* depthCopy = new osg::Geode;
+    depthCopy->addDrawable(quad);
+    depthCopy->setCullingActive(false);
+
+    // Protect the copy state from the shadow camera overrides, and draw 
+    // the copy before everything else.
+    osg::StateSet* ss = depthCopy->getOrCreateStateSet();
+    osg::Program* program = new osg::Program;
+    program->addShader(new osg::Shader(osg::Shader::VERTEX, sFullScreenQuadVertexShader));
+    program->addShader(new osg::Shader(osg::Shader::FRAGMENT, sDepthCopyFragmentShader));
+    ss->setAttributeAndModes(program, osg::StateAttribute::ON | osg::StateAttribute::PROTECTED);
+    ss->setTextureAttributeAndModes(0, myStaticTexture.get(), osg::StateAttribute::ON | osg::StateAttribute::PROTECTED);
+    ss->addUniform(new osg::Uniform("staticDepth", 0));
+    ss->setAttributeAndModes(new osg::Depth(osg::Depth::ALWAYS), osg::StateAttribute::ON | osg::StateAttribute::PROTECTED);
+    ss->setMode(GL_CULL_FACE, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+    ss->setMode(GL_POLYGON_OFFSET_FILL, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+    ss->setRenderBinDetails(-1, "RenderBin");
+
+    _camera->setCullCallback(new DynamicCasterCullCallback(this, depthCopy));
+
+    myStaticDirty = true;
+    myStaticBounds.init();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::cullStaticCasters(osgUtil::CullVisitor& cv, unsigned int traversalMask)
+{
+    if(myStaticCastersVersion != sStaticCastersVersion ||
+        !matricesEquivalent(myStaticViewMatrix, _camera->getViewMatrix()) ||
+        !matricesEquivalent(myStaticProjectionMatrix, _camera->getProjectionMatrix()))
+    {
+        myStaticDirty = true;
+    }
+
+    if(myStaticDirty)
+    {
+        myStaticDirty = false;
+        myStaticCastersVersion = sStaticCastersVersion;
+        myStaticViewMatrix = _camera->getViewMatrix();
+        myStaticProjectionMatrix = _camera->getProjectionMatrix();
+
+        myStaticCamera->setViewMatrix(myStaticViewMatrix);
+        myStaticCamera->setProjectionMatrix(myStaticProjectionMatrix);
+        cv.setTraversalMask(traversalMask & StaticCasterTraversalMask);
+        myStaticCamera->accept(cv);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::initCube()
+{
+    // Faces are laid out in a 3x2 grid: +X -X +Y in the bottom row,
+    // -Y +Z -Z in the top row.
+    int w = _textureSize.x();
+    int h = _textureSize.y();
+    myCubeTexture = new osg::Texture2D;
+    myCubeTexture->setTextureSize(w * 3, h * 2);
+    myCubeTexture->setInternalFormat(GL_DEPTH_COMPONENT);
+    myCubeTexture->setShadowComparison(true);
+    myCubeTexture->setShadowTextureMode(osg::Texture::LUMINANCE);
+    myCubeTexture->setFilter(osg::Texture::MIN_FILTER,osg::Texture::LINEAR);
+    myCubeTexture->setFilter(osg::Texture::MAG_FILTER,osg::Texture::LINEAR);
+    myCubeTexture->setWrap(osg::Texture::WRAP_S,osg::Texture::CLAMP_TO_EDGE);
+    myCubeTexture->setWrap(osg::Texture::WRAP_T,osg::Texture::CLAMP_TO_EDGE);
+
+    for(int i = 0; i < 6; i++)
+    {
+        osg::Camera* camera = createShadowCamera();
+        camera->setViewport((i % 3) * w, (i / 3) * h, w, h);
+        camera->attach(osg::Camera::DEPTH_BUFFER, myCubeTexture.get());
+        myCubeCameras[i] = camera;
+        myCubeFaceEmpty[i] = true;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::cullCube(osgUtil::CullVisitor& cv, const osg::Vec3& lightPos, const osg::BoundingBox& bb, bool needShadowRefresh)
+{
+    // Faces are fit and rendered together, once per frame. Other views, and
+    // frames that do not refresh the shadows, keep using the face crop and
+    // matrices matching the stored depth.
+    myContextRenderLock.lock();
+    if(needShadowRefresh)
+    {
+        unsigned int frame = cv.getFrameStamp() ? cv.getFrameStamp()->getFrameNumber() : 0;
+        if(!myCubeFit || myCubeFitFrame != frame)
+        {
+            fitCube(lightPos, bb);
+            myCubeFit = true;
+            myCubeFitFrame = frame;
+        }
+    }
+    osg::Vec3 origin = myCubeLightPosition;
+    myContextRenderLock.unlock();
+
+    if(needShadowRefresh)
+    {
+        for(int f = 0; f < 6; f++) 
+        {
+            if(!myCubeFaceEmpty[f]) myCubeCameras[f]->accept(cv);
+        }
+        myDirty = false;
+    }
+
+    // The texture coordinates of each view are positions relative to the 
+    // light at the last refresh. Positional state belongs to the view render
+    // stage, so each view (and stereo eye) gets its own.
+    _texgen->setMode(osg::TexGen::EYE_LINEAR);
+    _texgen->setPlanesFromMatrix(osg::Matrix::identity());
+    osg::RefMatrix* refMatrix = new osg::RefMatrix(
+        osg::Matrix::translate(origin) * *cv.getModelViewMatrix());
+    cv.getRenderStage()->getPositionalStateContainer()->
+         addPositionedTextureAttribute( _shadowTextureUnit, refMatrix, _texgen.get() );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::fitCube(const osg::Vec3& lightPos, const osg::BoundingBox& bb)
+{
+    static const osg::Vec3 faceDirs[6] = {
+        osg::Vec3(1, 0, 0), osg::Vec3(-1, 0, 0),
+        osg::Vec3(0, 1, 0), osg::Vec3(0, -1, 0),
+        osg::Vec3(0, 0, 1), osg::Vec3(0, 0, -1) };
+    static const osg::Vec3 faceUps[6] = {
+        osg::Vec3(0, -1, 0), osg::Vec3(0, -1, 0),
+        osg::Vec3(0, 0, 1), osg::Vec3(0, 0, -1),
+        osg::Vec3(0, -1, 0), osg::Vec3(0, -1, 0) };
+
+    myCubeLightPosition = lightPos;
+    osg::Matrix bias = osg::Matrix::translate(1.0,1.0,1.0) * osg::Matrix::scale(0.5f,0.5f,0.5f);
+
+    // Depth range covering all casters.
+    float zFar = 0;
+    for(int i = 0; i < 8; i++) zFar = std::max(zFar, (bb.corner(i) - lightPos).length());
+    float zNear = std::max(zFar * 0.001f, 0.01f);
+    if(zFar <= zNear) zFar = zNear * 2;
+
+    // Skipped faces map everything outside the face, where the shader 
+    // considers fragments lit.
+    osg::Matrixf emptyFace = osg::Matrixf::scale(0, 0, 0) * osg::Matrixf::translate(-1, -1, 0);
+
+    osg::Matrix proj = osg::Matrix::perspective(90.0, 1.0, zNear, zFar);
+    for(int f = 0; f < 6; f++)
+    {
+        osg::Matrix view = osg::Matrix::lookAt(lightPos, lightPos + faceDirs[f], faceUps[f]);
+        osg::Matrix viewProj = view * proj;
+
+        // Clip the caster bounds against the face frustum. If all corners 
+        // are outside one of the frustum planes, the face has no casters.
+        int outside[6] = {0, 0, 0, 0, 0, 0};
+        bool behind = false;
+        float x0 = 1, y0 = 1, x1 = -1, y1 = -1;
+        for(int i = 0; i < 8; i++)
+        {
+            osg::Vec4 c = osg::Vec4(bb.corner(i), 1.0f) * viewProj;
+            if(c.x() > c.w()) outside[0]++;
+            if(c.x() < -c.w()) outside[1]++;
+            if(c.y() > c.w()) outside[2]++;
+            if(c.y() < -c.w()) outside[3]++;
+            if(c.z() > c.w()) outside[4]++;
+            if(c.z() < -c.w()) outside[5]++;
+            if(c.w() <= zNear) 
+            {
+                behind = true;
+            }
+            else
+            {
+                x0 = std::min(x0, c.x() / c.w());
+                x1 = std::max(x1, c.x() / c.w());
+                y0 = std::min(y0, c.y() / c.w());
+                y1 = std::max(y1, c.y() / c.w());
+            }
+        }
+        bool empty = false;
+        for(int p = 0; p < 6; p++) if(outside[p] == 8) empty = true;
+        myCubeFaceEmpty[f] = empty;
+        if(empty)
+        {
+            myCubeMatricesUniform->setElement(f, emptyFace);
+            continue;
+        }
+
+        // Crop the face projection to the caster bounds, so the face 
+        // resolution is only spent where casters are. Corners behind the 
+        // light make the projected bounds unbounded: use the full face.
+        osg::Matrix faceProj = proj;
+        if(!behind)
+        {
+            x0 = std::max(x0, -1.0f); x1 = std::min(x1, 1.0f);
+            y0 = std::max(y0, -1.0f); y1 = std::min(y1, 1.0f);
+            if(x1 > x0 && y1 > y0)
+            {
+                faceProj = proj * 
+                    osg::Matrix::scale(2.0 / (x1 - x0), 2.0 / (y1 - y0), 1.0) *
+                    osg::Matrix::translate(-(x1 + x0) / (x1 - x0), -(y1 + y0) / (y1 - y0), 0.0);
+            }
+        }
+
+        osg::Camera* camera = myCubeCameras[f].get();
+        camera->setViewMatrix(view);
+        camera->setProjectionMatrix(faceProj);
+
+        // Matrix taking positions relative to the light to this face texture
+        // space. It does not depend on the view, so all views share it.
+        myCubeMatricesUniform->setElement(f, osg::Matrixf(
+            osg::Matrix::translate(lightPos) * view * faceProj * bias));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::Camera* ShadowMapGenerator::createShadowCamera()
+{
+    // Create an additional render to texture camera, sharing the depth pass 
+    // state of the main shadow camera. The caller attaches the target.
+    osg::Camera* camera = new osg::Camera;
+    camera->setReferenceFrame(osg::Camera::ABSOLUTE_RF_INHERIT_VIEWPOINT);
+    camera->setCullCallback(new CameraCullCallback(this));
+    camera->setClearMask(GL_DEPTH_BUFFER_BIT);
+    camera->setClearColor(osg::Vec4(1.0f,1.0f,1.0f,1.0f));
+    camera->setComputeNearFarMode(osg::Camera::DO_NOT_COMPUTE_NEAR_FAR);
+    camera->setViewport(0,0,_textureSize.x(),_textureSize.y());
+    camera->setRenderOrder(osg::Camera::PRE_RENDER);
+    camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+    camera->setStateSet(_camera->getOrCreateStateSet());
+    return camera;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::cullAtlas(osgUtil::CullVisitor& cv, bool needShadowRefresh)
+{
+    if(needShadowRefresh)
+    {
+        myDirty = false;
+        myAtlasCamera->setViewMatrix(_camera->getViewMatrix());
+        myAtlasCamera->setProjectionMatrix(_camera->getProjectionMatrix());
+        // NOTE: the camera viewport only covers our atlas rectangle, and 
+        // depth clears are limited to the viewport, so other shadow maps in
+        // the atlas are preserved.
+        myAtlasCamera->accept(cv);
+
+        // Matrix taking scene positions to the light frustum, in [0,1]. It
+        // only changes with the stored depth, and does not depend on the 
+        // view, so all views share it. The shader maps it to our rectangle.
+        myAtlasMatrices->setElement(myAtlasSlot, osg::Matrixf(
+            _camera->getViewMatrix() * _camera->getProjectionMatrix() *
+            osg::Matrix::translate(1.0,1.0,1.0) * osg::Matrix::scale(0.5f,0.5f,0.5f)));
+    }
+
+    // Each view (and stereo eye) gets its own scene positions, through 
+    // positional state of its render stage.
+    osg::RefMatrix* refMatrix = new osg::RefMatrix(*cv.getModelViewMatrix());
+    cv.getRenderStage()->getPositionalStateContainer()->
+         addPositionedTextureAttribute( myAtlasTextureUnit, refMatrix, myAtlasTexGen.get() );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::cullCascades(osgUtil::CullVisitor& cv, const osg::Vec3& lightDirection, const osg::BoundingBox& bb, bool needShadowRefresh)
+{
+    // Cascades are fit and rendered together, once per frame. Other views,
+    // and frames that do not refresh the shadows, keep using the cascades
+    // matching the stored depth.
+    myContextRenderLock.lock();
+    if(needShadowRefresh)
+    {
+        unsigned int frame = cv.getFrameStamp() ? cv.getFrameStamp()->getFrameNumber() : 0;
+        if(!myCascadesFit || myCascadeFitFrame != frame)
+        {
+            fitCascades(cv, lightDirection, bb);
+            myCascadesFit = true;
+            myCascadeFitFrame = frame;
+        }
+    }
+    osg::Vec3 origin = myCascadeOrigin;
+    myContextRenderLock.unlock();
+
+    if(needShadowRefresh)
+    {
+        unsigned int traversalMask = cv.getTraversalMask();
+        cv.setTraversalMask( traversalMask &
+            getShadowedScene()->getCastsShadowTraversalMask() );
+        for(int c = 0; c < myCascades; c++) myCascadeCameras[c]->accept(cv);
+        myDirty = false;
+        cv.setTraversalMask( traversalMask );
+    }
+
+    // The texture coordinates of each view are positions relative to the 
+    // cascades origin. Positional state belongs to the view render stage, 
+    // so each view (and stereo eye) gets its own.
+    _texgen->setMode(osg::TexGen::EYE_LINEAR);
+    _texgen->setPlanesFromMatrix(osg::Matrix::identity());
+    osg::RefMatrix* refMatrix = new osg::RefMatrix(
+        osg::Matrix::translate(origin) * *cv.getModelViewMatrix());
+    cv.getRenderStage()->getPositionalStateContainer()->
+         addPositionedTextureAttribute( _shadowTextureUnit, refMatrix, _texgen.get() );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::fitCascades(osgUtil::CullVisitor& cv, const osg::Vec3& lightDirection, const osg::BoundingBox& bb)
+{
+    osg::Vec3 lightDir = lightDirection;
+    lightDir.normalize();
+
+    // Find the view frustum corners on the near plane, in eye space. For
+    // perspective projections, rays through these corners go through the
+    // eye, so we can get the frustum corners at any depth by scaling them.
+    osg::Matrix invProj;
+    invProj.invert(*cv.getProjectionMatrix());
+    osg::Vec3 nearCorners[4];
+    for(int i = 0; i < 4; i++)
+    {
+        nearCorners[i] = osg::Vec3((i & 1) ? 1 : -1, (i & 2) ? 1 : -1, -1) * invProj;
+    }
+    float zNear = -nearCorners[0].z();
+    float zFar = -(osg::Vec3(1, 1, 1) * invProj).z();
+    float maxDistance = zFar;
+    if(myCascadeMaxDistance > 0 && myCascadeMaxDistance < zFar) maxDistance = myCascadeMaxDistance;
+
+    // Cascades are spheres around the viewer instead of sections of the
+    // view frustum. They do not depend on the view direction, so they work
+    // for all tiles and eyes sharing the viewer position. Fragments use the
+    // first cascade containing them.
+    osg::Matrix eyeToWorld;
+    eyeToWorld.invert(*cv.getModelViewMatrix());
+    osg::Vec3 center = osg::Vec3(0, 0, 0) * eyeToWorld;
+    myCascadeOrigin = center;
+
+    osg::Matrix bias = osg::Matrix::translate(1.0,1.0,1.0) * osg::Matrix::scale(0.5f,0.5f,0.5f);
+    for(int c = 0; c < myCascades; c++)
+    {
+        // Practical split scheme: blend logarithmic and uniform splits.
+        float t = (float)(c + 1) / myCascades;
+        float logSplit = zNear * powf(maxDistance / zNear, t);
+        float uniformSplit = zNear + (maxDistance - zNear) * t;
+        float splitFar = mySplitLambda * logSplit + (1.0f - mySplitLambda) * uniformSplit;
+
+        // The sphere reaches the frustum corners at the split distance.
+        float radius = 0;
+        for(int i = 0; i < 4; i++)
+        {
+            float nz = -nearCorners[i].z();
+            radius = osg::maximum(radius, (nearCorners[i] * (splitFar / nz)).length());
+        }
+        // Quantize the radius to filter out floating point noise.
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        // Move the cascade camera back along the light direction, far 
+        // enough to include all casters between the light and the sphere.
+        float backDistance = radius * 2;
+        if(bb.valid()) backDistance = radius + (bb.center() - center).length() + bb.radius();
+
+        osg::Vec3 position = center + lightDir * backDistance;
+        osg::Matrix view = osg::Matrix::lookAt(position, center, computeOrthogonalVector(lightDir));
+        osg::Matrix proj = osg::Matrix::ortho(-radius, radius, -radius, radius, 0.0, backDistance + radius);
+
+        // Snap the projection to shadow map texels, so shadow edges stay
+        // still when the viewer moves.
+        osg::Vec3 origin = osg::Vec3(0, 0, 0) * view * proj;
+        float halfWidth = _textureSize.x() * 0.5f;
+        float halfHeight = _textureSize.y() * 0.5f;
+        float dx = (floorf(origin.x() * halfWidth + 0.5f) - origin.x() * halfWidth) / halfWidth;
+        float dy = (floorf(origin.y() * halfHeight + 0.5f) - origin.y() * halfHeight) / halfHeight;
+        proj = proj * osg::Matrix::translate(dx, dy, 0);
+
+        osg::Camera* camera = myCascadeCameras[c].get();
+        camera->setViewMatrix(view);
+        camera->setProjectionMatrix(proj);
+
+        // Matrix taking positions relative to the cascades origin to this
+        // cascade texture space.
+        myCascadeMatricesUniform->setElement(c, 
+            osg::Matrixf(osg::Matrix::translate(center) * view * proj * bias));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::BoundingBox ShadowMapGenerator::getCasterBounds(osgUtil::CullVisitor& cv)
+{
+    unsigned int mask = getShadowedScene()->getCastsShadowTraversalMask();
+    const osg::FrameStamp* fs = cv.getFrameStamp();
+
+    osg::BoundingBox bb;
+    for(unsigned int i = 0; i < _shadowedScene->getNumChildren(); i++)
+    {
+        osg::Node* child = _shadowedScene->getChild(i);
+
+        // No frame information: we can't cache bounds.
+        if(fs == NULL)
+        {
+            osg::ComputeBoundsVisitor cbbv(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN);
+            cbbv.setTraversalMask(mask);
+            child->accept(cbbv);
+            bb.expandBy(cbbv.getBoundingBox());
+            continue;
+        }
+
+        unsigned int frameNumber = fs->getFrameNumber();
+        sCasterBoundsCacheLock.lock();
+        // On a new frame, drop entries that have not been used in the last 
+        // frame (i.e. nodes that have been removed from the scene).
+        if(frameNumber != sCasterBoundsCacheFrame)
+        {
+            CasterBoundsCache::iterator it = sCasterBoundsCache.begin();
+            while(it != sCasterBoundsCache.end())
+            {
+                if(it->second.frameNumber + 1 < frameNumber) sCasterBoundsCache.erase(it++);
+                else ++it;
+            }
+            sCasterBoundsCacheFrame = frameNumber;
+        }
+
+        CasterBoundsCache::iterator it = sCasterBoundsCache.find(child);
+        if(it != sCasterBoundsCache.end() && it->second.frameNumber == frameNumber)
+        {
+            bb.expandBy(it->second.bounds);
+            sCasterBoundsCacheLock.unlock();
+            continue;
+        }
+        sCasterBoundsCacheLock.unlock();
+
+        // Bounds not computed yet for this frame: compute them now.
+        osg::ComputeBoundsVisitor cbbv(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN);
+        cbbv.setTraversalMask(mask);
+        child->accept(cbbv);
+
+        CasterBoundsCacheEntry entry;
+        entry.frameNumber = frameNumber;
+        entry.bounds = cbbv.getBoundingBox();
+
+        sCasterBoundsCacheLock.lock();
+        sCasterBoundsCache[child] = entry;
+        sCasterBoundsCacheLock.unlock();
+
+        bb.expandBy(entry.bounds);
+    }
+    return bb;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ShadowMapGenerator::isRenderedOnContext(osgUtil::CullVisitor& cv)
+{
+    if(cv.getState() == NULL || cv.getFrameStamp() == NULL) return false;
+
+    unsigned int contextId = cv.getState()->getContextID();
+    unsigned int frame = cv.getFrameStamp()->getFrameNumber();
+
+    bool rendered = false;
+    myContextRenderLock.lock();
+    std::map<unsigned int, unsigned int>::iterator it = myContextRenderFrame.find(contextId);
+    if(it != myContextRenderFrame.end() && it->second == frame) rendered = true;
+    else myContextRenderFrame[contextId] = frame;
+    myContextRenderLock.unlock();
+    return rendered;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::BoundingSphere ShadowMapGenerator::getLightBounds(const osg::Light* light, const osg::Vec4& lightPos, const osg::Vec3& lightDir)
+{
+    // Directional lights and lights without attenuation reach everything.
+    if(lightPos.w() == 0 || myInfluenceRadius == FLT_MAX) return osg::BoundingSphere();
+
+    osg::Vec3 position(lightPos.x(), lightPos.y(), lightPos.z());
+    float r = myInfluenceRadius;
+
+    // For spot lights, use a sphere around the light cone when it is
+    // tighter than the full influence sphere. A sphere centered halfway
+    // along the cone axis contains the cone tip and the cone base rim.
+    float cutoff = light->getSpotCutoff();
+    if(cutoff < 90.0f)
+    {
+        float cosCutoff = cosf(osg::DegreesToRadians(cutoff));
+        if(cosCutoff > 0.25f)
+        {
+            float coneRadius = r * std::max(0.5f, sqrtf(1.25f - cosCutoff));
+            return osg::BoundingSphere(position + lightDir * (r * 0.5f), coneRadius);
+        }
+    }
+    return osg::BoundingSphere(position, r);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ShadowMapGenerator::setUnshadowed(osgUtil::CullVisitor& cv)
+{
+    // A matrix mapping every position to depth 0, so shadow comparisons
+    // always pass.
+    osg::Matrixf lit(
+        0, 0, 0, 0,
+        0, 0, 0, 0,
+        0, 0, 0, 0,
+        0, 0, 0, 1);
+
+    if(myAtlasCamera.valid())
+    {
+        myAtlasMatrices->setElement(myAtlasSlot, lit);
+    }
+    else if(myCascadeMatricesUniform != NULL)
+    {
+        // Map all positions outside the cascades. Cascades are fit again
+        // on the next refresh.
+        for(int c = 0; c < MaxCascades; c++) myCascadeMatricesUniform->setElement(c, lit);
+        myCascadesFit = false;
+    }
+    else if(myCubeTexture != NULL)
+    {
+        // Map all faces outside the face cells, like empty cube faces.
+        osg::Matrixf emptyFace = osg::Matrixf::scale(0, 0, 0) * osg::Matrixf::translate(-1, -1, 0);
+        for(int f = 0; f < 6; f++) myCubeMatricesUniform->setElement(f, emptyFace);
+        myCubeFit = false;
+    }
+    else
+    {
+        _texgen->setMode(osg::TexGen::EYE_LINEAR);
+        _texgen->setPlanesFromMatrix(lit);
+        osg::RefMatrix * refMatrix = new osg::RefMatrix(*cv.getModelViewMatrix());
+        cv.getRenderStage()->getPositionalStateContainer()->
+             addPositionedTextureAttribute( _shadowTextureUnit, refMatrix, _texgen.get() );
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void ShadowMapGenerator::cull(osgUtil::CullVisitor& cv)
 {
@@ -337,6 +1386,55 @@ void ShadowMapGenerator::cull(osgUtil::CullVisitor& cv)
     lightDir = osg::Matrix::transform3x3( lightDir, eyeToWorld );
     lightDir.normalize();
 
+    if(selectLight)
+    {
+        osg::BoundingSphere lightBounds = getLightBounds(selectLight, lightpos, lightDir);
+        if(lightBounds.valid())
+        {
+            // Condition 4: if no caster is within reach of the light, there 
+            // is nothing to render. Make shadow lookups pass instead of
+            // keeping stale shadows around.
+            osg::BoundingBox bb = getCasterBounds(cv);
+            if(!bb.valid() || !sphereIntersectsBox(lightBounds, bb))
+            {
+                if(needShadowRefresh) countShadowPass(cv.getFrameStamp(), false);
+                setUnshadowed(cv);
+                // Refresh as soon as casters get within reach again.
+                setDirty();
+                return;
+            }
+
+            // Condition 5: skip the shadow pass if the light volume is 
+            // outside the view frustum. The light does not affect anything
+            // visible in this view. We skip far plane culling, since the far
+            // depth partition uses the shadow map rendered by the near one.
+            if(needShadowRefresh)
+            {
+                osg::Polytope frustum;
+                frustum.setToUnitFrustum(true, false);
+                frustum.transformProvidingInverse(
+                    (*cv.getModelViewMatrix()) * (*cv.getProjectionMatrix()));
+                if(!frustum.contains(lightBounds))
+                {
+                    countShadowPass(cv.getFrameStamp(), false);
+                    needShadowRefresh = false;
+                }
+            }
+        }
+    }
+
+    // Condition 6: render the shadow map once per frame on each graphics 
+    // context. Other views drawn on the same context (tiles, additional 
+    // cameras) reuse it, since the light camera does not depend on the view.
+    // Cascades are fit once per frame around the viewer, for the same reason.
+    // NOTE: this check comes after light culling: views that skip the shadow
+    // pass do not mark it as rendered for other views on the context.
+    if(needShadowRefresh && isRenderedOnContext(cv))
+    {
+        needShadowRefresh = false;
+    }
+    if(needShadowRefresh) countShadowPass(cv.getFrameStamp(), true);
+
     if (selectLight)
     {
         float fov = selectLight->getSpotCutoff() * 2;
@@ -349,12 +1447,22 @@ void ShadowMapGenerator::cull(osgUtil::CullVisitor& cv)
         else
         {
             // get the bounds of the model.
-            osg::ComputeBoundsVisitor cbbv(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN);
-            cbbv.setTraversalMask(getShadowedScene()->getCastsShadowTraversalMask());
-
-            _shadowedScene->osg::Group::traverse(cbbv);
+            osg::BoundingBox bb = getCasterBounds(cv);
 
-            osg::BoundingBox bb = cbbv.getBoundingBox();
+            if(myStaticCamera.valid())
+            {
+                // Keep the camera fit stable while casters stay inside the 
+                // previous bounds, so the static cache stays valid. Leave
+                // some room for dynamic casters to move.
+                if(myStaticCastersVersion != sStaticCastersVersion || 
+                    !myStaticBounds.valid() ||
+                    !myStaticBounds.contains(bb._min) || !myStaticBounds.contains(bb._max))
+                {
+                    osg::Vec3 margin = (bb._max - bb._min) * 0.1f;
+                    myStaticBounds.set(bb._min - margin, bb._max + margin);
+                }
+                bb = myStaticBounds;
+            }
 
             if (lightpos[3]!=0.0)   // point light
             {
@@ -372,6 +1480,20 @@ void ShadowMapGenerator::cull(osgUtil::CullVisitor& cv)
 
                 _camera->setProjectionMatrixAsFrustum(-right,right,-top,top,znear,zfar);
                 _camera->setViewMatrixAsLookAt(position,bb.center(),computeOrthogonalVector(bb.center()-position));
+
+                if(myCubeTexture != NULL && !myAtlasCamera.valid())
+                {
+                    cv.setTraversalMask( traversalMask &
+                        getShadowedScene()->getCastsShadowTraversalMask() );
+                    cullCube(cv, position, bb, needShadowRefresh);
+                    cv.setTraversalMask( traversalMask );
+                    return;
+                }
+            }
+            else if(myCascadeTexture != NULL && !myAtlasCamera.valid())    // directional light, cascaded
+            {
+                cullCascades(cv, osg::Vec3(lightpos.x(), lightpos.y(), lightpos.z()), bb, needShadowRefresh);
+                return;
             }
             else    // directional light
             {
@@ -400,13 +1522,34 @@ void ShadowMapGenerator::cull(osgUtil::CullVisitor& cv)
         cv.setTraversalMask( traversalMask &
             getShadowedScene()->getCastsShadowTraversalMask() );
 
+        if(myAtlasCamera.valid())
+        {
+            cullAtlas(cv, needShadowRefresh);
+            cv.setTraversalMask( traversalMask );
+            return;
+        }
+
         if(needShadowRefresh)
         {
             myDirty = false;
+            if(myStaticCamera.valid())
+            {
+                // Render the static casters if needed, then only the dynamic
+                // ones on top of them.
+                cullStaticCasters(cv, traversalMask);
+                cv.setTraversalMask( traversalMask & DynamicCasterTraversalMask );
+            }
             // NOTE: Camera accept will use the ShadowTechnique::CameraCallback
             // registered during init to traverse the rest of the scene attached
             // to the ShadowedScene object
             _camera->accept(cv);
+
+            if(myBlurCameras[0].valid())
+            {
+                // Blur the moments and generate the shadow texture mipmaps.
+                myBlurCameras[0]->accept(cv);
+                myBlurCameras[1]->accept(cv);
+            }
         }
 
         _texgen->setMode(osg::TexGen::EYE_LINEAR);
@@ -73,7 +73,7 @@ public:
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 Skybox::Skybox():
-	myTexture(NULL), myNode(NULL), myRootStateSet(NULL)
+	myTexture(NULL), myNode(NULL), myRootStateSet(NULL), myProgramsVersion(-1)
 {
 	// Allocate and delete MoveSkyWithEyePointTransform, since we can't use Ref<> inside the Skybox header 
 	// (because MoveSkyWithEyePointTransform is defined within this file)
@@ -184,6 +184,22 @@ osg::Node* Skybox::createSkyBox()
 	return NULL;
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void Skybox::update()
+{
+	if(myGeode == NULL || myProgramsVersion == SceneManager::instance()->getProgramsVersion()) return;
+
+	ProgramAsset* cubeMapProgram = SceneManager::instance()->getOrCreateProgram(
+		"skybox-cube", 
+		"cyclops/common/skybox.vert", 
+		"cyclops/common/skybox.frag");
+	myProgramsVersion = SceneManager::instance()->getProgramsVersion();
+	if(cubeMapProgram != NULL)
+	{
+		myGeode->getOrCreateStateSet()->setAttributeAndModes(cubeMapProgram->program, osg::StateAttribute::ON);
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 void Skybox::updateSkyBox()
 {
@@ -198,6 +214,8 @@ void Skybox::updateSkyBox()
 			"cyclops/common/skybox.vert", 
 			"cyclops/common/skybox.frag");
 
+		myProgramsVersion = sm->getProgramsVersion();
+
 		osg::StateSet* stateset = myGeode->getOrCreateStateSet();
 		if(cubeMapProgram != NULL)
 		{
@@ -123,15 +123,42 @@ namespace cyclops
 
         // LightingLayer
         PYAPI_REF_CLASS_WITH_CTOR(LightingLayer, SceneLayer)
+            PYAPI_METHOD(LightingLayer, setMaxLightsPerEntity)
+            PYAPI_METHOD(LightingLayer, getMaxLightsPerEntity)
+            PYAPI_METHOD(LightingLayer, setShadowRefreshBudget)
+            PYAPI_METHOD(LightingLayer, getShadowRefreshBudget)
+            PYAPI_METHOD(LightingLayer, setShadowAtlasEnabled)
+            PYAPI_METHOD(LightingLayer, isShadowAtlasEnabled)
+            PYAPI_METHOD(LightingLayer, setShadowAtlasSize)
+            PYAPI_METHOD(LightingLayer, getShadowAtlasSize)
             ;
 
         // CompositingLayer
         PYAPI_REF_CLASS_WITH_CTOR(CompositingLayer, SceneLayer)
             PYAPI_METHOD(CompositingLayer, reset)
             PYAPI_METHOD(CompositingLayer, loadCompositor)
+            PYAPI_METHOD(CompositingLayer, reloadCompositor)
+            PYAPI_METHOD(CompositingLayer, getNumCompositorInstances)
+            PYAPI_METHOD(CompositingLayer, setHotReloadEnabled)
+            PYAPI_METHOD(CompositingLayer, isHotReloadEnabled)
+            PYAPI_METHOD(CompositingLayer, setTechnique)
+            PYAPI_METHOD(CompositingLayer, getTechnique)
+            PYAPI_METHOD(CompositingLayer, isNormalDepthOutputEnabled)
             PYAPI_METHOD(CompositingLayer, isPassActive)
             PYAPI_METHOD(CompositingLayer, setPassActive)
             PYAPI_REF_GETTER(CompositingLayer, getUniform)
+            PYAPI_METHOD(CompositingLayer, setDynamicResolutionEnabled)
+            PYAPI_METHOD(CompositingLayer, isDynamicResolutionEnabled)
+            PYAPI_METHOD(CompositingLayer, setTargetFrameTime)
+            PYAPI_METHOD(CompositingLayer, getTargetFrameTime)
+            PYAPI_METHOD(CompositingLayer, setMinResolutionScale)
+            PYAPI_METHOD(CompositingLayer, getMinResolutionScale)
+            PYAPI_METHOD(CompositingLayer, getResolutionScale)
+            PYAPI_METHOD(CompositingLayer, setProfilingEnabled)
+            PYAPI_METHOD(CompositingLayer, isProfilingEnabled)
+            PYAPI_METHOD(CompositingLayer, getProfile)
+            PYAPI_METHOD(CompositingLayer, getPassCullTime)
+            PYAPI_METHOD(CompositingLayer, getPassGpuTime)
             ;
 
         // SceneManager
@@ -281,6 +308,8 @@ namespace cyclops
             PYAPI_REF_GETTER(Entity, getLayer)
             PYAPI_METHOD(Entity, castShadow)
             PYAPI_METHOD(Entity, doesCastShadow)
+            PYAPI_METHOD(Entity, setStaticShadowCaster)
+            PYAPI_METHOD(Entity, isStaticShadowCaster)
             PYAPI_METHOD(Entity, hasEffect)
             PYAPI_METHOD(Entity, setEffect)
             PYAPI_REF_GETTER(Entity, getMaterial)
@@ -382,7 +411,9 @@ namespace cyclops
         PYAPI_ENUM(Light::ShadowRefreshMode, ShadowRefreshMode)
             PYAPI_ENUM_VALUE(Light, OnFrame)
             PYAPI_ENUM_VALUE(Light, OnLightMove)
-            PYAPI_ENUM_VALUE(Light, Manual);
+            PYAPI_ENUM_VALUE(Light, Manual)
+            PYAPI_ENUM_VALUE(Light, StaticCached)
+            PYAPI_ENUM_VALUE(Light, Scheduled);
 
         // ShadowMap
         PYAPI_REF_BASE_CLASS_WITH_CTOR(ShadowMap)
@@ -391,6 +422,15 @@ namespace cyclops
             PYAPI_METHOD(ShadowMap, isSoft)
             PYAPI_METHOD(ShadowMap, setSoftShadowParameters)
             PYAPI_METHOD(ShadowMap, setDirty)
+            PYAPI_METHOD(ShadowMap, setOmnidirectional)
+            PYAPI_METHOD(ShadowMap, isOmnidirectional)
+            PYAPI_METHOD(ShadowMap, setFilterable)
+            PYAPI_METHOD(ShadowMap, isFilterable)
+            PYAPI_METHOD(ShadowMap, setFilterableShadowParameters)
+            PYAPI_METHOD(ShadowMap, setCascades)
+            PYAPI_METHOD(ShadowMap, getCascades)
+            PYAPI_METHOD(ShadowMap, setCascadeSplitLambda)
+            PYAPI_METHOD(ShadowMap, setCascadeMaxDistance)
             ;
 
         // ShadowMap
@@ -408,6 +448,8 @@ namespace cyclops
             PYAPI_REF_GETTER(Light, getLayer)
             PYAPI_METHOD(Light, setAttenuation)
             PYAPI_GETTER(Light, getAttenuation)
+            PYAPI_METHOD(Light, setInfluenceRadius)
+            PYAPI_METHOD(Light, getInfluenceRadius)
             PYAPI_METHOD(Light, getLightType)
             PYAPI_METHOD(Light, setLightType)
             PYAPI_METHOD(Light, getLightFunction)